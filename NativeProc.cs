@@ -1,4 +1,6 @@
 using System;
+using System.Buffers;
+using System.IO;
 using System.Runtime.InteropServices;
 using System.Text;
 using System.Threading;
@@ -7,8 +9,73 @@ using System.Threading.Tasks;
 public static class NativeProc
 {
     // ========= P/Invoke =========
-    [DllImport("procwrapper", EntryPoint = "start_process", CallingConvention = CallingConvention.Cdecl)]
-    private static extern int start_process([MarshalAs(UnmanagedType.LPStr)] string path, IntPtr argv);
+    // pw_redirect / pw_spawn_opts in procwrapper.c
+    [StructLayout(LayoutKind.Sequential)]
+    private struct NativeRedirect
+    {
+        public int    Kind;
+        public int    Fd;
+        public IntPtr Path;
+        public int    Flags;
+    }
+
+    [StructLayout(LayoutKind.Sequential)]
+    private struct SpawnOpts
+    {
+        public int            Size;
+        public int            Flags;
+        public IntPtr         Path;
+        public IntPtr         Argv;
+        public NativeRedirect Out;
+        public NativeRedirect Err;
+        public IntPtr         ArgvBlock;
+        public IntPtr         EnvBlock;
+        public IntPtr         Cwd;
+        public long           RlimitAs;
+        public long           RlimitCpu;
+        public int            Argc;
+        public int            Envc;
+        public int            Nice;
+        public int            PipeSize;
+        public long           TimeoutMs;
+        public long           CpuTimeoutMs;
+        public int            TimeoutGraceMs;
+        private int           _reserved;
+        public IntPtr         CpuAffinity;
+        public int            CpuAffinitySize;
+        public int            SchedPolicy;
+        public int            IoPriority;
+        private int           _reserved2;
+        public IntPtr         Cgroup;
+    }
+
+    [DllImport("procwrapper", EntryPoint = "start_process_ex", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int start_process_ex(ref SpawnOpts opts);
+
+    // specs: count SpawnOpts back to back; handles[i] = handle or -errno
+    [DllImport("procwrapper", EntryPoint = "start_processes", CallingConvention = CallingConvention.Cdecl)]
+    private static extern unsafe int start_processes(int count, SpawnOpts* specs, int* handles);
+
+    // stages: count SpawnOpts back to back, stage i's stdout feeding stage i+1's stdin
+    [DllImport("procwrapper", EntryPoint = "start_pipeline", CallingConvention = CallingConvention.Cdecl)]
+    private static extern unsafe int start_pipeline(int count, SpawnOpts* stages, int flags, int* handles);
+
+    // PW_PIPELINE_MONITOR
+    private const int PIPELINE_MONITOR = 0x1;
+
+    // errno start_pipeline fails with for stage options no pipeline can take
+    private const int EINVAL = 22;
+
+    [DllImport("procwrapper", EntryPoint = "map_output", CallingConvention = CallingConvention.Cdecl)]
+    private static extern IntPtr map_output(int handle, int stream, out long len);
+
+    [DllImport("procwrapper", EntryPoint = "release_output", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int release_output(int handle, int stream);
+
+    private const int REDIRECT_APPEND = 0x1;
+
+    // PW_START_CLEAR_ENV
+    private const int START_CLEAR_ENV = 0x8;
 
     [DllImport("procwrapper", EntryPoint = "read_stdout", CallingConvention = CallingConvention.Cdecl)]
     private static extern int read_stdout(int handle, IntPtr buffer, int buflen);
@@ -22,31 +89,479 @@ public static class NativeProc
     [DllImport("procwrapper", EntryPoint = "get_exit_code", CallingConvention = CallingConvention.Cdecl)]
     private static extern int get_exit_code(int handle);
 
+    [DllImport("procwrapper", EntryPoint = "watch_exit", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int watch_exit(int handle, IntPtr cb, IntPtr user);
+
+    [DllImport("procwrapper", EntryPoint = "get_exit_info", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int get_exit_info(int handle, out ExitInfo info);
+
+    [DllImport("procwrapper", EntryPoint = "get_proc_stats", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int get_proc_stats(int handle, ref ProcStats stats);
+
     [DllImport("procwrapper", EntryPoint = "stop_process", CallingConvention = CallingConvention.Cdecl)]
     private static extern int stop_process(int handle);
 
-    // ========= argv helpers =========
-    private static IntPtr BuildArgv(string[] parts) {
-        IntPtr[] ptrs = new IntPtr[parts.Length + 1];
-        for (int i = 0; i < parts.Length; i++) {
-            byte[] bytes = Encoding.UTF8.GetBytes(parts[i] + "\0");
-            IntPtr mem = Marshal.AllocHGlobal(bytes.Length);
-            Marshal.Copy(bytes, 0, mem, bytes.Length);
-            ptrs[i] = mem;
+    [DllImport("procwrapper", EntryPoint = "write_stdin", CallingConvention = CallingConvention.Cdecl)]
+    private static extern unsafe int write_stdin(int handle, byte* buf, int len);
+
+    [DllImport("procwrapper", EntryPoint = "close_stdin", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int close_stdin(int handle);
+
+    [DllImport("procwrapper", EntryPoint = "signal_process", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int signal_process(int handle, int sig, int group);
+
+    [DllImport("procwrapper", EntryPoint = "stop_process_async", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int stop_process_async(int handle, int grace_ms);
+
+    [DllImport("procwrapper", EntryPoint = "stop_all", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int stop_all(int grace_ms);
+
+    [DllImport("procwrapper", EntryPoint = "wait_events", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int wait_events(int handle, int timeout_ms, ref int mask);
+
+    [DllImport("procwrapper", EntryPoint = "subscribe_process", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int subscribe_process(int handle, IntPtr cb, IntPtr user);
+
+    [DllImport("procwrapper", EntryPoint = "unsubscribe_process", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int unsubscribe_process(int handle);
+
+    [DllImport("procwrapper", EntryPoint = "set_spawn_backend", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int set_spawn_backend(int backend);
+
+    [DllImport("procwrapper", EntryPoint = "get_spawn_backend", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int get_spawn_backend();
+
+    [DllImport("procwrapper", EntryPoint = "spawn_server_start", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int spawn_server_start();
+
+    [DllImport("procwrapper", EntryPoint = "spawn_server_stop", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int spawn_server_stop();
+
+    [DllImport("procwrapper", EntryPoint = "get_process_backend", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int get_process_backend(int handle);
+
+    [DllImport("procwrapper", EntryPoint = "get_slot_usage", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int get_slot_usage(out int inUse, out int capacity);
+
+    [DllImport("procwrapper", EntryPoint = "get_child_fd_count", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int get_child_fd_count(int handle);
+
+    [DllImport("procwrapper", EntryPoint = "procwrapper_last_error", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int procwrapper_last_error();
+
+    [DllImport("procwrapper", EntryPoint = "procwrapper_get_stats", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int procwrapper_get_stats(ref LibraryStats stats);
+
+    [DllImport("procwrapper", EntryPoint = "procwrapper_reset_stats", CallingConvention = CallingConvention.Cdecl)]
+    private static extern void procwrapper_reset_stats();
+
+    [DllImport("procwrapper", EntryPoint = "subscribe_process_ring", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int subscribe_process_ring(int handle, int ring_size, IntPtr cb, IntPtr user);
+
+    [DllImport("procwrapper", EntryPoint = "ring_resume", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int ring_resume(int handle, int stream);
+
+    [DllImport("procwrapper", EntryPoint = "pause_stream", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int pause_stream(int handle, int stream, int paused);
+
+    [DllImport("procwrapper", EntryPoint = "read_lines", CallingConvention = CallingConvention.Cdecl)]
+    private static extern unsafe int read_lines(int handle, int stream, byte* buf, int buflen, LineSpan* lines, int max_lines);
+
+    // pw_read_result in procwrapper.c
+    [StructLayout(LayoutKind.Sequential)]
+    private struct ReadResult
+    {
+        public IntPtr OutBuf;
+        public int    OutCap;
+        public int    OutLen;
+        public IntPtr ErrBuf;
+        public int    ErrCap;
+        public int    ErrLen;
+        public int    Done;     // EV_* bits: stream at EOF / child exited
+        public int    ExitCode;
+    }
+
+    [DllImport("procwrapper", EntryPoint = "read_streams", CallingConvention = CallingConvention.Cdecl)]
+    private static extern int read_streams(int handle, ref ReadResult result);
+
+    // pw_ring header offsets (must match procwrapper.c)
+    private const int RING_HEAD     = 0;
+    private const int RING_CAPACITY = 4;
+    private const int RING_STALLED  = 12;
+    private const int RING_TAIL     = 64;
+    private const int RING_DATA     = 128;
+
+    private const int LINE_CONTINUED = 0x1; // pw_line.flags PW_LINE_CONTINUED
+
+    // invoked on the native event loop thread
+    [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+    private delegate void NativeEventCallback(int handle, int evt, IntPtr data, int len, IntPtr user);
+
+    // invoked by whoever records the exit (normally the event loop), with the slot locked
+    [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+    private delegate void NativeExitCallback(int handle, IntPtr info, IntPtr user);
+
+    // pw_exit_info in procwrapper.c. Timestamps are CLOCK_MONOTONIC; CPU times and peak
+    // RSS come from the child's rusage (none for children of a spawn server that died).
+    [StructLayout(LayoutKind.Sequential)]
+    public readonly struct ExitInfo
+    {
+        public readonly int  ExitCode;
+        private readonly int _timedOut;
+        public readonly long StartNs;
+        public readonly long ExitNs;
+        public readonly long UserTimeUs;
+        public readonly long SystemTimeUs;
+        public readonly long MaxRssKb;
+        public readonly long SpawnNs;
+        public readonly long MinorFaults;
+        public readonly long MajorFaults;
+        public readonly long VoluntaryContextSwitches;
+        public readonly long InvoluntaryContextSwitches;
+        public readonly long StdoutStalls;
+        public readonly long StderrStalls;
+        public readonly long PipeSize;
+        public readonly long ExecNs; // fork-to-exec part of SpawnNs (fork backend), else 0
+
+        public TimeoutKind TimedOut => (TimeoutKind)_timedOut;
+        public TimeSpan WallTime => TimeSpan.FromTicks((ExitNs - StartNs) / 100);
+        public TimeSpan UserTime => TimeSpan.FromTicks(UserTimeUs * 10);
+        public TimeSpan SystemTime => TimeSpan.FromTicks(SystemTimeUs * 10);
+    }
+
+    // pw_proc_stats in procwrapper.c: final after the exit, live /proc counters before.
+    [StructLayout(LayoutKind.Sequential)]
+    public readonly struct ProcStats
+    {
+        private readonly int _size;
+        public readonly int  ExitCode; // -2 while running
+        public readonly long SpawnNs;  // spawn-to-exec
+        public readonly long RunNs;    // exec-to-exit (or to now)
+        public readonly long UserTimeUs;
+        public readonly long SystemTimeUs;
+        public readonly long MaxRssKb;
+        public readonly long MinorFaults;
+        public readonly long MajorFaults;
+        public readonly long VoluntaryContextSwitches;
+        public readonly long InvoluntaryContextSwitches;
+        public readonly long StdoutStalls; // reads that found the pipe full: the child was blocked on us
+        public readonly long StderrStalls;
+        public readonly long PipeSize;
+        public readonly long ExecNs;   // fork-to-exec part of SpawnNs (fork backend), else 0
+
+        internal ProcStats(int size) : this() => _size = size;
+
+        internal ProcStats(in ExitInfo e)
+        {
+            _size = Marshal.SizeOf<ProcStats>();
+            ExitCode = e.ExitCode;
+            SpawnNs = e.SpawnNs;
+            RunNs = e.ExitNs - e.StartNs;
+            UserTimeUs = e.UserTimeUs;
+            SystemTimeUs = e.SystemTimeUs;
+            MaxRssKb = e.MaxRssKb;
+            MinorFaults = e.MinorFaults;
+            MajorFaults = e.MajorFaults;
+            VoluntaryContextSwitches = e.VoluntaryContextSwitches;
+            InvoluntaryContextSwitches = e.InvoluntaryContextSwitches;
+            StdoutStalls = e.StdoutStalls;
+            StderrStalls = e.StderrStalls;
+            PipeSize = e.PipeSize;
+            ExecNs = e.ExecNs;
+        }
+
+        public bool HasExited => ExitCode != -2;
+        public TimeSpan SpawnTime => TimeSpan.FromTicks(SpawnNs / 100);
+        public TimeSpan ExecTime => TimeSpan.FromTicks(ExecNs / 100);
+        public TimeSpan RunTime => TimeSpan.FromTicks(RunNs / 100);
+        public TimeSpan CpuTime => TimeSpan.FromTicks((UserTimeUs + SystemTimeUs) * 10);
+    }
+
+    // pw_histogram in procwrapper.c: bucket 0 counts values under 1 us, bucket i values
+    // in [2^(i-1), 2^i) us, and the last one everything above.
+    [StructLayout(LayoutKind.Sequential)]
+    public unsafe struct LatencyHistogram
+    {
+        public const int BucketCount = 32; // PW_HIST_BUCKETS
+
+        private long _count;
+        private long _sumNs;
+        private long _maxNs;
+        private fixed long _buckets[BucketCount];
+
+        public long Count => _count;
+        public TimeSpan Mean => _count > 0 ? TimeSpan.FromTicks(_sumNs / _count / 100) : TimeSpan.Zero;
+        public TimeSpan Max => TimeSpan.FromTicks(_maxNs / 100);
+        public long this[int bucket] => (uint)bucket < BucketCount ? _buckets[bucket] : throw new ArgumentOutOfRangeException(nameof(bucket));
+
+        // Upper bound of the bucket holding the p-th percentile (0..100), capped at Max;
+        // the resolution is a factor of two.
+        public TimeSpan Percentile(double p)
+        {
+            if (_count == 0) return TimeSpan.Zero;
+            long rank = Math.Max(1, (long)Math.Ceiling(_count * Math.Clamp(p, 0, 100) / 100));
+            long seen = 0;
+            for (int i = 0; i < BucketCount - 1; ++i)
+            {
+                seen += _buckets[i];
+                if (seen >= rank) return TimeSpan.FromTicks(Math.Min((1L << i) * 10, _maxNs / 100));
+            }
+            return Max;
+        }
+
+        public override string ToString() =>
+            _count == 0 ? "n=0" : $"n={_count} mean={Mean.TotalMilliseconds:F3}ms p50<={Percentile(50).TotalMilliseconds:F3}ms " +
+                                  $"p99<={Percentile(99).TotalMilliseconds:F3}ms max={Max.TotalMilliseconds:F3}ms";
+    }
+
+    // pw_lib_stats in procwrapper.c: counters for the whole library since load (or
+    // ResetLibraryStats). Each field is read atomically, but not all of them at once.
+    [StructLayout(LayoutKind.Sequential)]
+    public struct LibraryStats
+    {
+        private int _size;
+        private int _reserved;
+        public long Spawns;
+        public long SpawnFailures;
+        public long ExecFailures;  // fork children whose exec failed
+        public long SpawnsFork;
+        public long SpawnsPosixSpawn;
+        public long SpawnsServer;
+        public long StdoutBytes;   // read from pipes, every read path
+        public long StderrBytes;
+        public long Reads;
+        public long ReadsEagain;   // reads that found the pipe empty
+        public long LockWaits;     // handle lock acquisitions that blocked
+        public long Reaps;
+        public LatencyHistogram Spawn;     // whole start call
+        public LatencyHistogram PipeSetup; // pipes, redirects, pipe sizing
+        public LatencyHistogram Fork;      // fork() in the parent (fork backend)
+        public LatencyHistogram Exec;      // launch-to-exec, per backend
+        public LatencyHistogram LockWait;
+        public LatencyHistogram Reap;      // exit noticed to recorded
+        public long RelayBytes;    // spliced between monitored pipeline stages
+        public long RelayDropped;  // ... of those, passed uncopied because the copy was full
+        public long Timeouts;      // children stopped for passing a deadline
+
+        internal LibraryStats(int size) : this() => _size = size;
+
+        public double EagainRate => Reads > 0 ? (double)ReadsEagain / Reads : 0;
+    }
+
+    // event loop event kinds (must match procwrapper.c)
+    private const int EVT_STDOUT = 1;
+    private const int EVT_STDERR = 2;
+    private const int EVT_EXIT   = 3;
+
+    // wait_events mask bits (must match procwrapper.c)
+    private const int EV_STDOUT = 0x1;
+    private const int EV_STDERR = 0x2;
+    private const int EV_EXIT   = 0x4;
+    private const int EV_STDIN  = 0x8;
+
+    // PW_START_STDIN (the group flags are ProcessGroupMode)
+    private const int START_STDIN = 0x4;
+
+    // values match PW_SPAWN_* in procwrapper.c
+    public enum SpawnBackend
+    {
+        Fork = 0,
+        PosixSpawn = 1,
+        Server = 2, // the spawn server (StartSpawnServer)
+    }
+
+    // PW_OUT_* in procwrapper.c
+    public enum OutputKind
+    {
+        Pipe = 0,   // read through OnStdoutLine etc. (default)
+        File = 1,
+        Fd = 2,
+        Memory = 3, // memfd; ProcessStream.MapOutput after the exit
+    }
+
+    // Where a child's stdout/stderr goes. Anything but Pipe bypasses the wrapper entirely.
+    public sealed class OutputRedirect
+    {
+        public OutputKind Kind { get; }
+        public string? Path { get; }
+        public int Fd { get; } = -1;
+        public bool Append { get; }
+
+        private OutputRedirect(OutputKind kind, string? path, int fd, bool append)
+        {
+            Kind = kind;
+            Path = path;
+            Fd = fd;
+            Append = append;
+        }
+
+        public static OutputRedirect ToFile(string path, bool append = false) =>
+            new OutputRedirect(OutputKind.File, path ?? throw new ArgumentNullException(nameof(path)), -1, append);
+
+        // fd stays owned by the caller; the child gets a duplicate
+        public static OutputRedirect ToFd(int fd) => new OutputRedirect(OutputKind.Fd, null, fd, false);
+
+        public static OutputRedirect ToMemory() => new OutputRedirect(OutputKind.Memory, null, -1, false);
+    }
+
+    // What happens to output beyond OutputLimits.
+    public enum OutputPolicy
+    {
+        Block,    // stop draining the pipe until the handler catches up; the child blocks
+        Truncate, // drop it (counted in OutputBytesDropped)
+        Spill,    // append it to a temp file instead (OutputBytesSpilled, *SpillPath)
+    }
+
+    // Caps on output held in managed memory, per stream. 0 = unlimited.
+    public sealed class OutputLimits
+    {
+        // Longest line kept, in chars. Block cannot wait out a single line, so there it
+        // splits the line into MaxLineLength pieces instead.
+        public int MaxLineLength { get; init; }
+
+        // Lines not yet handled, in bytes of managed memory. When set, line events are
+        // raised from a queue on the thread pool, so a slow handler holds back only its
+        // own child and never the reader thread or the shared event loop.
+        public long MaxBufferedBytes { get; init; }
+
+        public OutputPolicy Policy { get; init; } = OutputPolicy.Block;
+
+        // Where Spill files go (default: the temp directory). They are left for the caller.
+        public string? SpillDirectory { get; init; }
+    }
+
+    // path points at r.Path inside the packed block (or is zero)
+    private static NativeRedirect ToNative(OutputRedirect? r, IntPtr path) => r == null ? default : new NativeRedirect
+    {
+        Kind = (int)r.Kind,
+        Fd = r.Fd,
+        Path = path,
+        Flags = r.Append ? REDIRECT_APPEND : 0,
+    };
+
+    // PW_TIMEOUT_* in procwrapper.c: which deadline stopped a child
+    public enum TimeoutKind
+    {
+        None = 0,
+        WallClock = 1, // ProcessStream.Timeout
+        Cpu = 2,       // ProcessStream.CpuTimeout
+    }
+
+    // PW_SCHED_* in procwrapper.c
+    public enum SchedulingClass
+    {
+        Inherit = 0,
+        Batch = 1, // SCHED_BATCH: CPU-bound throughput work, never preempts on wakeup
+        Idle = 2,  // SCHED_IDLE: runs only on otherwise idle CPUs
+    }
+
+    // ioprio_set(2) classes
+    public enum IoPriorityClass
+    {
+        Inherit = 0,
+        Realtime = 1,
+        BestEffort = 2,
+        Idle = 3,
+    }
+
+    // PW_START_* in procwrapper.c
+    public enum ProcessGroupMode
+    {
+        None = 0,       // stay in our process group
+        NewGroup = 1,   // child leads its own process group
+        NewSession = 2, // child leads its own session (and group)
+    }
+
+    // Backend used for subsequent launches (posix_spawn where the platform has it).
+    public static SpawnBackend DefaultSpawnBackend
+    {
+        get => (SpawnBackend)get_spawn_backend();
+        set
+        {
+            if (set_spawn_backend((int)value) != 0)
+                throw new PlatformNotSupportedException($"spawn backend {value} is not available");
         }
-        ptrs[parts.Length] = IntPtr.Zero;
-        IntPtr argv = Marshal.AllocHGlobal(IntPtr.Size * ptrs.Length);
-        for (int i = 0; i < ptrs.Length; i++)
-            Marshal.WriteIntPtr(argv, i * IntPtr.Size, ptrs[i]);
-        return argv;
     }
 
-    private static void FreeArgv(IntPtr argv, int count) {
-        for (int i = 0; i < count; i++) {
-            IntPtr p = Marshal.ReadIntPtr(argv, i * IntPtr.Size);
-            if (p != IntPtr.Zero) Marshal.FreeHGlobal(p);
+    // Fork the native spawn server and launch through it from now on, so launch cost
+    // stops growing with our heap. Call early in startup, while the process is small;
+    // children see the environment as of this call unless EnvironmentVariables is set.
+    public static void StartSpawnServer()
+    {
+        if (spawn_server_start() != 0)
+            throw new InvalidOperationException("failed to start the spawn server");
+    }
+
+    // Back to spawning locally. Children the server still runs report exit code -1.
+    public static bool StopSpawnServer() => spawn_server_stop() == 0;
+
+    // SIGTERM every running child at once; the native event loop SIGKILLs whatever is
+    // still alive after grace. Returns immediately with the number of children signalled.
+    public static int StopAll(TimeSpan grace) => stop_all(GraceMs(grace));
+
+    // Snapshot of the native counters and latency histograms (spawn phases, bytes read,
+    // EAGAIN rate, lock waits, reaping). Cheap enough to poll; null if the native
+    // library predates them.
+    public static LibraryStats? GetLibraryStats()
+    {
+        var stats = new LibraryStats(Marshal.SizeOf<LibraryStats>());
+        try
+        {
+            return procwrapper_get_stats(ref stats) == 0 ? stats : null;
+        }
+        catch (EntryPointNotFoundException)
+        {
+            return null;
         }
-        Marshal.FreeHGlobal(argv);
+    }
+
+    public static void ResetLibraryStats()
+    {
+        try { procwrapper_reset_stats(); }
+        catch (EntryPointNotFoundException) { }
+    }
+
+    private static int GraceMs(TimeSpan grace) =>
+        (int)Math.Clamp(grace.TotalMilliseconds, 0, int.MaxValue);
+
+    // One line inside a batch buffer (pw_line in procwrapper.c); newline and trailing \r excluded.
+    // Continued: the buffer filled first, and the next record goes on with the same line.
+    [StructLayout(LayoutKind.Sequential)]
+    public readonly struct LineSpan
+    {
+        public readonly int Offset;
+        public readonly int Length;
+        private readonly int _flags; // PW_LINE_*
+
+        public bool Continued => (_flags & LINE_CONTINUED) != 0;
+    }
+
+    // buffer holds raw UTF-8; each entry of lines points into it. Valid only during the call.
+    public delegate void LineBatchHandler(ReadOnlySpan<byte> buffer, ReadOnlySpan<LineSpan> lines);
+
+    // One decoded line, newline and trailing \r excluded. Valid only during the call.
+    public delegate void LineSpanHandler(ReadOnlySpan<char> line);
+
+    // Output bytes as read, cut anywhere. Valid only during the call.
+    public delegate void DataHandler(ReadOnlySpan<byte> data);
+
+    // ========= packed string block =========
+    // start_process_ex takes every string from one buffer: each one UTF-8, NUL-terminated.
+    private static int PackedSize(string? s) => s == null ? 0 : Encoding.UTF8.GetByteCount(s) + 1;
+
+    // Writes s at pos and returns the position after its NUL.
+    private static int Pack(string s, byte[] buf, int pos)
+    {
+        pos += Encoding.UTF8.GetBytes(s, 0, s.Length, buf, pos);
+        buf[pos] = 0;
+        return pos + 1;
+    }
+
+    private static int PackEnv(string name, string value, byte[] buf, int pos)
+    {
+        pos += Encoding.UTF8.GetBytes(name, 0, name.Length, buf, pos);
+        buf[pos++] = (byte)'=';
+        return Pack(value, buf, pos);
     }
 
   public class ProcessStream : IDisposable
@@ -55,172 +570,830 @@ public static class NativeProc
     public event Action<string>? OnStderrLine;
     public event Action<int>?    OnExited;
 
-    public bool Debug { get; set; } = true;
+    // Batched line events, framed natively by read_lines (one P/Invoke per batch).
+    // Subscribing before Start switches this process to the native line reader.
+    public event LineBatchHandler? OnStdoutLines;
+    public event LineBatchHandler? OnStderrLines;
+
+    // Like OnStdoutLine/OnStderrLine without the string: raised on the thread reading the
+    // stream, from reused buffers, so a subscriber that does not keep the text costs no
+    // allocation per line. MaxLineLength applies; MaxBufferedBytes does not (nothing queued).
+    public event LineSpanHandler? OnStdoutLineSpan;
+    public event LineSpanHandler? OnStderrLineSpan;
+
+    // The raw bytes, undecoded and unframed, for binary or length-prefixed protocols
+    // (WorkerSession). Raised on the reading thread ahead of any line events. Not raised
+    // with OnStdoutLines/OnStderrLines or a RingBufferSize, which frame lines natively.
+    public event DataHandler? OnStdoutData;
+    public event DataHandler? OnStderrData;
+    internal bool HasStdoutLineBatches => OnStdoutLines != null;
+
+    // Lifecycle logging ([proc] start/exit/stop) to the console. Off by default; for
+    // per-read numbers use NativeProc.GetLibraryStats, which costs nothing to keep on.
+    public bool Debug { get; set; }
+
+    // Serve this process from the shared native event loop instead of a reader thread.
+    public bool UseEventLoop { get; set; } = true;
+
+    // With the event loop: when > 0, native code drains each pipe into a ring of this
+    // many bytes and lines are decoded straight from native memory (no managed copies).
+    public int RingBufferSize { get; set; }
+
+    // With NewGroup/NewSession, Stop/StopAsync and Signal(..., wholeGroup: true) also
+    // reach helpers the child forks, so they cannot keep the pipes open.
+    public ProcessGroupMode Group { get; set; }
+
+    // Give the child a stdin pipe, written through StandardInput. Otherwise it inherits ours.
+    public bool RedirectStdin { get; set; }
+
+    // Write-only stream into the child's stdin (RedirectStdin); Write blocks while the
+    // pipe is full, so memory stays constant however much is piped. Dispose sends EOF.
+    public Stream? StandardInput { get; private set; }
+
+    // Bounds on buffered output for line events; null = unbounded.
+    public OutputLimits? Limits { get; set; }
+
+    public long OutputBytesDropped => (_sinkOut?.BytesDropped ?? 0) + (_sinkErr?.BytesDropped ?? 0);
+    public long OutputBytesSpilled => (_sinkOut?.BytesSpilled ?? 0) + (_sinkErr?.BytesSpilled ?? 0);
+    public int OutputPauses => (_sinkOut?.Pauses ?? 0) + (_sinkErr?.Pauses ?? 0); // Block episodes
+    public string? StdoutSpillPath => _sinkOut?.SpillPath;
+    public string? StderrSpillPath => _sinkErr?.SpillPath;
+
+    // null = pipe (line events). Redirected streams raise no line events.
+    public OutputRedirect? StdoutRedirect { get; set; }
+    public OutputRedirect? StderrRedirect { get; set; }
+
+    // Set over the inherited environment (or replacing it with ClearEnvironment),
+    // e.g. LD_LIBRARY_PATH / OPENSSL_MODULES for the bundled openssl.
+    public Dictionary<string, string> EnvironmentVariables { get; } = new Dictionary<string, string>();
+    public bool ClearEnvironment { get; set; }
+
+    public string? WorkingDirectory { get; set; }
+
+    // RLIMIT_AS / RLIMIT_CPU soft limits and a nice increment; 0 = inherit.
+    // Any of these (and WorkingDirectory on older libcs) launches with fork.
+    public long MemoryLimitBytes { get; set; }
+    public long CpuLimitSeconds { get; set; }
+    public int Nice { get; set; }
+
+    // Placement, applied in the child before exec (and so launched with fork): the CPUs it
+    // may run on (e.g. the little cores), its scheduling and I/O class (level 0-7, lower
+    // is more important), and a cgroup v2 directory to join. null/Inherit = as ours. A
+    // setting the kernel refuses (a missing cgroup, an ioprio class needing privileges)
+    // fails Start with that errno.
+    public IReadOnlyList<int>? CpuAffinity { get; set; }
+    public SchedulingClass Scheduling { get; set; }
+    public IoPriorityClass IoClass { get; set; }
+    public int IoLevel { get; set; } = 4;
+    public string? CgroupPath { get; set; }
+
+    // Capacity of the stdout/stderr pipes in bytes (F_SETPIPE_SZ); 0 = kernel default
+    // (64 KiB). A larger pipe lets a fast producer run ahead instead of blocking on us.
+    // Capped by /proc/sys/fs/pipe-max-size; Stats reports what the kernel granted.
+    public int PipeSize { get; set; }
+
+    // Deadlines enforced by the native event loop, with no timer of ours per process: past
+    // either one the child gets SIGTERM, SIGKILL after TimeoutGrace (Zero = at once), and
+    // its exit code reads as ExitTimedOut. CpuTimeout counts user + system time of all its
+    // threads (and unlike CpuLimitSeconds works with any backend). null = none.
+    public TimeSpan? Timeout { get; set; }
+    public TimeSpan? CpuTimeout { get; set; }
+    public TimeSpan TimeoutGrace { get; set; } = TimeSpan.FromSeconds(1);
+
+    // PW_EXIT_TIMED_OUT: GetExitCode / WaitForExitAsync of a child stopped by a deadline
+    public const int ExitTimedOut = -3;
+    public bool TimedOut => Volatile.Read(ref _exitCode) == ExitTimedOut;
+
+    // an exit code the child actually ended with (not -2 running, not -1 error)
+    private static bool IsExitCode(int ec) => ec >= 0 || ec == ExitTimedOut;
 
     private int _handle = -1;
+
+    // errno of a failed Start (ENOENT, EACCES, ENOEXEC, ...), 0 after a successful one.
+    // A binary that cannot be exec'ed fails Start itself; it never runs to exit with 127.
+    public int StartErrno { get; private set; }
+    public string? StartError => StartErrno != 0 ? Marshal.GetPInvokeErrorMessage(StartErrno) : null;
+
+    private static int LastStartError()
+    {
+        try { return procwrapper_last_error(); }
+        catch (EntryPointNotFoundException) { return 0; }
+    }
+
+    // backend that launched this process (null until Start succeeds)
+    public SpawnBackend? Backend { get; private set; }
+    private int _exitCode = -2; // cached once final; the native slot may be recycled after that
     private CancellationTokenSource? _cts;
     private Task? _readerTask;
 
     // NEW: signal when we've drained both stdout/stderr
     private TaskCompletionSource<bool>? _drainedTcs;
 
+    // completed by the native reaper (watch_exit), or by whichever reader sees the exit first
+    private TaskCompletionSource<int>? _exitTcs;
+    private static readonly NativeExitCallback s_onNativeExit = OnNativeExit; // keep delegate alive
+    private static readonly IntPtr s_onNativeExitPtr = Marshal.GetFunctionPointerForDelegate(s_onNativeExit);
+    private GCHandle _exitSelf;
+    private int _exitWatched;
+    private ExitInfo _exitInfo;
+    private int _hasExitInfo;
+
     private const int BUF_SIZE = 4096;
 
-    public bool Start(string exePath, string[] args)
-    {
-        string[] argv = new string[args.Length + 1];
-        argv[0] = exePath;
-        Array.Copy(args, 0, argv, 1, args.Length);
+    // reader thread read buffers grow up to this while reads keep filling them
+    private const int MAX_READ_SIZE = 1024 * 1024;
+    private const int SHRINK_AFTER_READS = 64;
 
-        if (Debug) Console.WriteLine($"[proc] start: {exePath} {string.Join(" ", args)}");
+    // read_lines batch sizes
+    private const int LINE_BUF_SIZE = 64 * 1024;
+    private const int MAX_LINES_PER_BATCH = 512;
 
-        IntPtr nativeArgv = BuildArgv(argv);
-        _handle = start_process(exePath, nativeArgv);
-        FreeArgv(nativeArgv, argv.Length);
+    // upper bound for one native wait, so cancellation is still observed
+    private const int WAIT_SLICE_MS = 250;
 
-        if (_handle < 0)
-        {
-            if (Debug) Console.WriteLine("[proc] start failed (handle < 0)");
-            return false;
-        }
+    // reader thread re-check period while a stream is paused (OutputPolicy.Block)
+    private const int PAUSED_SLICE_MS = 20;
 
-        if (Debug) Console.WriteLine($"[proc] started handle={_handle}");
+    // event loop subscription state
+    private static readonly NativeEventCallback s_onNativeEvent = OnNativeEvent; // keep delegate alive
+    private static readonly IntPtr s_onNativeEventPtr = Marshal.GetFunctionPointerForDelegate(s_onNativeEvent);
+    private GCHandle _self;
+    private int _subscribed;
+    private bool _ringMode;
+    private OutputSink? _sinkOut;
+    private OutputSink? _sinkErr;
 
-        _cts = new CancellationTokenSource();
-        _drainedTcs = new TaskCompletionSource<bool>(TaskCreationOptions.RunContinuationsAsynchronously);
-        _readerTask = Task.Run(() => ReaderLoop(_cts.Token));
-        return true;
-    }
+    public bool Start(string exePath, string[] args)
+    {
+        if (Debug) Console.WriteLine($"[proc] start: {exePath} {string.Join(" ", args)}");
 
-    // NEW: await this after WaitForExitAsync to ensure tail has flushed
-    public Task WaitForDrainAsync() => _drainedTcs?.Task ?? Task.CompletedTask;
+        int handle = StartNative(exePath, args);
+        // read right away: the native value is per thread and per call
+        return Started(handle, handle < 0 ? LastStartError() : 0);
+    }
 
-    private async Task ReaderLoop(CancellationToken ct)
+    // Start procs[i] as exePath with args[i], all through one native call: slots are
+    // reserved together and the spawn server gets the requests pipelined. Configure each
+    // stream as for Start first. Returns how many started; for the rest StartErrno and
+    // StartError say why, as after a failed Start.
+    public static unsafe int StartMany(IReadOnlyList<ProcessStream> procs, string exePath, IReadOnlyList<string[]> args)
     {
-        var stdoutBuf = Marshal.AllocHGlobal(BUF_SIZE);
-        var stderrBuf = Marshal.AllocHGlobal(BUF_SIZE);
-        var sbOut = new StringBuilder();
-        var sbErr = new StringBuilder();
-
-        bool sawExit = false;
-        bool outEof = false, errEof = false;
+        if (procs.Count != args.Count) throw new ArgumentException("one args array per process is needed", nameof(args));
+        int count = procs.Count;
+        if (count == 0) return 0;
 
+        int size = 0;
+        for (int i = 0; i < count; i++) size += procs[i].PackedLaunchSize(exePath, args[i]);
+        byte[] block = ArrayPool<byte>.Shared.Rent(size);
+        SpawnOpts[] specs = ArrayPool<SpawnOpts>.Shared.Rent(count);
+        int[] handles = ArrayPool<int>.Shared.Rent(count);
         try
         {
-            while (!ct.IsCancellationRequested)
+            int n;
+            fixed (byte* b = block)
+            fixed (SpawnOpts* sp = specs)
+            fixed (int* h = handles)
             {
-                int nOut = read_stdout(_handle, stdoutBuf, BUF_SIZE - 1);
-                if (nOut > 0)
+                int pos = 0;
+                for (int i = 0; i < count; i++)
                 {
-                    if (Debug) Console.WriteLine($"[proc] read stdout {nOut} bytes");
-                    byte[] tmp = new byte[nOut];
-                    Marshal.Copy(stdoutBuf, tmp, 0, nOut);
-                    sbOut.Append(Encoding.UTF8.GetString(tmp));
-                    EmitLines(sbOut, OnStdoutLine);
+                    if (procs[i].Debug) Console.WriteLine($"[proc] start (batch): {exePath} {string.Join(" ", args[i])}");
+                    specs[i] = procs[i].PackLaunch(exePath, args[i], block, b, ref pos);
                 }
-                else if (nOut == 0 && GetExitCode() >= 0)
+                try { n = start_processes(count, sp, h); }
+                catch (EntryPointNotFoundException)
                 {
-                    // EOF on stdout (after exit observed)
-                    outEof = true;
+                    // older library: one call each
+                    n = 0;
+                    for (int i = 0; i < count; i++) if (procs[i].Start(exePath, args[i])) n++;
+                    return n;
                 }
+                if (n < 0) throw new ArgumentException($"start_processes rejected the batch (errno {LastStartError()})");
+            }
+            for (int i = 0; i < count; i++)
+                procs[i].Started(handles[i] > 0 ? handles[i] : -1, handles[i] > 0 ? 0 : -handles[i]);
+            return n;
+        }
+        finally
+        {
+            ArrayPool<int>.Shared.Return(handles);
+            ArrayPool<SpawnOpts>.Shared.Return(specs);
+            ArrayPool<byte>.Shared.Return(block);
+        }
+    }
 
-                int nErr = read_stderr(_handle, stderrBuf, BUF_SIZE - 1);
-                if (nErr > 0)
-                {
-                    if (Debug) Console.WriteLine($"[proc] read stderr {nErr} bytes");
-                    byte[] tmp = new byte[nErr];
-                    Marshal.Copy(stderrBuf, tmp, 0, nErr);
-                    sbErr.Append(Encoding.UTF8.GetString(tmp));
-                    EmitLines(sbErr, OnStderrLine);
-                }
-                else if (nErr == 0 && GetExitCode() >= 0)
-                {
-                    // EOF on stderr (after exit observed)
-                    errEof = true;
-                }
+    // Start stages[i] as exePaths[i] with args[i], stage i's stdout wired to stage i+1's
+    // stdin in the kernel: the bytes between stages never come through us. Configure each
+    // stream as for Start; only the first may set RedirectStdin, and every stage but the
+    // last must keep its stdout a pipe. Without monitor that stdout then reads as empty;
+    // with it, it reads as a copy of what went to the next stage (dropped where the copy
+    // falls behind, never slowing the pipeline). All stages share one new process group,
+    // so Signal(sig, wholeGroup: true) on any stage reaches all; each keeps its own exit
+    // code. Either every stage starts or none does (StartErrno then says why, on each).
+    public static unsafe bool StartPipeline(IReadOnlyList<ProcessStream> stages, IReadOnlyList<string> exePaths,
+                                            IReadOnlyList<string[]> args, bool monitor = false)
+    {
+        int count = stages.Count;
+        if (exePaths.Count != count || args.Count != count)
+            throw new ArgumentException("one executable and args array per stage is needed");
+        if (count == 0) return true;
 
-                int exitStatus = GetExitCode();
-                if (exitStatus == -1)
+        int size = 0;
+        for (int i = 0; i < count; i++) size += stages[i].PackedLaunchSize(exePaths[i], args[i]);
+        byte[] block = ArrayPool<byte>.Shared.Rent(size);
+        SpawnOpts[] specs = ArrayPool<SpawnOpts>.Shared.Rent(count);
+        int[] handles = ArrayPool<int>.Shared.Rent(count);
+        try
+        {
+            int rc, errno;
+            fixed (byte* b = block)
+            fixed (SpawnOpts* sp = specs)
+            fixed (int* h = handles)
+            {
+                int pos = 0;
+                for (int i = 0; i < count; i++)
                 {
-                    if (Debug) Console.WriteLine("[proc] GetExitCode returned -1 (error/invalid)");
-                    OnExited?.Invoke(-1);
-                    break;
+                    if (stages[i].Debug) Console.WriteLine($"[proc] start (pipeline stage {i}): {exePaths[i]} {string.Join(" ", args[i])}");
+                    specs[i] = stages[i].PackLaunch(exePaths[i], args[i], block, b, ref pos);
                 }
-
-                if (exitStatus >= 0)
+                try { rc = start_pipeline(count, sp, monitor ? PIPELINE_MONITOR : 0, h); }
+                catch (EntryPointNotFoundException)
                 {
-                    if (!sawExit)
-                    {
-                        sawExit = true;
-                        if (Debug) Console.WriteLine("[proc] exit observed, draining...");
-                    }
-
-                    // Keep looping until both streams report EOF
-                    if (outEof && errEof)
-                    {
-                        // flush any trailing partial lines
-                        if (sbOut.Length > 0) OnStdoutLine?.Invoke(sbOut.ToString());
-                        if (sbErr.Length > 0) OnStderrLine?.Invoke(sbErr.ToString());
-
-                        if (Debug) Console.WriteLine($"[proc] exited with code {exitStatus}");
-                        OnExited?.Invoke(exitStatus);
-                        break;
-                    }
+                    throw new PlatformNotSupportedException("this procwrapper library has no start_pipeline");
                 }
-
-                await Task.Delay(20, ct).ConfigureAwait(false);
+                errno = rc < 0 ? LastStartError() : 0;
             }
+            if (errno == EINVAL) throw new ArgumentException("these stages cannot form a pipeline: RedirectStdin past the first, stdout redirected before the last, or a new session");
+            for (int i = 0; i < count; i++) stages[i].Started(rc == 0 ? handles[i] : -1, errno);
+            return rc == 0;
         }
-        catch (OperationCanceledException)
+        finally
         {
-            if (Debug) Console.WriteLine("[proc] reader cancelled");
+            ArrayPool<int>.Shared.Return(handles);
+            ArrayPool<SpawnOpts>.Shared.Return(specs);
+            ArrayPool<byte>.Shared.Return(block);
         }
-        finally
+    }
+
+    // Everything after the native start: errno is why handle is -1, else 0.
+    private bool Started(int handle, int errno)
+    {
+        _handle = handle;
+        if (_handle < 0)
         {
-            Marshal.FreeHGlobal(stdoutBuf);
-            Marshal.FreeHGlobal(stderrBuf);
-            _drainedTcs?.TrySetResult(true);
+            StartErrno = errno;
+            if (Debug) Console.WriteLine($"[proc] start failed: {StartError} (errno {StartErrno})");
+            return false;
         }
+        StartErrno = 0;
+
+        int backend = get_process_backend(_handle);
+        Backend = backend >= 0 ? (SpawnBackend)backend : null;
+        if (RedirectStdin) StandardInput = new StdinStream(_handle);
+
+        if (Debug) Console.WriteLine($"[proc] started handle={_handle} backend={Backend}");
+
+        _cts = new CancellationTokenSource();
+        _drainedTcs = new TaskCompletionSource<bool>(TaskCreationOptions.RunContinuationsAsynchronously);
+        _exitTcs = new TaskCreationSource<int>();
+        _sinkOut = new OutputSink(this, isOut: true, Limits);
+        _sinkErr = new OutputSink(this, isOut: false, Limits);
+        WatchExit();
+
+        bool batched = OnStdoutLines != null || OnStderrLines != null;
+        if (UseEventLoop && !batched && Subscribe()) return true;
+
+        var token = _cts.Token;
+        // The reader blocks in wait_events, so give it its own thread rather than a pool worker.
+        _readerTask = Task.Factory.StartNew(() => ReaderLoop(token), token,
+            TaskCreationOptions.LongRunning, TaskScheduler.Default);
+        return true;
     }
 
-    private static void EmitLines(StringBuilder sb, Action<string>? callback)
+    // Everything goes into one pooled buffer: path, argv (argv[0] = exePath), env,
+    // cwd and redirect paths, so a launch makes no per-string native allocations.
+    private unsafe int StartNative(string exePath, string[] args)
     {
-        if (callback == null) return;
-        string all = sb.ToString();
-        int start = 0, idx;
-        while ((idx = all.IndexOf('\n', start)) >= 0)
+        byte[] block = ArrayPool<byte>.Shared.Rent(PackedLaunchSize(exePath, args));
+        try
         {
-            string line = all.Substring(start, idx - start).TrimEnd('\r');
-            callback(line);
-            start = idx + 1;
+            fixed (byte* b = block)
+            {
+                int pos = 0;
+                var opts = PackLaunch(exePath, args, block, b, ref pos);
+                return start_process_ex(ref opts);
+            }
         }
-        if (start > 0)
+        finally
         {
-            string rem = all.Substring(start);
-            sb.Clear();
-            sb.Append(rem);
+            ArrayPool<byte>.Shared.Return(block);
         }
     }
 
-    public int GetExitCode()
+    private int PackedLaunchSize(string exePath, string[] args)
     {
-        if (_handle < 0) return -1;
-        try { return get_exit_code(_handle); }
-        catch { return -1; }
+        int size = PackedSize(exePath) * 2;
+        foreach (string a in args) size += PackedSize(a);
+        foreach (var kv in EnvironmentVariables) size += PackedSize(kv.Key) + PackedSize(kv.Value);
+        return size + PackedSize(WorkingDirectory) + PackedSize(StdoutRedirect?.Path) + PackedSize(StderrRedirect?.Path)
+            + PackedSize(CgroupPath) + CpuMaskSize();
     }
 
-    public Task<int> WaitForExitAsync(int pollMs = 50, CancellationToken cancellationToken = default)
+    // Packs this launch's strings into block (pinned at b) from pos on; the options point there.
+    private unsafe SpawnOpts PackLaunch(string exePath, string[] args, byte[] block, byte* b, ref int pos)
     {
-        var tcs = new TaskCreationSource<int>();
-        var linked = CancellationTokenSource.CreateLinkedTokenSource(cancellationToken);
-        Task.Run(async () =>
+        IntPtr path = (IntPtr)(b + pos);
+        pos = Pack(exePath, block, pos);
+
+        IntPtr argvBlock = (IntPtr)(b + pos);
+        pos = Pack(exePath, block, pos);
+        foreach (string a in args) pos = Pack(a, block, pos);
+
+        IntPtr envBlock = (IntPtr)(b + pos);
+        foreach (var kv in EnvironmentVariables) pos = PackEnv(kv.Key, kv.Value, block, pos);
+
+        IntPtr cwd = IntPtr.Zero, outPath = IntPtr.Zero, errPath = IntPtr.Zero;
+        if (WorkingDirectory != null) { cwd = (IntPtr)(b + pos); pos = Pack(WorkingDirectory, block, pos); }
+        if (StdoutRedirect?.Path != null) { outPath = (IntPtr)(b + pos); pos = Pack(StdoutRedirect.Path, block, pos); }
+        if (StderrRedirect?.Path != null) { errPath = (IntPtr)(b + pos); pos = Pack(StderrRedirect.Path, block, pos); }
+        IntPtr cgroup = IntPtr.Zero, cpuMask = IntPtr.Zero;
+        if (CgroupPath != null) { cgroup = (IntPtr)(b + pos); pos = Pack(CgroupPath, block, pos); }
+        int maskSize = CpuMaskSize();
+        if (maskSize > 0)
+        {
+            cpuMask = (IntPtr)(b + pos);
+            Array.Clear(block, pos, maskSize);
+            foreach (int cpu in CpuAffinity!) block[pos + cpu / 8] |= (byte)(1 << (cpu % 8));
+            pos += maskSize;
+        }
+
+        return new SpawnOpts
+        {
+            Size = sizeof(SpawnOpts),
+            Flags = (int)Group | (RedirectStdin ? START_STDIN : 0) | (ClearEnvironment ? START_CLEAR_ENV : 0),
+            Path = path,
+            Out = ToNative(StdoutRedirect, outPath),
+            Err = ToNative(StderrRedirect, errPath),
+            ArgvBlock = argvBlock,
+            Argc = args.Length + 1,
+            EnvBlock = envBlock,
+            Envc = EnvironmentVariables.Count,
+            Cwd = cwd,
+            RlimitAs = MemoryLimitBytes,
+            RlimitCpu = CpuLimitSeconds,
+            Nice = Nice,
+            PipeSize = PipeSize,
+            TimeoutMs = DeadlineMs(Timeout),
+            CpuTimeoutMs = DeadlineMs(CpuTimeout),
+            TimeoutGraceMs = GraceMs(TimeoutGrace),
+            CpuAffinity = cpuMask,
+            CpuAffinitySize = maskSize,
+            SchedPolicy = (int)Scheduling,
+            IoPriority = IoClass == IoPriorityClass.Inherit ? 0 : (int)IoClass << 13 | Math.Clamp(IoLevel, 0, 7),
+            Cgroup = cgroup,
+        };
+    }
+
+    // bytes of sched_setaffinity mask CpuAffinity needs, whole 64-bit words as in cpu_set_t
+    private int CpuMaskSize()
+    {
+        if (CpuAffinity == null || CpuAffinity.Count == 0) return 0;
+        int max = 0;
+        foreach (int cpu in CpuAffinity)
+        {
+            if (cpu < 0) throw new ArgumentOutOfRangeException(nameof(CpuAffinity), cpu, "CPU numbers start at 0");
+            max = Math.Max(max, cpu);
+        }
+        return (max / 64 + 1) * 8;
+    }
+
+    // 0 = none; anything shorter than 1 ms still gets a deadline
+    private static long DeadlineMs(TimeSpan? t) =>
+        t is { } d ? Math.Max(1, (long)Math.Ceiling(Math.Min(d.TotalMilliseconds, long.MaxValue / 2))) : 0;
+
+    private bool Subscribe()
+    {
+        _self = GCHandle.Alloc(this);
+        _subscribed = 1;
+        _ringMode = RingBufferSize > 0;
+        int rc = _ringMode
+            ? subscribe_process_ring(_handle, RingBufferSize, s_onNativeEventPtr, GCHandle.ToIntPtr(_self))
+            : subscribe_process(_handle, s_onNativeEventPtr, GCHandle.ToIntPtr(_self));
+        if (rc == 0)
+        {
+            if (Debug) Console.WriteLine($"[proc] handle={_handle} served by event loop{(_ringMode ? " (ring)" : "")}");
+            return true;
+        }
+
+        if (Debug) Console.WriteLine("[proc] event loop unavailable, using reader thread");
+        _subscribed = 0;
+        _self.Free();
+        return false;
+    }
+
+    // Before any reader starts, so the slot cannot have been released yet. The callback may
+    // run right here if the child is already gone.
+    private void WatchExit()
+    {
+        _exitSelf = GCHandle.Alloc(this);
+        _exitWatched = 1;
+        if (watch_exit(_handle, s_onNativeExitPtr, GCHandle.ToIntPtr(_exitSelf)) >= 0) return;
+        if (Interlocked.Exchange(ref _exitWatched, 0) == 1) _exitSelf.Free();
+    }
+
+    private static void OnNativeExit(int handle, IntPtr info, IntPtr user)
+    {
+        try
+        {
+            if (GCHandle.FromIntPtr(user).Target is not ProcessStream ps) return;
+            ps._exitInfo = Marshal.PtrToStructure<ExitInfo>(info);
+            Volatile.Write(ref ps._hasExitInfo, 1);
+            ps.SetExited(ps._exitInfo.ExitCode);
+            // fires once; the native side already dropped the registration
+            if (Interlocked.Exchange(ref ps._exitWatched, 0) == 1) ps._exitSelf.Free();
+        }
+        catch
+        {
+            // never let an exception unwind into native code
+        }
+    }
+
+    // Every path that learns the final exit code goes through here.
+    private void SetExited(int code)
+    {
+        if (code == -2) return;
+        Volatile.Write(ref _exitCode, code);
+        _exitTcs?.TrySetResult(code);
+    }
+
+    // Exit record (timestamps, CPU time, peak RSS); null while the child runs.
+    public ExitInfo? ExitDetails
+    {
+        get
+        {
+            if (Volatile.Read(ref _hasExitInfo) == 1) return _exitInfo;
+            if (_handle < 0 || Volatile.Read(ref _exitWatched) == 1) return null;
+            // not watched: ask directly (the slot may already be gone)
+            try { return get_exit_info(_handle, out ExitInfo info) == 0 ? info : null; }
+            catch { return null; }
+        }
+    }
+
+    // Resource accounting for this child: CPU, peak RSS, faults, context switches and
+    // spawn/run wall time. Sampled live while it runs; null before Start.
+    public ProcStats? Stats
+    {
+        get
+        {
+            if (Volatile.Read(ref _hasExitInfo) == 1) return new ProcStats(_exitInfo);
+            if (_handle < 0) return null;
+            var stats = new ProcStats(Marshal.SizeOf<ProcStats>());
+            int rc;
+            try { rc = get_proc_stats(_handle, ref stats); }
+            catch { return null; }
+            if (rc >= 0) return stats;
+            // the slot goes away only after the exit callback stored the record
+            return Volatile.Read(ref _hasExitInfo) == 1 ? new ProcStats(_exitInfo) : null;
+        }
+    }
+
+    private void Unsubscribe()
+    {
+        if (Interlocked.Exchange(ref _subscribed, 0) == 0) return;
+        // waits out a callback in flight, so freeing the GCHandle afterwards is safe
+        try { unsubscribe_process(_handle); } catch { /* ignore */ }
+        _self.Free();
+        _drainedTcs?.TrySetResult(true);
+    }
+
+    private static void OnNativeEvent(int handle, int evt, IntPtr data, int len, IntPtr user)
+    {
+        // never let an exception unwind into the native loop thread
+        ProcessStream? ps = null;
+        try
+        {
+            ps = GCHandle.FromIntPtr(user).Target as ProcessStream;
+            ps?.HandleNativeEvent(evt, data, len);
+        }
+        catch (Exception ex)
+        {
+            if (ps?.Debug == true) Console.WriteLine($"[proc] event callback failed: {ex}");
+        }
+    }
+
+    private unsafe void HandleNativeEvent(int evt, IntPtr data, int len)
+    {
+        switch (evt)
+        {
+            case EVT_STDOUT:
+            case EVT_STDERR:
+                bool isOut = evt == EVT_STDOUT;
+                if (_ringMode)
+                {
+                    ConsumeRing(data, isOut, eof: len == 0);
+                    return;
+                }
+                if (len == 0)
+                {
+                    if (Debug) Console.WriteLine($"[proc] {(isOut ? "stdout" : "stderr")} EOF");
+                    return;
+                }
+                // data is the loop's read buffer, valid until we return
+                (isOut ? _sinkOut : _sinkErr)!.Append(new ReadOnlySpan<byte>((void*)data, len));
+                break;
+
+            case EVT_EXIT:
+                HandleNativeExit(len);
+                break;
+        }
+    }
+
+    // Kept out of HandleNativeEvent: a lambda capturing its parameter would cost that
+    // method a closure allocation on every output event.
+    private void HandleNativeExit(int code)
+    {
+        _sinkOut!.Flush();
+        _sinkErr!.Flush();
+        _sinkOut.Release();
+        _sinkErr.Release();
+
+        SetExited(code);
+        if (Debug) Console.WriteLine($"[proc] exited with code {code}");
+        // last event for this handle: native side already dropped the subscription
+        if (Interlocked.Exchange(ref _subscribed, 0) == 1) _self.Free();
+        AfterOutput(() =>
+        {
+            OnExited?.Invoke(code);
+            _drainedTcs?.TrySetResult(true);
+        });
+    }
+
+    // Emit every complete line in [tail, head) and advance tail. A partial line stays in
+    // the ring unless the stream hit EOF (it is the last line) or the ring is full (it is
+    // passed on as the start of a line that goes on in the next chunk).
+    private unsafe void ConsumeRing(IntPtr ringPtr, bool isOut, bool eof)
+    {
+        byte* ring = (byte*)ringPtr;
+        byte* data = ring + RING_DATA;
+        uint cap = *(uint*)(ring + RING_CAPACITY);
+        uint head = Volatile.Read(ref *(uint*)(ring + RING_HEAD));
+        uint tail = *(uint*)(ring + RING_TAIL); // only we write it
+        var sink = (isOut ? _sinkOut : _sinkErr)!;
+
+        while (tail != head)
+        {
+            uint avail = head - tail;
+            uint off = tail & (cap - 1);
+            uint first = Math.Min(avail, cap - off);
+
+            int lineLen = new ReadOnlySpan<byte>(data + off, (int)first).IndexOf((byte)'\n');
+            if (lineLen < 0 && first < avail)
+            {
+                int nl = new ReadOnlySpan<byte>(data, (int)(avail - first)).IndexOf((byte)'\n');
+                if (nl >= 0) lineLen = (int)first + nl;
+            }
+
+            int consume;
+            bool complete = true;
+            if (lineLen >= 0) consume = lineLen + 1;
+            else if (eof) consume = lineLen = (int)avail; // no newline is coming
+            else if (avail == cap) { consume = lineLen = (int)avail; complete = false; } // no room to wait for one
+            else break;
+
+            if (sink.Wanted) AddRingLine(sink, data, cap, off, lineLen, complete);
+            tail += (uint)consume;
+        }
+
+        Volatile.Write(ref *(uint*)(ring + RING_TAIL), tail);
+        Interlocked.MemoryBarrier(); // pairs with the loop setting 'stalled' then re-reading tail
+        if (Volatile.Read(ref *(uint*)(ring + RING_STALLED)) != 0)
+            ring_resume(_handle, isOut ? EVT_STDOUT : EVT_STDERR);
+    }
+
+    private static unsafe void AddRingLine(OutputSink sink, byte* data, uint cap, uint off, int len, bool complete)
+    {
+        if (complete && len > 0 && data[(off + (uint)len - 1) & (cap - 1)] == (byte)'\r') len--;
+        int first = (int)Math.Min((uint)len, cap - off);
+        // a line that wraps around the end of the ring is decoded in two parts, not copied
+        sink.AddLine(new ReadOnlySpan<byte>(data + off, first), new ReadOnlySpan<byte>(data, len - first), complete);
+    }
+
+    // NEW: await this after WaitForExitAsync to ensure tail has flushed
+    public Task WaitForDrainAsync() => _drainedTcs?.Task ?? Task.CompletedTask;
+
+    private unsafe void ReaderLoop(CancellationToken ct)
+    {
+        var stdoutBuf = new ReadBuffer();
+        var stderrBuf = new ReadBuffer();
+        var sinkOut = _sinkOut!;
+        var sinkErr = _sinkErr!;
+
+        bool sawExit = false;
+        bool outEof = false, errEof = false;
+
+        bool batchOut = OnStdoutLines != null, batchErr = OnStderrLines != null;
+        byte[] lineBuf = batchOut || batchErr ? new byte[LINE_BUF_SIZE] : Array.Empty<byte>();
+        LineSpan[] lineRecs = batchOut || batchErr ? new LineSpan[MAX_LINES_PER_BATCH] : Array.Empty<LineSpan>();
+
+        var rs = new ReadResult();
+
+        try
+        {
+            while (!ct.IsCancellationRequested)
+            {
+                int nOut, nErr, exitStatus;
+                // a paused stream is left in its pipe, which pushes back on the child
+                bool pausedOut = sinkOut.Paused, pausedErr = sinkErr.Paused;
+                if (!batchOut && !batchErr)
+                {
+                    // NEW: both streams and the exit status in one native call
+                    rs.OutBuf = stdoutBuf.Ptr;
+                    rs.OutCap = pausedOut ? 0 : stdoutBuf.Size;
+                    rs.ErrBuf = stderrBuf.Ptr;
+                    rs.ErrCap = pausedErr ? 0 : stderrBuf.Size;
+                    read_streams(_handle, ref rs);
+                    nOut = rs.OutLen;
+                    nErr = rs.ErrLen;
+                    exitStatus = rs.ExitCode;
+                    if ((rs.Done & EV_STDOUT) != 0) outEof = true;
+                    if ((rs.Done & EV_STDERR) != 0) errEof = true;
+                    if (IsExitCode(exitStatus)) SetExited(exitStatus);
+                }
+                else
+                {
+                    nOut = pausedOut ? 0 : batchOut
+                        ? ReadLineBatch(EVT_STDOUT, lineBuf, lineRecs, OnStdoutLines, sinkOut)
+                        : read_stdout(_handle, stdoutBuf.Ptr, stdoutBuf.Size);
+                    // EOF on stdout (after exit observed); < 0 once the last EOF released the handle
+                    if (nOut < 0 || (nOut == 0 && !pausedOut && IsExitCode(GetExitCode()))) outEof = true;
+
+                    nErr = pausedErr ? 0 : batchErr
+                        ? ReadLineBatch(EVT_STDERR, lineBuf, lineRecs, OnStderrLines, sinkErr)
+                        : read_stderr(_handle, stderrBuf.Ptr, stderrBuf.Size);
+                    // EOF on stderr (after exit observed)
+                    if (nErr < 0 || (nErr == 0 && !pausedErr && IsExitCode(GetExitCode()))) errEof = true;
+
+                    exitStatus = GetExitCode();
+                }
+
+                // decoded straight out of the native read buffers
+                if (nOut > 0 && !batchOut)
+                {
+                    sinkOut.Append(new ReadOnlySpan<byte>((void*)stdoutBuf.Ptr, nOut));
+                    stdoutBuf.Observe(nOut);
+                }
+
+                if (nErr > 0 && !batchErr)
+                {
+                    sinkErr.Append(new ReadOnlySpan<byte>((void*)stderrBuf.Ptr, nErr));
+                    stderrBuf.Observe(nErr);
+                }
+
+                if (exitStatus == -1)
+                {
+                    if (Debug) Console.WriteLine("[proc] GetExitCode returned -1 (error/invalid)");
+                    AfterOutput(() => OnExited?.Invoke(-1));
+                    break;
+                }
+
+                if (IsExitCode(exitStatus))
+                {
+                    if (!sawExit)
+                    {
+                        sawExit = true;
+                        if (Debug) Console.WriteLine("[proc] exit observed, draining...");
+                    }
+
+                    // Keep looping until both streams report EOF
+                    if (outEof && errEof)
+                    {
+                        // flush any trailing partial lines
+                        sinkOut.Flush();
+                        sinkErr.Flush();
+
+                        if (Debug) Console.WriteLine($"[proc] exited with code {exitStatus}");
+                        int code = exitStatus;
+                        AfterOutput(() => OnExited?.Invoke(code));
+                        break;
+                    }
+                }
+
+                // Nothing read this round: sleep in native code until a stream
+                // becomes readable or the child exits.
+                if (nOut <= 0 && nErr <= 0)
+                {
+                    int mask = (outEof || pausedOut ? 0 : EV_STDOUT) | (errEof || pausedErr ? 0 : EV_STDERR) | (sawExit ? 0 : EV_EXIT);
+                    int slice = pausedOut || pausedErr ? PAUSED_SLICE_MS : WAIT_SLICE_MS;
+                    if (mask == 0 && (pausedOut || pausedErr)) ct.WaitHandle.WaitOne(slice);
+                    else if (mask != 0 && wait_events(_handle, slice, ref mask) < 0)
+                    {
+                        // fall back to the old polling cadence
+                        if (Debug) Console.WriteLine("[proc] wait_events failed");
+                        ct.WaitHandle.WaitOne(20);
+                    }
+                }
+            }
+
+            if (ct.IsCancellationRequested && Debug) Console.WriteLine("[proc] reader cancelled");
+        }
+        finally
+        {
+            stdoutBuf.Dispose();
+            stderrBuf.Dispose();
+            sinkOut.Release();
+            sinkErr.Release();
+            AfterOutput(() => _drainedTcs?.TrySetResult(true));
+        }
+    }
+
+    // Returns the number of lines delivered (0 if none were complete), -1 on error.
+    private unsafe int ReadLineBatch(int stream, byte[] buf, LineSpan[] recs, LineBatchHandler? batch, OutputSink perLine)
+    {
+        int n;
+        fixed (byte* b = buf)
+        fixed (LineSpan* r = recs)
+        {
+            n = read_lines(_handle, stream, b, buf.Length, r, recs.Length);
+        }
+        if (n <= 0) return n;
+
+        batch?.Invoke(buf, new ReadOnlySpan<LineSpan>(recs, 0, n));
+        if (perLine.Wanted)
+        {
+            for (int i = 0; i < n; i++)
+                perLine.AddLine(new ReadOnlySpan<byte>(buf, recs[i].Offset, recs[i].Length), complete: !recs[i].Continued);
+        }
+        return n;
+    }
+
+    // Run action once both streams delivered every queued line (at once without a queue).
+    private void AfterOutput(Action action)
+    {
+        if (_sinkOut == null || _sinkErr == null)
+        {
+            action();
+            return;
+        }
+        int pending = 2;
+        Action step = () => { if (Interlocked.Decrement(ref pending) == 0) action(); };
+        _sinkOut.WhenDrained(step);
+        _sinkErr.WhenDrained(step);
+    }
+
+    private void PauseStream(bool isOut, bool paused)
+    {
+        // the reader thread checks OutputSink.Paused itself
+        if (Volatile.Read(ref _subscribed) == 0) return;
+        try { pause_stream(_handle, isOut ? EVT_STDOUT : EVT_STDERR, paused ? 1 : 0); }
+        catch { /* ignore */ }
+    }
+
+    public int GetExitCode()
+    {
+        int cached = Volatile.Read(ref _exitCode);
+        if (cached != -2) return cached;
+        if (_handle < 0) return -1;
+        int ec;
+        try { ec = get_exit_code(_handle); }
+        catch { return -1; }
+        if (IsExitCode(ec)) SetExited(ec);
+        // the reader may have cached the code and let the slot go while we were asking
+        else if (ec == -1 && (cached = Volatile.Read(ref _exitCode)) != -2) return cached;
+        return ec;
+    }
+
+    // Open fd count of the running child (normally 3); -1 once it exited or if unavailable.
+    public int GetChildFdCount()
+    {
+        if (_handle < 0 || Volatile.Read(ref _exitCode) != -2) return -1;
+        try { return get_child_fd_count(_handle); }
+        catch { return -1; }
+    }
+
+    // Completes when the native reaper records the exit; no thread waits or polls for it.
+    // pollMs only applies if the exit could not be watched (the handle was already gone).
+    public Task<int> WaitForExitAsync(int pollMs = 50, CancellationToken cancellationToken = default)
+    {
+        var exited = _exitTcs?.Task;
+        if (exited == null) return Task.FromResult(GetExitCode());
+        if (exited.IsCompleted || Volatile.Read(ref _exitWatched) == 1)
+            return cancellationToken.CanBeCanceled ? exited.WaitAsync(cancellationToken) : exited;
+        int ec = GetExitCode();
+        return ec != -2 ? Task.FromResult(ec) : PollExitAsync(pollMs, cancellationToken);
+    }
+
+    private Task<int> PollExitAsync(int pollMs, CancellationToken cancellationToken)
+    {
+        var tcs = new TaskCreationSource<int>();
+        var linked = CancellationTokenSource.CreateLinkedTokenSource(cancellationToken);
+        Task.Run(async () =>
         {
             try
             {
                 while (!linked.Token.IsCancellationRequested)
                 {
                     int ec = GetExitCode();
-                    if (ec >= 0 || ec == -1) { tcs.TrySetResult(ec); return; }
+                    if (ec != -2) { tcs.TrySetResult(ec); return; }
                     await Task.Delay(pollMs, linked.Token).ConfigureAwait(false);
                 }
                 tcs.TrySetCanceled(linked.Token);
@@ -246,20 +1419,1296 @@ public static class NativeProc
         }
         _cts?.Cancel();
         try { _readerTask?.Wait(500); } catch { /* ignore */ }
+
+        if (Volatile.Read(ref _subscribed) == 1)
+        {
+            // give the event loop a moment to deliver the tail and exit
+            try { _drainedTcs?.Task.Wait(500); } catch { /* ignore */ }
+            Unsubscribe();
+        }
+    }
+
+    // Non-blocking Stop: SIGTERM now, SIGKILL from the native event loop after grace.
+    // Completes once the exit was observed and the output tail delivered (or after a
+    // short drain window, as in Stop).
+    public async Task StopAsync(TimeSpan grace, CancellationToken cancellationToken = default)
+    {
+        if (Debug) Console.WriteLine($"[proc] async stop requested (grace {grace.TotalMilliseconds}ms)");
+        // even after the exit: a process group may still hold the pipes
+        if (_handle >= 0)
+        {
+            try { stop_process_async(_handle, GraceMs(grace)); } catch { /* ignore */ }
+        }
+
+        await WaitForExitAsync(cancellationToken: cancellationToken).ConfigureAwait(false);
+        var drained = WaitForDrainAsync();
+        await Task.WhenAny(drained, Task.Delay(500, cancellationToken)).ConfigureAwait(false);
+
+        _cts?.Cancel();
+        if (Volatile.Read(ref _subscribed) == 1) Unsubscribe();
+    }
+
+    // Send a signal to the child, or to its whole process group (Group must be set).
+    public bool Signal(int signal, bool wholeGroup = false)
+    {
+        if (_handle < 0) return false;
+        try { return signal_process(_handle, signal, wholeGroup ? 1 : 0) == 0; }
+        catch { return false; }
+    }
+
+    // Captured output of a stream redirected ToMemory, mapped straight from the memfd.
+    // Call after the exit; the memory stays valid until ReleaseOutput or Dispose.
+    public bool TryMapOutput(bool stderr, out IntPtr data, out long length)
+    {
+        data = IntPtr.Zero;
+        length = 0;
+        if (_handle < 0) return false;
+        try { data = map_output(_handle, stderr ? EVT_STDERR : EVT_STDOUT, out length); }
+        catch { return false; }
+        return data != IntPtr.Zero;
+    }
+
+    public unsafe ReadOnlySpan<byte> MapOutput(bool stderr = false)
+    {
+        if (!TryMapOutput(stderr, out IntPtr data, out long length)) return ReadOnlySpan<byte>.Empty;
+        if (length > int.MaxValue) throw new NotSupportedException("capture exceeds 2 GiB; use TryMapOutput");
+        return new ReadOnlySpan<byte>((void*)data, (int)length);
+    }
+
+    // Unmap and drop memfd captures; the native handle is kept alive until this runs.
+    public void ReleaseOutput()
+    {
+        if (_handle < 0) return;
+        try
+        {
+            release_output(_handle, EVT_STDOUT);
+            release_output(_handle, EVT_STDERR);
+        }
+        catch { /* ignore */ }
     }
 
     public void Dispose()
     {
+        StandardInput?.Dispose();
         Stop();
+        ReleaseOutput();
+        _sinkOut?.CloseSpill();
+        _sinkErr?.CloseSpill();
+        // a child still running after Stop keeps no reference to us
+        if (_handle >= 0 && Volatile.Read(ref _exitWatched) == 1 && watch_exit(_handle, IntPtr.Zero, IntPtr.Zero) == 1
+            && Interlocked.Exchange(ref _exitWatched, 0) == 1)
+            _exitSelf.Free();
         _cts?.Dispose();
     }
 
-    // tiny helper so we can use TaskCompletionSource in netstandard-friendly way
-    private sealed class TaskCreationSource<T> : TaskCompletionSource<T>
+    private sealed class StdinStream : Stream
     {
-        public TaskCreationSource() : base(TaskCreationOptions.RunContinuationsAsynchronously) { }
+        private readonly int _handle;
+        private int _closed;
+
+        public StdinStream(int handle) { _handle = handle; }
+
+        public override bool CanRead => false;
+        public override bool CanSeek => false;
+        public override bool CanWrite => Volatile.Read(ref _closed) == 0;
+        public override long Length => throw new NotSupportedException();
+        public override long Position
+        {
+            get => throw new NotSupportedException();
+            set => throw new NotSupportedException();
+        }
+
+        public override void Write(byte[] buffer, int offset, int count) =>
+            Write(new ReadOnlySpan<byte>(buffer, offset, count));
+
+        public override void Write(ReadOnlySpan<byte> buffer)
+        {
+            while (!buffer.IsEmpty)
+            {
+                int n = TryWrite(buffer);
+                if (n > 0) buffer = buffer.Slice(n);
+                else WaitWritable();
+            }
+        }
+
+        public override async ValueTask WriteAsync(ReadOnlyMemory<byte> buffer, CancellationToken cancellationToken = default)
+        {
+            while (!buffer.IsEmpty)
+            {
+                cancellationToken.ThrowIfCancellationRequested();
+                int n = TryWrite(buffer.Span);
+                if (n > 0) buffer = buffer.Slice(n);
+                // pipe full: only the wait leaves this thread
+                else await Task.Run(WaitWritable, cancellationToken).ConfigureAwait(false);
+            }
+        }
+
+        public override Task WriteAsync(byte[] buffer, int offset, int count, CancellationToken cancellationToken) =>
+            WriteAsync(new ReadOnlyMemory<byte>(buffer, offset, count), cancellationToken).AsTask();
+
+        // bytes accepted, 0 if the pipe is full
+        private unsafe int TryWrite(ReadOnlySpan<byte> buffer)
+        {
+            if (Volatile.Read(ref _closed) != 0) throw new ObjectDisposedException(nameof(StdinStream));
+            int n;
+            fixed (byte* p = buffer) n = write_stdin(_handle, p, buffer.Length);
+            if (n < 0) throw new IOException("child stdin is closed");
+            return n;
+        }
+
+        private void WaitWritable()
+        {
+            int mask = EV_STDIN;
+            if (wait_events(_handle, WAIT_SLICE_MS, ref mask) < 0) throw new IOException("child stdin is closed");
+        }
+
+        public override void Flush() { } // writes go straight to the pipe
+        public override int Read(byte[] buffer, int offset, int count) => throw new NotSupportedException();
+        public override long Seek(long offset, SeekOrigin origin) => throw new NotSupportedException();
+        public override void SetLength(long value) => throw new NotSupportedException();
+
+        protected override void Dispose(bool disposing)
+        {
+            if (Interlocked.Exchange(ref _closed, 1) == 0)
+            {
+                try { close_stdin(_handle); } catch { /* ignore */ }
+            }
+            base.Dispose(disposing);
+        }
     }
-}
 
-}
+    // Native read buffer for the reader thread: doubles while reads keep filling it (from
+    // BUF_SIZE up to MAX_READ_SIZE), so a chatty child costs fewer reads, and halves again
+    // after SHRINK_AFTER_READS reads that used under a quarter of it.
+    private sealed class ReadBuffer : IDisposable
+    {
+        private int _smallReads;
+
+        public IntPtr Ptr { get; private set; } = Marshal.AllocHGlobal(BUF_SIZE);
+        public int Size { get; private set; } = BUF_SIZE;
+
+        public void Observe(int n)
+        {
+            if (n >= Size)
+            {
+                _smallReads = 0;
+                if (Size < MAX_READ_SIZE) Resize(Size * 2);
+            }
+            else if (n >= Size / 4 || Size == BUF_SIZE)
+            {
+                _smallReads = 0;
+            }
+            else if (++_smallReads >= SHRINK_AFTER_READS)
+            {
+                _smallReads = 0;
+                Resize(Size / 2);
+            }
+        }
 
+        // the contents need not survive: every read starts from an empty buffer
+        private void Resize(int size)
+        {
+            IntPtr next = Marshal.AllocHGlobal(size);
+            Marshal.FreeHGlobal(Ptr);
+            Ptr = next;
+            Size = size;
+        }
+
+        public void Dispose()
+        {
+            Marshal.FreeHGlobal(Ptr);
+            Ptr = IntPtr.Zero;
+        }
+    }
+
+    // Line assembly and delivery for one stream: decodes UTF-8, splits it into lines, applies
+    // Limits and raises OnStdoutLine/OnStderrLine, directly or (MaxBufferedBytes) from a queue.
+    private sealed class OutputSink
+    {
+        private static int s_spillSeq;
+
+        // chars decoded per Decoder.Convert call
+        private const int DECODE_CHUNK = 4096;
+
+        private readonly ProcessStream _owner;
+        private readonly bool _isOut;
+        private readonly int _maxLine;
+        private readonly long _maxBuffered;
+        private readonly OutputPolicy _policy;
+        private readonly string? _spillDir;
+
+        // decoder state and partial line; used only by the thread reading this stream.
+        // The decoder keeps a character split across two reads; both buffers are pooled.
+        private readonly Decoder _decoder = Encoding.UTF8.GetDecoder();
+        private char[] _chars = Array.Empty<char>();
+        private char[] _partial = Array.Empty<char>();
+        private int _partialLen;
+        private bool _overflow; // the current line passed MaxLineLength (Truncate/Spill)
+
+        // delivery queue, under _lock
+        private readonly object _lock = new object();
+        private readonly Queue<string> _queue = new Queue<string>();
+        private readonly List<Action> _whenDrained = new List<Action>();
+        private long _queuedBytes;
+        private bool _draining;
+        private FileStream? _spill;
+
+        private long _dropped, _spilled;
+        private int _pauses;
+        private volatile bool _paused;
+
+        public OutputSink(ProcessStream owner, bool isOut, OutputLimits? limits)
+        {
+            _owner = owner;
+            _isOut = isOut;
+            _maxLine = Math.Max(0, limits?.MaxLineLength ?? 0);
+            _maxBuffered = Math.Max(0, limits?.MaxBufferedBytes ?? 0);
+            _policy = limits?.Policy ?? OutputPolicy.Block;
+            _spillDir = limits?.SpillDirectory;
+        }
+
+        public long BytesDropped => Interlocked.Read(ref _dropped);
+        public long BytesSpilled => Interlocked.Read(ref _spilled);
+        public int Pauses => Volatile.Read(ref _pauses);
+        public bool Paused => _paused;
+        public string? SpillPath { get; private set; }
+
+        private Action<string>? Handler => _isOut ? _owner.OnStdoutLine : _owner.OnStderrLine;
+        private LineSpanHandler? SpanHandler => _isOut ? _owner.OnStdoutLineSpan : _owner.OnStderrLineSpan;
+
+        // nobody listens: lines need not even be decoded
+        public bool Wanted => Handler != null || SpanHandler != null;
+
+        // Bytes as read from the pipe, cut anywhere.
+        public void Append(ReadOnlySpan<byte> bytes)
+        {
+            (_isOut ? _owner.OnStdoutData : _owner.OnStderrData)?.Invoke(bytes);
+            if (!Wanted) return;
+            Grow(ref _chars, DECODE_CHUNK, 0);
+            while (!bytes.IsEmpty)
+            {
+                _decoder.Convert(bytes, _chars, flush: false, out int used, out int n, out _);
+                bytes = bytes.Slice(used);
+                Split(_chars.AsSpan(0, n));
+            }
+        }
+
+        private void Split(ReadOnlySpan<char> text)
+        {
+            while (true)
+            {
+                int nl = text.IndexOf('\n');
+                if (nl < 0)
+                {
+                    AddPartial(text);
+                    return;
+                }
+                var line = text.Slice(0, nl);
+                text = text.Slice(nl + 1);
+                if (_partialLen == 0 && !_overflow && (_maxLine == 0 || line.Length <= _maxLine))
+                {
+                    // the whole line is in this chunk: deliver it from the decode buffer
+                    Deliver(TrimCr(line));
+                    continue;
+                }
+                AddPartial(line);
+                EndLine();
+            }
+        }
+
+        // A line framed elsewhere (ring, read_lines), in up to two parts; newline already removed.
+        // Not complete: the framer ran out of room first, and the line goes on in the next call
+        // (a character cut there is kept by the decoder, as in Append).
+        public void AddLine(ReadOnlySpan<byte> first, ReadOnlySpan<byte> second = default, bool complete = true)
+        {
+            if (!Wanted) return;
+            // bytes never decode to more chars than there are bytes, plus one held-over character
+            Grow(ref _chars, first.Length + second.Length + 2, 0);
+            _decoder.Convert(first, _chars, flush: complete && second.IsEmpty, out _, out int n, out _);
+            if (!second.IsEmpty)
+            {
+                _decoder.Convert(second, _chars.AsSpan(n), flush: complete, out _, out int m, out _);
+                n += m;
+            }
+            var line = _chars.AsSpan(0, n);
+            if (!complete)
+            {
+                AddPartial(line);
+                return;
+            }
+            if (_partialLen == 0 && !_overflow && (_maxLine == 0 || line.Length <= _maxLine))
+            {
+                Deliver(line);
+                return;
+            }
+            AddPartial(line);
+            EndLine();
+        }
+
+        // The stream ended: deliver what is left of the last line and sync the spill file.
+        public void Flush()
+        {
+            if (Wanted)
+            {
+                // an unfinished character at EOF becomes U+FFFD, as GetString would make it
+                Grow(ref _chars, DECODE_CHUNK, 0);
+                _decoder.Convert(ReadOnlySpan<byte>.Empty, _chars, flush: true, out _, out int n, out _);
+                if (n > 0) AddPartial(_chars.AsSpan(0, n));
+            }
+            if (_partialLen > 0 || _overflow) EndLine();
+            lock (_lock)
+            {
+                try { _spill?.Flush(); }
+                catch (IOException) { /* counted when written */ }
+            }
+        }
+
+        // The reader is done with this stream: hand the pooled buffers back.
+        public void Release()
+        {
+            Return(ref _chars);
+            Return(ref _partial);
+            _partialLen = 0;
+        }
+
+        private void AddPartial(ReadOnlySpan<char> text)
+        {
+            while (!text.IsEmpty)
+            {
+                if (_overflow)
+                {
+                    Overflow(text);
+                    return;
+                }
+                int room = _maxLine > 0 ? _maxLine - _partialLen : text.Length;
+                if (text.Length <= room)
+                {
+                    AppendPartial(text);
+                    return;
+                }
+                AppendPartial(text.Slice(0, room));
+                text = text.Slice(room);
+                if (_policy == OutputPolicy.Block) Deliver(TakePartial(trimCr: false));
+                else _overflow = true;
+            }
+        }
+
+        private void AppendPartial(ReadOnlySpan<char> text)
+        {
+            Grow(ref _partial, _partialLen + text.Length, _partialLen);
+            text.CopyTo(_partial.AsSpan(_partialLen));
+            _partialLen += text.Length;
+        }
+
+        // Make buf hold at least size chars, keeping the first keep of them.
+        private static void Grow(ref char[] buf, int size, int keep)
+        {
+            if (buf.Length >= size) return;
+            char[] next = ArrayPool<char>.Shared.Rent(Math.Max(size, Math.Max(DECODE_CHUNK, buf.Length * 2)));
+            buf.AsSpan(0, keep).CopyTo(next);
+            Return(ref buf);
+            buf = next;
+        }
+
+        private static void Return(ref char[] buf)
+        {
+            if (buf.Length > 0) ArrayPool<char>.Shared.Return(buf);
+            buf = Array.Empty<char>();
+        }
+
+        private static ReadOnlySpan<char> TrimCr(ReadOnlySpan<char> line) =>
+            line.Length > 0 && line[line.Length - 1] == '\r' ? line.Slice(0, line.Length - 1) : line;
+
+        private void Overflow(ReadOnlySpan<char> text)
+        {
+            if (_policy == OutputPolicy.Spill) Spill(text, newline: false);
+            else Interlocked.Add(ref _dropped, Encoding.UTF8.GetByteCount(text));
+        }
+
+        private void EndLine()
+        {
+            if (_overflow && _policy == OutputPolicy.Spill) Spill(ReadOnlySpan<char>.Empty, newline: true);
+            _overflow = false;
+            Deliver(TakePartial(trimCr: true));
+        }
+
+        // The span stays valid until the next append, i.e. for the Deliver it is passed to.
+        private ReadOnlySpan<char> TakePartial(bool trimCr)
+        {
+            var line = _partial.AsSpan(0, _partialLen);
+            _partialLen = 0;
+            return trimCr ? TrimCr(line) : line;
+        }
+
+        private void Deliver(ReadOnlySpan<char> line)
+        {
+            SpanHandler?.Invoke(line);
+            var handler = Handler;
+            if (handler == null) return;
+            if (_maxBuffered == 0)
+            {
+                handler(new string(line));
+                return;
+            }
+
+            long size = (long)line.Length * sizeof(char);
+            bool start;
+            lock (_lock)
+            {
+                // one line is always admitted, so the handler can make progress
+                if (_queue.Count > 0 && _queuedBytes + size > _maxBuffered)
+                {
+                    switch (_policy)
+                    {
+                        case OutputPolicy.Truncate:
+                            Interlocked.Add(ref _dropped, Encoding.UTF8.GetByteCount(line) + 1);
+                            return;
+                        case OutputPolicy.Spill:
+                            Spill(line, newline: true);
+                            return;
+                        default:
+                            // admitted anyway: what was already read has to go somewhere
+                            if (!_paused)
+                            {
+                                _paused = true;
+                                Interlocked.Increment(ref _pauses);
+                                _owner.PauseStream(_isOut, true);
+                            }
+                            break;
+                    }
+                }
+                _queue.Enqueue(new string(line));
+                _queuedBytes += size;
+                start = !_draining;
+                _draining = true;
+            }
+            if (start) ThreadPool.UnsafeQueueUserWorkItem(s => ((OutputSink)s!).Drain(), this);
+        }
+
+        private void Drain()
+        {
+            var handler = Handler;
+            while (true)
+            {
+                string line;
+                Action[]? done = null;
+                lock (_lock)
+                {
+                    if (_queue.Count == 0)
+                    {
+                        _draining = false;
+                        if (_whenDrained.Count == 0) return;
+                        done = _whenDrained.ToArray();
+                        _whenDrained.Clear();
+                        line = "";
+                    }
+                    else
+                    {
+                        line = _queue.Dequeue();
+                        _queuedBytes -= (long)line.Length * sizeof(char);
+                        if (_paused && _queuedBytes <= _maxBuffered / 2)
+                        {
+                            _paused = false;
+                            _owner.PauseStream(_isOut, false);
+                        }
+                    }
+                }
+                if (done != null)
+                {
+                    foreach (var action in done) action();
+                    return;
+                }
+                try { handler?.Invoke(line); }
+                catch (Exception ex)
+                {
+                    // on the pool there is nobody to rethrow to
+                    if (_owner.Debug) Console.WriteLine($"[proc] line handler threw: {ex.Message}");
+                }
+            }
+        }
+
+        // Run action once the queue is empty (now, if it already is). Actions keep their order.
+        public void WhenDrained(Action action)
+        {
+            lock (_lock)
+            {
+                if (_draining)
+                {
+                    _whenDrained.Add(action);
+                    return;
+                }
+            }
+            action();
+        }
+
+        private void Spill(ReadOnlySpan<char> text, bool newline)
+        {
+            lock (_lock)
+            {
+                try
+                {
+                    if (_spill == null)
+                    {
+                        string dir = _spillDir ?? Path.GetTempPath();
+                        string name = $"procwrapper-{Environment.ProcessId}-{Interlocked.Increment(ref s_spillSeq)}.{(_isOut ? "stdout" : "stderr")}";
+                        SpillPath = Path.Combine(dir, name);
+                        _spill = new FileStream(SpillPath, FileMode.Append, FileAccess.Write, FileShare.Read);
+                    }
+                    int max = Encoding.UTF8.GetMaxByteCount(text.Length) + 1;
+                    byte[] buf = ArrayPool<byte>.Shared.Rent(max);
+                    try
+                    {
+                        int n = Encoding.UTF8.GetBytes(text, buf);
+                        if (newline) buf[n++] = (byte)'\n';
+                        _spill.Write(buf, 0, n);
+                        Interlocked.Add(ref _spilled, n);
+                    }
+                    finally
+                    {
+                        ArrayPool<byte>.Shared.Return(buf);
+                    }
+                }
+                catch (Exception ex) when (ex is IOException || ex is UnauthorizedAccessException)
+                {
+                    // nowhere to spill to: fall back to dropping
+                    Interlocked.Add(ref _dropped, Encoding.UTF8.GetByteCount(text) + (newline ? 1 : 0));
+                }
+            }
+        }
+
+        public void CloseSpill()
+        {
+            lock (_lock)
+            {
+                _spill?.Dispose();
+                _spill = null;
+            }
+        }
+    }
+
+    // tiny helper so we can use TaskCompletionSource in netstandard-friendly way
+    private sealed class TaskCreationSource<T> : TaskCompletionSource<T>
+    {
+        public TaskCreationSource() : base(TaskCreationOptions.RunContinuationsAsynchronously) { }
+    }
+}
+
+    // One unit of work for ProcessPool. Configure runs on the fresh ProcessStream before
+    // Start (environment, redirects, line handlers); the pool owns Start and Dispose.
+    public sealed class ProcessJob
+    {
+        public string ExePath { get; }
+        public string[] Args { get; }
+        public int Priority { get; init; } // higher starts first; FIFO within a priority
+        public Action<ProcessStream>? Configure { get; init; }
+        public CancellationToken CancellationToken { get; init; } // queued: dropped, running: stopped
+
+        public ProcessJob(string exePath, params string[] args)
+        {
+            ExePath = exePath ?? throw new ArgumentNullException(nameof(exePath));
+            Args = args ?? Array.Empty<string>();
+        }
+    }
+
+    public readonly struct ProcessJobResult
+    {
+        public int ExitCode { get; }
+        public ProcStats? Stats { get; }
+
+        internal ProcessJobResult(int exitCode, ProcStats? stats)
+        {
+            ExitCode = exitCode;
+            Stats = stats;
+        }
+    }
+
+    // Runs ProcessJobs at most Limit at a time and queues the rest by priority. Children are
+    // served by the shared native event loop, so a running job costs no thread, and launches
+    // wait for a free native slot instead of failing.
+    public sealed class ProcessPool : IDisposable
+    {
+        private sealed class Pending
+        {
+            public readonly ProcessJob Job;
+            public readonly TaskCompletionSource<ProcessJobResult> Tcs =
+                new TaskCompletionSource<ProcessJobResult>(TaskCreationOptions.RunContinuationsAsynchronously);
+            public CancellationTokenRegistration Registration;
+            public ProcessStream? Stream;
+            public int State; // QUEUED, STARTED or CANCELED
+
+            public Pending(ProcessJob job) => Job = job;
+        }
+
+        private const int QUEUED = 0, STARTED = 1, CANCELED = 2;
+
+        // how often the adaptive limit is re-evaluated, and the utilization band it keeps
+        private static readonly TimeSpan AdaptInterval = TimeSpan.FromMilliseconds(250);
+        private const double AdaptRaiseBelow = 0.75;
+        private const double AdaptLowerAbove = 0.95;
+
+        // retry period while every native slot is taken by children outside the pool
+        private const int SLOT_RETRY_MS = 50;
+
+        private readonly object _lock = new object();
+        private readonly PriorityQueue<Pending, (int, long)> _queue = new PriorityQueue<Pending, (int, long)>();
+        private long _seq;
+        private int _queued; // _queue minus canceled entries not yet dequeued
+        private int _running;
+        private int _concurrency;
+        private int _limit;
+        private bool _disposed;
+        private bool _retryArmed;
+
+        // adaptive window: child CPU time finished since _windowStart
+        private long _windowStart = System.Diagnostics.Stopwatch.GetTimestamp();
+        private long _windowCpuUs;
+
+        public ProcessPool(int concurrency = 0)
+        {
+            _concurrency = _limit = concurrency > 0 ? concurrency : Environment.ProcessorCount;
+        }
+
+        // Baseline number of jobs run at once (default: core count).
+        public int Concurrency
+        {
+            get { lock (_lock) return _concurrency; }
+            set
+            {
+                if (value < 1) throw new ArgumentOutOfRangeException(nameof(value));
+                lock (_lock) _concurrency = _limit = value;
+                Pump();
+            }
+        }
+
+        // With AdaptiveConcurrency the limit rises above Concurrency (up to MaxConcurrency)
+        // while the jobs leave cores idle, e.g. when they mostly wait on I/O, and falls back
+        // toward Concurrency once the CPUs are saturated. Usage is measured from the
+        // children's own CPU time (ProcStats), not the whole machine.
+        public bool AdaptiveConcurrency { get; set; }
+        public int MaxConcurrency { get; set; } = Environment.ProcessorCount * 4;
+
+        // SIGTERM to SIGKILL grace when a running job is canceled.
+        public TimeSpan CancelGrace { get; set; } = TimeSpan.FromSeconds(2);
+
+        public int Limit { get { lock (_lock) return AdaptiveConcurrency ? _limit : _concurrency; } }
+        public int Running { get { lock (_lock) return _running; } }
+        public int Queued { get { lock (_lock) return _queued; } }
+
+        public Task<ProcessJobResult> Run(ProcessJob job)
+        {
+            if (job == null) throw new ArgumentNullException(nameof(job));
+            var token = job.CancellationToken;
+            if (token.IsCancellationRequested) return Task.FromCanceled<ProcessJobResult>(token);
+
+            var pending = new Pending(job);
+            lock (_lock)
+            {
+                if (_disposed) throw new ObjectDisposedException(nameof(ProcessPool));
+                _queue.Enqueue(pending, (-job.Priority, _seq++));
+                _queued++;
+            }
+            if (token.CanBeCanceled) pending.Registration = token.Register(() => Cancel(pending));
+            Pump();
+            return pending.Tcs.Task;
+        }
+
+        public Task<ProcessJobResult> Run(string exePath, params string[] args) => Run(new ProcessJob(exePath, args));
+
+        private void Cancel(Pending pending)
+        {
+            int prev = Interlocked.CompareExchange(ref pending.State, CANCELED, QUEUED);
+            if (prev == QUEUED)
+            {
+                lock (_lock) _queued--; // the entry itself is skipped when dequeued
+                pending.Tcs.TrySetCanceled(pending.Job.CancellationToken);
+            }
+            else if (prev == STARTED)
+            {
+                // Complete reports the cancellation once the child is gone
+                _ = pending.Stream?.StopAsync(CancelGrace);
+            }
+        }
+
+        // Start queued jobs while there is room under the limit and in the native table.
+        private void Pump()
+        {
+            while (true)
+            {
+                Pending? next = null;
+                lock (_lock)
+                {
+                    if (_running >= (AdaptiveConcurrency ? _limit : _concurrency)) return;
+                    while (_queue.TryPeek(out var head, out _) && Volatile.Read(ref head.State) == CANCELED)
+                        _queue.Dequeue();
+                    if (_queue.Count == 0) return;
+                    if (SlotsExhausted())
+                    {
+                        // our own completions pump again; otherwise poll until outsiders let go
+                        if (_running == 0 && !_retryArmed)
+                        {
+                            _retryArmed = true;
+                            _ = Task.Delay(SLOT_RETRY_MS).ContinueWith(_ => { lock (_lock) _retryArmed = false; Pump(); },
+                                TaskScheduler.Default);
+                        }
+                        return;
+                    }
+                    next = _queue.Dequeue();
+                    if (Interlocked.CompareExchange(ref next.State, STARTED, QUEUED) != QUEUED) continue;
+                    _queued--;
+                    _running++;
+                }
+                Launch(next);
+            }
+        }
+
+        private static bool SlotsExhausted()
+        {
+            try { return get_slot_usage(out int inUse, out int capacity) >= 0 && inUse >= capacity; }
+            catch { return false; }
+        }
+
+        private void Launch(Pending pending)
+        {
+            var job = pending.Job;
+            var ps = new ProcessStream { Debug = false };
+            pending.Stream = ps;
+            try
+            {
+                job.Configure?.Invoke(ps);
+                if (!ps.Start(job.ExePath, job.Args))
+                {
+                    throw new InvalidOperationException($"failed to start {job.ExePath}: {ps.StartError ?? "unknown error"}",
+                        ps.StartErrno != 0 ? new System.ComponentModel.Win32Exception(ps.StartErrno) : null);
+                }
+            }
+            catch (Exception ex)
+            {
+                lock (_lock) _running--;
+                pending.Registration.Dispose();
+                pending.Tcs.TrySetException(ex);
+                Pump();
+                return;
+            }
+            // canceled between dequeue and Start: Cancel saw STARTED before Stream was usable
+            if (job.CancellationToken.IsCancellationRequested) _ = ps.StopAsync(CancelGrace);
+            _ = Complete(pending, ps);
+        }
+
+        private async Task Complete(Pending pending, ProcessStream ps)
+        {
+            ProcessJobResult result = default;
+            Exception? error = null;
+            try
+            {
+                int ec = await ps.WaitForExitAsync().ConfigureAwait(false);
+                await ps.WaitForDrainAsync().ConfigureAwait(false);
+                result = new ProcessJobResult(ec, ps.Stats);
+            }
+            catch (Exception ex)
+            {
+                error = ex;
+            }
+            finally
+            {
+                ps.Dispose();
+            }
+
+            lock (_lock)
+            {
+                _running--;
+                if (result.Stats is ProcStats stats) Observe(stats);
+            }
+            pending.Registration.Dispose();
+            var token = pending.Job.CancellationToken;
+            if (error != null) pending.Tcs.TrySetException(error);
+            else if (token.IsCancellationRequested) pending.Tcs.TrySetCanceled(token);
+            else pending.Tcs.TrySetResult(result);
+            Pump();
+        }
+
+        // Called under _lock for every finished job.
+        private void Observe(in ProcStats stats)
+        {
+            if (!AdaptiveConcurrency) return;
+            _windowCpuUs += stats.UserTimeUs + stats.SystemTimeUs;
+            long now = System.Diagnostics.Stopwatch.GetTimestamp();
+            double elapsed = (double)(now - _windowStart) / System.Diagnostics.Stopwatch.Frequency;
+            if (elapsed < AdaptInterval.TotalSeconds) return;
+
+            double utilization = _windowCpuUs / 1e6 / (elapsed * Environment.ProcessorCount);
+            if (utilization < AdaptRaiseBelow && _queued > 0 && _limit < MaxConcurrency) _limit++;
+            else if (utilization > AdaptLowerAbove && _limit > _concurrency) _limit--;
+            _windowStart = now;
+            _windowCpuUs = 0;
+        }
+
+        // Drops queued jobs (their tasks are canceled); running jobs finish normally.
+        public void Dispose()
+        {
+            var dropped = new List<Pending>();
+            lock (_lock)
+            {
+                _disposed = true;
+                while (_queue.TryDequeue(out var pending, out _))
+                {
+                    if (Interlocked.CompareExchange(ref pending.State, CANCELED, QUEUED) == QUEUED) dropped.Add(pending);
+                }
+                _queued = 0;
+            }
+            foreach (var pending in dropped)
+            {
+                pending.Registration.Dispose();
+                pending.Tcs.TrySetCanceled();
+            }
+        }
+    }
+
+    // How WorkerSession tells where one response ends on the worker's stdout.
+    public enum WorkerFraming
+    {
+        Delimiter,    // requests are written as given; a response runs up to WorkerOptions.Delimiter
+        LengthPrefix, // both ways: a 4-byte big-endian length, then that many bytes
+    }
+
+    // What a WorkerSession runs and how it talks to it. Configure runs on the fresh
+    // ProcessStream before Start (environment, placement, stderr handlers); the session
+    // owns stdin and stdout.
+    public sealed class WorkerOptions
+    {
+        public string ExePath { get; }
+        public string[] Args { get; }
+        public WorkerFraming Framing { get; init; } = WorkerFraming.Delimiter;
+        public byte[] Delimiter { get; init; } = { (byte)'\n' };
+        public int GreetingFrames { get; init; } // frames the worker prints before its first request (a banner, a prompt)
+        public int MaxResponseBytes { get; init; } = 16 * 1024 * 1024;
+        public TimeSpan? RequestTimeout { get; init; } // a worker that misses it is killed
+        public TimeSpan ShutdownGrace { get; init; } = TimeSpan.FromSeconds(2); // after stdin EOF, before SIGTERM
+        public int MaxRequestsPerWorker { get; init; } // WorkerPool retires a worker after this many; 0 = never
+        public Action<ProcessStream>? Configure { get; init; }
+
+        public WorkerOptions(string exePath, params string[] args)
+        {
+            ExePath = exePath ?? throw new ArgumentNullException(nameof(exePath));
+            Args = args ?? Array.Empty<string>();
+        }
+    }
+
+    // One long-lived child fed requests over its stdin, answering on its stdout: the
+    // startup cost (exec, dynamic loading, provider modules) is paid once rather than per
+    // call. The worker must answer in order; responses are matched to requests FIFO, so
+    // several may be in flight. Stdout bytes go straight from the read buffer into the
+    // framer, with one array per response.
+    public sealed class WorkerSession : IDisposable
+    {
+        private readonly WorkerOptions _options;
+        private readonly ProcessStream _proc;
+        private readonly SemaphoreSlim _writeLock = new SemaphoreSlim(1, 1);
+        private readonly Queue<TaskCompletionSource<byte[]>> _pending = new Queue<TaskCompletionSource<byte[]>>(); // under itself
+        private readonly TaskCompletionSource<bool> _ready =
+            new TaskCompletionSource<bool>(TaskCreationOptions.RunContinuationsAsynchronously);
+        private int _greetingLeft;
+        private long _requests, _unsolicited;
+        private int _dead; // exited, or the framing can no longer be trusted
+        private int _disposed;
+
+        // framer state: only the thread reading stdout touches it
+        private byte[] _buf = Array.Empty<byte>();
+        private int _len;
+        private int _scan; // Delimiter: _buf[.._scan) holds no delimiter start
+
+        private WorkerSession(WorkerOptions options)
+        {
+            _options = options;
+            _greetingLeft = options.GreetingFrames;
+            if (options.Framing == WorkerFraming.Delimiter && (options.Delimiter == null || options.Delimiter.Length == 0))
+                throw new ArgumentException("Delimiter framing needs a delimiter", nameof(options));
+            _proc = new ProcessStream { RedirectStdin = true };
+            options.Configure?.Invoke(_proc);
+            // the session frames stdout itself; native line framing would starve OnStdoutData
+            if (_proc.HasStdoutLineBatches)
+                throw new ArgumentException("Configure must not subscribe OnStdoutLines on a worker", nameof(options));
+            _proc.RedirectStdin = true;
+            _proc.RingBufferSize = 0;
+            _proc.OnStdoutData += OnData;
+        }
+
+        // Start the worker and wait for its greeting frames, if any.
+        public static async Task<WorkerSession> StartAsync(WorkerOptions options, CancellationToken cancellationToken = default)
+        {
+            if (options == null) throw new ArgumentNullException(nameof(options));
+            var session = new WorkerSession(options);
+            if (!session._proc.Start(options.ExePath, options.Args))
+            {
+                var ps = session._proc;
+                ps.Dispose();
+                throw new InvalidOperationException($"failed to start worker {options.ExePath}: {ps.StartError ?? "unknown error"}",
+                    ps.StartErrno != 0 ? new System.ComponentModel.Win32Exception(ps.StartErrno) : null);
+            }
+            _ = session.WatchExit();
+            if (options.GreetingFrames <= 0) session._ready.TrySetResult(true);
+            try
+            {
+                var ready = session._ready.Task;
+                if (options.RequestTimeout is { } t) ready = ready.WaitAsync(t, cancellationToken);
+                else if (cancellationToken.CanBeCanceled) ready = ready.WaitAsync(cancellationToken);
+                await ready.ConfigureAwait(false);
+            }
+            catch
+            {
+                session.Kill();
+                throw;
+            }
+            return session;
+        }
+
+        public bool IsAlive => Volatile.Read(ref _dead) == 0;
+        public long Requests => Interlocked.Read(ref _requests);
+        public long UnsolicitedFrames => Interlocked.Read(ref _unsolicited); // answers nobody asked for, dropped
+        public int InFlight { get { lock (_pending) return _pending.Count; } }
+        public ProcessStream Process => _proc;
+
+        // Send one request and await its response (its frame, delimiter or length excluded).
+        // Cancelling abandons the wait only: the response is still owed and consumed in order.
+        public async Task<byte[]> SendAsync(ReadOnlyMemory<byte> request, CancellationToken cancellationToken = default)
+        {
+            if (Volatile.Read(ref _disposed) != 0) throw new ObjectDisposedException(nameof(WorkerSession));
+            var tcs = new TaskCompletionSource<byte[]>(TaskCreationOptions.RunContinuationsAsynchronously);
+            await _writeLock.WaitAsync(cancellationToken).ConfigureAwait(false);
+            try
+            {
+                if (!IsAlive) throw new IOException("worker is gone");
+                lock (_pending) _pending.Enqueue(tcs); // in write order, so responses match up
+                Interlocked.Increment(ref _requests);
+                var stdin = _proc.StandardInput!;
+                if (_options.Framing == WorkerFraming.LengthPrefix)
+                {
+                    byte[] header = new byte[4];
+                    System.Buffers.Binary.BinaryPrimitives.WriteInt32BigEndian(header, request.Length);
+                    await stdin.WriteAsync(header, CancellationToken.None).ConfigureAwait(false);
+                }
+                // not cancellable: half a request would leave the worker out of step
+                await stdin.WriteAsync(request, CancellationToken.None).ConfigureAwait(false);
+            }
+            catch (Exception ex) when (ex is IOException || ex is ObjectDisposedException)
+            {
+                Fail(new IOException("worker stdin is closed", ex));
+                throw;
+            }
+            finally
+            {
+                _writeLock.Release();
+            }
+
+            var response = tcs.Task;
+            if (_options.RequestTimeout is { } timeout)
+            {
+                try { return await response.WaitAsync(timeout, cancellationToken).ConfigureAwait(false); }
+                catch (TimeoutException)
+                {
+                    Kill(); // whatever it answers now would be matched to the wrong request
+                    throw;
+                }
+            }
+            return cancellationToken.CanBeCanceled
+                ? await response.WaitAsync(cancellationToken).ConfigureAwait(false)
+                : await response.ConfigureAwait(false);
+        }
+
+        public Task<byte[]> SendAsync(string request, CancellationToken cancellationToken = default) =>
+            SendAsync(Encoding.UTF8.GetBytes(request), cancellationToken);
+
+        public async Task<string> SendStringAsync(string request, CancellationToken cancellationToken = default) =>
+            Encoding.UTF8.GetString(await SendAsync(request, cancellationToken).ConfigureAwait(false));
+
+        // stdout reader thread
+        private void OnData(ReadOnlySpan<byte> data)
+        {
+            if (Volatile.Read(ref _dead) != 0) return;
+            if (_buf.Length - _len < data.Length)
+            {
+                int size = Math.Max(Math.Max(_buf.Length * 2, 4096), _len + data.Length);
+                byte[] grown = ArrayPool<byte>.Shared.Rent(size);
+                Buffer.BlockCopy(_buf, 0, grown, 0, _len);
+                if (_buf.Length > 0) ArrayPool<byte>.Shared.Return(_buf);
+                _buf = grown;
+            }
+            data.CopyTo(_buf.AsSpan(_len));
+            _len += data.Length;
+
+            int consumed = 0;
+            while (TryFrame(consumed, out int start, out int length, out int next))
+            {
+                Deliver(_buf.AsSpan(start, length));
+                consumed = next;
+            }
+            if (consumed > 0)
+            {
+                Buffer.BlockCopy(_buf, consumed, _buf, 0, _len - consumed);
+                _len -= consumed;
+                _scan = Math.Max(0, _scan - consumed);
+            }
+            if (_len > _options.MaxResponseBytes + 4 && Volatile.Read(ref _dead) == 0)
+                Fail(new InvalidDataException($"worker response exceeds {_options.MaxResponseBytes} bytes"), kill: true);
+        }
+
+        // Finds the next whole frame in _buf from 'from' on.
+        private bool TryFrame(int from, out int start, out int length, out int next)
+        {
+            start = from;
+            length = next = 0;
+            if (_options.Framing == WorkerFraming.LengthPrefix)
+            {
+                if (_len - from < 4) return false;
+                int n = System.Buffers.Binary.BinaryPrimitives.ReadInt32BigEndian(_buf.AsSpan(from, 4));
+                if (n < 0 || n > _options.MaxResponseBytes)
+                {
+                    Fail(new InvalidDataException($"worker sent a frame length of {n}"), kill: true);
+                    return false;
+                }
+                if (_len - from - 4 < n) return false;
+                start = from + 4;
+                length = n;
+                next = start + n;
+                return true;
+            }
+
+            byte[] delim = _options.Delimiter;
+            int scan = Math.Max(from, _scan);
+            int at = _buf.AsSpan(scan, _len - scan).IndexOf(delim);
+            if (at < 0)
+            {
+                _scan = Math.Max(from, _len - delim.Length + 1);
+                return false;
+            }
+            length = scan + at - from;
+            next = scan + at + delim.Length;
+            _scan = next;
+            return true;
+        }
+
+        private void Deliver(ReadOnlySpan<byte> frame)
+        {
+            TaskCompletionSource<byte[]>? tcs = null;
+            lock (_pending)
+            {
+                if (_pending.Count > 0) tcs = _pending.Dequeue();
+            }
+            if (tcs != null)
+            {
+                tcs.TrySetResult(frame.ToArray());
+            }
+            else if (_greetingLeft > 0)
+            {
+                if (--_greetingLeft == 0) _ready.TrySetResult(true);
+            }
+            else
+            {
+                Interlocked.Increment(ref _unsolicited);
+            }
+        }
+
+        private async Task WatchExit()
+        {
+            int code = await _proc.WaitForExitAsync().ConfigureAwait(false);
+            await _proc.WaitForDrainAsync().ConfigureAwait(false); // last responses first
+            Fail(new IOException($"worker exited with code {code}"));
+            _proc.Dispose();
+        }
+
+        // The session cannot go on: fail what is in flight (and the greeting wait).
+        private void Fail(Exception error, bool kill = false)
+        {
+            Volatile.Write(ref _dead, 1);
+            List<TaskCompletionSource<byte[]>> failed;
+            lock (_pending)
+            {
+                failed = new List<TaskCompletionSource<byte[]>>(_pending);
+                _pending.Clear();
+            }
+            foreach (var tcs in failed) tcs.TrySetException(error);
+            _ready.TrySetException(error);
+            if (kill) _ = _proc.StopAsync(TimeSpan.Zero);
+        }
+
+        private void Kill() => Fail(new IOException("worker was killed"), kill: true);
+
+        // Sends EOF on stdin; a worker that has not left after ShutdownGrace is stopped.
+        public void Dispose()
+        {
+            if (Interlocked.Exchange(ref _disposed, 1) != 0) return;
+            try { _proc.StandardInput?.Dispose(); } catch { /* already gone */ }
+            if (!IsAlive) return;
+            _ = Task.Delay(_options.ShutdownGrace).ContinueWith(_ =>
+            {
+                if (IsAlive) _ = _proc.StopAsync(TimeSpan.FromSeconds(1));
+            }, TaskScheduler.Default);
+        }
+    }
+
+    // Warm WorkerSessions for one binary (one WorkerOptions): a request takes an idle
+    // worker, or starts one while under MaxWorkers, or waits for the next to come free.
+    // Workers that die, time out or reach MaxRequestsPerWorker are replaced on demand.
+    public sealed class WorkerPool : IDisposable
+    {
+        private readonly WorkerOptions _options;
+        private readonly object _lock = new object();
+        private readonly Stack<WorkerSession> _idle = new Stack<WorkerSession>(); // most recently used on top
+        private readonly Queue<TaskCompletionSource<WorkerSession?>> _waiters = new Queue<TaskCompletionSource<WorkerSession?>>();
+        private int _workers; // idle, busy and starting
+        private long _started;
+        private bool _disposed;
+
+        public WorkerPool(WorkerOptions options, int maxWorkers = 0)
+        {
+            _options = options ?? throw new ArgumentNullException(nameof(options));
+            MaxWorkers = maxWorkers > 0 ? maxWorkers : Environment.ProcessorCount;
+        }
+
+        public int MaxWorkers { get; }
+        public int Workers { get { lock (_lock) return _workers; } }
+        public int Idle { get { lock (_lock) return _idle.Count; } }
+        public long WorkersStarted => Interlocked.Read(ref _started);
+
+        // Start workers until count are up (at most MaxWorkers), so the first requests do
+        // not pay for the startup.
+        public async Task WarmAsync(int count, CancellationToken cancellationToken = default)
+        {
+            var starting = new List<Task<WorkerSession>>();
+            lock (_lock)
+            {
+                while (_workers < Math.Min(count, MaxWorkers))
+                {
+                    _workers++;
+                    starting.Add(StartWorker(cancellationToken));
+                }
+            }
+            // every start is released, failed or not, before a failure is rethrown
+            try { await Task.WhenAll(starting).ConfigureAwait(false); }
+            finally
+            {
+                foreach (var t in starting)
+                    Release(t.IsCompletedSuccessfully ? t.Result : null, reusable: t.IsCompletedSuccessfully);
+            }
+        }
+
+        public async Task<byte[]> SendAsync(ReadOnlyMemory<byte> request, CancellationToken cancellationToken = default)
+        {
+            var worker = await Acquire(cancellationToken).ConfigureAwait(false);
+            bool reusable = false;
+            try
+            {
+                var response = await worker.SendAsync(request, cancellationToken).ConfigureAwait(false);
+                reusable = true;
+                return response;
+            }
+            catch (OperationCanceledException)
+            {
+                reusable = true; // the response is still consumed in order; IsAlive decides
+                throw;
+            }
+            finally
+            {
+                Release(worker, reusable);
+            }
+        }
+
+        public Task<byte[]> SendAsync(string request, CancellationToken cancellationToken = default) =>
+            SendAsync(Encoding.UTF8.GetBytes(request), cancellationToken);
+
+        public async Task<string> SendStringAsync(string request, CancellationToken cancellationToken = default) =>
+            Encoding.UTF8.GetString(await SendAsync(request, cancellationToken).ConfigureAwait(false));
+
+        private async Task<WorkerSession> Acquire(CancellationToken cancellationToken)
+        {
+            while (true)
+            {
+                TaskCompletionSource<WorkerSession?>? waiter = null;
+                lock (_lock)
+                {
+                    if (_disposed) throw new ObjectDisposedException(nameof(WorkerPool));
+                    while (_idle.Count > 0)
+                    {
+                        var w = _idle.Pop();
+                        if (w.IsAlive) return w;
+                        w.Dispose();
+                        _workers--;
+                    }
+                    if (_workers < MaxWorkers)
+                        _workers++;
+                    else
+                    {
+                        waiter = new TaskCompletionSource<WorkerSession?>(TaskCreationOptions.RunContinuationsAsynchronously);
+                        _waiters.Enqueue(waiter);
+                    }
+                }
+                if (waiter == null)
+                {
+                    try { return await StartWorker(cancellationToken).ConfigureAwait(false); }
+                    catch
+                    {
+                        Release(null, reusable: false);
+                        throw;
+                    }
+                }
+
+                WorkerSession? handed;
+                using (cancellationToken.Register(() => waiter.TrySetCanceled(cancellationToken)))
+                    handed = await waiter.Task.ConfigureAwait(false);
+                if (handed != null) return handed;
+                // null: a worker slot came free instead; go round and start one
+            }
+        }
+
+        private async Task<WorkerSession> StartWorker(CancellationToken cancellationToken)
+        {
+            var w = await WorkerSession.StartAsync(_options, cancellationToken).ConfigureAwait(false);
+            Interlocked.Increment(ref _started);
+            return w;
+        }
+
+        // Hand a worker back (null: a start failed). Passed to the oldest waiter still
+        // waiting, kept idle, or retired, in which case a waiter is told to start its own.
+        private void Release(WorkerSession? worker, bool reusable)
+        {
+            bool retire = worker == null || !reusable || !worker.IsAlive ||
+                          (_options.MaxRequestsPerWorker > 0 && worker.Requests >= _options.MaxRequestsPerWorker);
+            lock (_lock)
+            {
+                if (retire || _disposed)
+                {
+                    worker?.Dispose();
+                    _workers--;
+                    // its slot goes to a waiter, who starts a fresh worker
+                    while (!_disposed && _waiters.Count > 0)
+                    {
+                        if (_waiters.Dequeue().TrySetResult(null)) break;
+                    }
+                    return;
+                }
+                while (_waiters.Count > 0)
+                {
+                    if (_waiters.Dequeue().TrySetResult(worker)) return;
+                }
+                _idle.Push(worker!);
+            }
+        }
+
+        // Shuts down idle workers and refuses new requests; busy ones finish their request.
+        public void Dispose()
+        {
+            List<WorkerSession> idle;
+            List<TaskCompletionSource<WorkerSession?>> waiters;
+            lock (_lock)
+            {
+                _disposed = true;
+                idle = new List<WorkerSession>(_idle);
+                _idle.Clear();
+                _workers -= idle.Count;
+                waiters = new List<TaskCompletionSource<WorkerSession?>>(_waiters);
+                _waiters.Clear();
+            }
+            foreach (var w in idle) w.Dispose();
+            foreach (var waiter in waiters) waiter.TrySetException(new ObjectDisposedException(nameof(WorkerPool)));
+        }
+    }
+}
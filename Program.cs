@@ -46,7 +46,7 @@ class Program
         }
 
         // Build platform-specific command
-        (string exePath, string[] args) = BuildPlatformCommand(
+        (string exePath, string[] args, var env) = BuildPlatformCommand(
             binaryPathOrName: binary,
             subCommand: subArgs,
             linuxLibDir: linuxLibDir,
@@ -54,6 +54,7 @@ class Program
         );
 
         var ps = new NativeProc.ProcessStream { Debug = true };
+        foreach (var kv in env) ps.EnvironmentVariables[kv.Key] = kv.Value;
         ps.OnStdoutLine += l => Console.WriteLine("[OUT] " + l);
         ps.OnStderrLine += l => Console.WriteLine("[ERR] " + l);
         ps.OnExited     += ec => Console.WriteLine($">>> Exited with code {ec}");
@@ -72,11 +73,11 @@ class Program
 
     /// <summary>
     /// Build a platform-appropriate command:
-    /// - Linux desktop: execute the glibc loader with --library-path <linuxLibDir> <binary> <args...>
+    /// - Linux desktop: execute the binary with LD_LIBRARY_PATH and OPENSSL_MODULES set to <linuxLibDir>
     /// - Android: execute the binary directly (typically copied to Context.FilesDir and chmod +x)
     /// - Windows/macOS: execute directly (you manage PATH/DYLD outside if needed)
     /// </summary>
-    private static (string exePath, string[] args) BuildPlatformCommand(
+    private static (string exePath, string[] args, Dictionary<string, string> env) BuildPlatformCommand(
         string binaryPathOrName,
         string[] subCommand,
         string? linuxLibDir = null,
@@ -87,7 +88,7 @@ class Program
             string exe = !string.IsNullOrWhiteSpace(androidExePath)
                 ? androidExePath
                 : binaryPathOrName; // assume caller passes full path (e.g., FilesDir/openssl)
-            return (exe, subCommand);
+            return (exe, subCommand, new Dictionary<string, string>());
         }
 
         if (OperatingSystem.IsLinux())
@@ -97,22 +98,16 @@ class Program
                 ? binaryPathOrName
                 : Path.Combine(linuxLibDir ?? ".", binaryPathOrName);
 
-            // Choose the correct ELF loader for current arch
-            string loader = RuntimeInformation.ProcessArchitecture switch
+            // The bundled libcrypto/libssl and oqsprovider.so live next to the binary,
+            // so point the dynamic loader and OpenSSL's provider search there.
+            string libDir = linuxLibDir ?? Path.GetDirectoryName(exeFull) ?? ".";
+            var env = new Dictionary<string, string>
             {
-                Architecture.X64   => "/lib64/ld-linux-x86-64.so.2",
-                Architecture.X86   => "/lib/ld-linux.so.2",
-                Architecture.Arm64 => "/lib/ld-linux-aarch64.so.1",
-                Architecture.Arm   => "/lib/ld-linux-armhf.so.3",
-                _ => "/lib64/ld-linux-x86-64.so.2"
+                ["LD_LIBRARY_PATH"] = libDir,
+                ["OPENSSL_MODULES"] = libDir,
             };
 
-            string libDir = linuxLibDir ?? Path.GetDirectoryName(exeFull) ?? ".";
-            string[] args = new[] { "--library-path", libDir, exeFull }
-                            .Concat(subCommand)
-                            .ToArray();
-
-            return (loader, args);
+            return (exeFull, subCommand, env);
         }
 
         if (OperatingSystem.IsWindows() || OperatingSystem.IsMacOS())
@@ -121,7 +116,7 @@ class Program
             string exeFull = Path.IsPathRooted(binaryPathOrName)
                 ? binaryPathOrName
                 : Path.Combine(Directory.GetCurrentDirectory(), binaryPathOrName);
-            return (exeFull, subCommand);
+            return (exeFull, subCommand, new Dictionary<string, string>());
         }
 
         throw new PlatformNotSupportedException("Unknown platform.");
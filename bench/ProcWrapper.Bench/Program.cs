@@ -0,0 +1,339 @@
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using System.Linq;
+using System.Threading;
+using System.Threading.Tasks;
+
+// End-to-end benchmarks for NativeProc.ProcessStream: what the managed side adds on top
+// of native/bench/procwrapper_bench (reader loop, copies, line decoding, event dispatch).
+//
+//   dotnet run -c Release -- [--mode poll,batch,loop,ring,span] [--scenario a,b,...]
+//                            [--runs n] [--lines n] [--children n] [--backend fork|posix_spawn|server]
+//
+// Each scenario runs once as warm-up and then --runs times per reader mode; the table
+// reports medians plus p50/p99 of the scenario's latency, allocations per MB of output
+// (GC.GetTotalAllocatedBytes, whole process) and the peak thread-pool / OS thread counts.
+class Program
+{
+    // How ProcessStream reads the child's output.
+    enum ReaderMode
+    {
+        Poll,  // reader thread, read_streams + OnStdoutLine
+        Batch, // reader thread, read_lines + OnStdoutLines (native framing)
+        Loop,  // native event loop + OnStdoutLine
+        Ring,  // native event loop draining into a ring + OnStdoutLine
+        Span,  // native event loop + OnStdoutLineSpan (no string per line)
+    }
+
+    sealed record Scenario(string Name, string LatencyLabel, Func<Options, Run[]> Launches);
+
+    // One child to launch: sh -c script, expecting this many stdout lines.
+    sealed record Run(string Script, long ExpectedLines);
+
+    sealed class Options
+    {
+        public List<ReaderMode> Modes = new() { ReaderMode.Poll, ReaderMode.Batch, ReaderMode.Loop, ReaderMode.Ring, ReaderMode.Span };
+        public List<string> Scenarios = new() { "first-line", "short-lines", "long-lines", "fan-out" };
+        public int Runs = 5;
+        public long Lines = 1_000_000;
+        public int Children = 64;
+        public NativeProc.SpawnBackend? Backend;
+    }
+
+    // Counters for one child; the handlers of one stream never run concurrently.
+    sealed class Counters
+    {
+        public long Lines;
+        public long Bytes;
+        public long FirstLine; // Stopwatch timestamp of the first line, 0 until then
+    }
+
+    readonly record struct Sample(double Seconds, double Latency, long Lines, long Bytes, long Allocated,
+                                  int PoolThreads, int OsThreads, bool Complete);
+
+    private const int RING_SIZE = 1024 * 1024;
+
+    private static string Shell = "/bin/sh";
+
+    static async Task<int> Main(string[] argv)
+    {
+        var opt = new Options();
+        try
+        {
+            ParseArgs(argv, opt);
+        }
+        catch (ArgumentException e)
+        {
+            Console.Error.WriteLine(e.Message);
+            PrintUsage();
+            return 2;
+        }
+
+        if (!File.Exists(Shell) && File.Exists("/system/bin/sh")) Shell = "/system/bin/sh"; // Android
+        if (opt.Backend == NativeProc.SpawnBackend.Server) NativeProc.StartSpawnServer();
+        else if (opt.Backend != null) NativeProc.DefaultSpawnBackend = opt.Backend.Value;
+
+        var scenarios = new[]
+        {
+            // start -> first OnStdoutLine, per launch
+            new Scenario("first-line", "first line", o => new[] { new Run("echo ready", 1) }),
+            // 2-byte lines: per-line and per-event overhead dominates
+            new Scenario("short-lines", "run", o => new[] { new Run($"yes x | head -n {o.Lines}", o.Lines) }),
+            // 200-byte lines: copy and decode cost per MB
+            new Scenario("long-lines", "run", o => new[]
+            {
+                new Run($"yes {new string('a', 199)} | head -n {o.Lines / 10}", o.Lines / 10),
+            }),
+            // many children at once: how threads and dispatch scale
+            new Scenario("fan-out", "run", o => Enumerable.Range(0, o.Children)
+                .Select(_ => new Run($"yes x | head -n {Math.Max(1, o.Lines / o.Children)}", Math.Max(1, o.Lines / o.Children)))
+                .ToArray()),
+        };
+
+        Console.WriteLine($"ProcWrapper.Bench: {RuntimeInformationText()} backend={NativeProc.DefaultSpawnBackend} " +
+                          $"runs={opt.Runs} lines={opt.Lines} children={opt.Children}");
+        Console.WriteLine();
+        Console.WriteLine("| Scenario    | Mode  | Median    | P50       | P99       | Lines/s      | MB/s    | Alloc/MB    | Pool thr | OS thr |");
+        Console.WriteLine("|-------------|-------|-----------|-----------|-----------|--------------|---------|-------------|----------|--------|");
+
+        foreach (var sc in scenarios)
+        {
+            if (!opt.Scenarios.Contains(sc.Name)) continue;
+            // first-line is about launch-to-event latency, so it needs more samples
+            int runs = sc.Name == "first-line" ? opt.Runs * 20 : opt.Runs;
+            foreach (var mode in opt.Modes)
+            {
+                await Measure(sc, mode, opt); // warm-up: JIT, pipes, thread pool
+                var samples = new List<Sample>();
+                for (int i = 0; i < runs; ++i) samples.Add(await Measure(sc, mode, opt));
+                Report(sc, mode, samples);
+            }
+        }
+
+        if (opt.Backend == NativeProc.SpawnBackend.Server) NativeProc.StopSpawnServer();
+        return 0;
+    }
+
+    // Launch every child of the scenario at once and wait until all output was delivered.
+    private static async Task<Sample> Measure(Scenario sc, ReaderMode mode, Options opt)
+    {
+        Run[] launches = sc.Launches(opt);
+        var procs = new NativeProc.ProcessStream[launches.Length];
+        var counters = new Counters[launches.Length];
+        var starts = new long[launches.Length];
+
+        using var sampler = new ThreadSampler();
+        long own0 = sampler.Allocated;
+        long alloc0 = GC.GetTotalAllocatedBytes(precise: true);
+        long t0 = Stopwatch.GetTimestamp();
+
+        for (int i = 0; i < launches.Length; ++i)
+        {
+            var c = counters[i] = new Counters();
+            var ps = procs[i] = new NativeProc.ProcessStream
+            {
+                Debug = false,
+                UseEventLoop = mode is ReaderMode.Loop or ReaderMode.Ring or ReaderMode.Span,
+                RingBufferSize = mode == ReaderMode.Ring ? RING_SIZE : 0,
+            };
+            if (mode == ReaderMode.Batch)
+            {
+                ps.OnStdoutLines += (buffer, lines) =>
+                {
+                    if (c.FirstLine == 0) c.FirstLine = Stopwatch.GetTimestamp();
+                    c.Lines += lines.Length;
+                    foreach (var l in lines) c.Bytes += l.Length + 1;
+                };
+            }
+            else if (mode == ReaderMode.Span)
+            {
+                ps.OnStdoutLineSpan += line =>
+                {
+                    if (c.FirstLine == 0) c.FirstLine = Stopwatch.GetTimestamp();
+                    c.Lines++;
+                    c.Bytes += line.Length + 1;
+                };
+            }
+            else
+            {
+                ps.OnStdoutLine += line =>
+                {
+                    if (c.FirstLine == 0) c.FirstLine = Stopwatch.GetTimestamp();
+                    c.Lines++;
+                    c.Bytes += line.Length + 1;
+                };
+            }
+            starts[i] = Stopwatch.GetTimestamp();
+            if (!ps.Start(Shell, new[] { "-c", launches[i].Script }))
+                throw new InvalidOperationException($"failed to start: {launches[i].Script}");
+        }
+
+        foreach (var ps in procs)
+        {
+            await ps.WaitForExitAsync().ConfigureAwait(false);
+            await ps.WaitForDrainAsync().ConfigureAwait(false);
+        }
+        long t1 = Stopwatch.GetTimestamp();
+        long allocated = GC.GetTotalAllocatedBytes(precise: true) - alloc0 - (sampler.Allocated - own0);
+        sampler.Stop();
+        foreach (var ps in procs) ps.Dispose();
+
+        long lineCount = 0, bytes = 0;
+        bool complete = true;
+        double latency = Stopwatch.GetElapsedTime(t0, t1).TotalSeconds;
+        for (int i = 0; i < launches.Length; ++i)
+        {
+            lineCount += counters[i].Lines;
+            bytes += counters[i].Bytes;
+            complete &= counters[i].Lines == launches[i].ExpectedLines;
+        }
+        if (sc.LatencyLabel == "first line" && counters[0].FirstLine != 0)
+            latency = Stopwatch.GetElapsedTime(starts[0], counters[0].FirstLine).TotalSeconds;
+
+        return new Sample(Stopwatch.GetElapsedTime(t0, t1).TotalSeconds, latency, lineCount, bytes,
+                          allocated, sampler.PeakPoolThreads, sampler.PeakOsThreads, complete);
+    }
+
+    private static void Report(Scenario sc, ReaderMode mode, List<Sample> samples)
+    {
+        var seconds = samples.Select(s => s.Seconds).OrderBy(s => s).ToArray();
+        var latency = samples.Select(s => s.Latency).OrderBy(s => s).ToArray();
+        double median = seconds[seconds.Length / 2];
+        var mid = samples.OrderBy(s => s.Seconds).ElementAt(samples.Count / 2);
+
+        // tiny outputs (first-line) report allocations per run; per MB would be noise
+        double mb = samples.Sum(s => s.Bytes) / 1e6;
+        string alloc = mb >= 1
+            ? FormatBytes(samples.Sum(s => s.Allocated) / mb)
+            : FormatBytes(samples.Average(s => (double)s.Allocated)) + "/run";
+
+        Console.WriteLine($"| {sc.Name,-11} | {mode,-5} | {Ms(median),9} | {Ms(Percentile(latency, 50)),9} | " +
+                          $"{Ms(Percentile(latency, 99)),9} | {mid.Lines / mid.Seconds,12:N0} | {mid.Bytes / 1e6 / mid.Seconds,7:F1} | " +
+                          $"{alloc,11} | {samples.Max(s => s.PoolThreads),8} | {samples.Max(s => s.OsThreads),6} |");
+
+        int short_ = samples.Count(s => !s.Complete);
+        if (short_ > 0) Console.WriteLine($"  ! {short_} of {samples.Count} runs delivered fewer lines than the child wrote");
+    }
+
+    private static double Percentile(double[] sorted, int p) =>
+        sorted[Math.Min(sorted.Length - 1, sorted.Length * p / 100)];
+
+    private static string Ms(double seconds) => $"{seconds * 1e3:F3} ms";
+
+    private static string FormatBytes(double b) =>
+        b >= 1 << 20 ? $"{b / (1 << 20):F1} MiB" : b >= 1 << 10 ? $"{b / (1 << 10):F1} KiB" : $"{b:F0} B";
+
+    private static string RuntimeInformationText() =>
+        $"{System.Runtime.InteropServices.RuntimeInformation.FrameworkDescription} " +
+        $"{System.Runtime.InteropServices.RuntimeInformation.RuntimeIdentifier} cores={Environment.ProcessorCount}";
+
+    // Samples ThreadPool.ThreadCount every millisecond and the OS thread count (Threads: in
+    // /proc/self/status) every 10 ms on its own thread. Allocated tracks what the sampler
+    // itself allocated so far, so a measurement can leave it out.
+    private sealed class ThreadSampler : IDisposable
+    {
+        private readonly Thread _thread;
+        private volatile bool _stop;
+
+        public int PeakPoolThreads { get; private set; }
+        public int PeakOsThreads { get; private set; }
+        private long _allocated;
+        public long Allocated => Volatile.Read(ref _allocated);
+
+        public ThreadSampler()
+        {
+            _thread = new Thread(Loop) { IsBackground = true, Name = "bench-sampler" };
+            _thread.Start();
+        }
+
+        private void Loop()
+        {
+            long alloc0 = GC.GetAllocatedBytesForCurrentThread();
+            for (int tick = 0; !_stop; ++tick)
+            {
+                PeakPoolThreads = Math.Max(PeakPoolThreads, ThreadPool.ThreadCount);
+                if (tick % 10 == 0)
+                {
+                    PeakOsThreads = Math.Max(PeakOsThreads, OsThreads());
+                    Volatile.Write(ref _allocated, GC.GetAllocatedBytesForCurrentThread() - alloc0);
+                }
+                Thread.Sleep(1);
+            }
+            PeakOsThreads = Math.Max(PeakOsThreads, OsThreads());
+        }
+
+        private static int OsThreads()
+        {
+            try
+            {
+                foreach (string l in File.ReadLines("/proc/self/status"))
+                {
+                    if (l.StartsWith("Threads:", StringComparison.Ordinal)) return int.Parse(l.AsSpan(8).Trim());
+                }
+            }
+            catch (IOException) { }
+            return 0;
+        }
+
+        public void Stop()
+        {
+            _stop = true;
+            _thread.Join();
+        }
+
+        public void Dispose()
+        {
+            if (!_stop) Stop();
+        }
+    }
+
+    private static void ParseArgs(string[] argv, Options opt)
+    {
+        for (int i = 0; i < argv.Length; ++i)
+        {
+            string a = argv[i];
+            if (i + 1 >= argv.Length) throw new ArgumentException($"missing value for {a}");
+            string v = argv[++i];
+            switch (a)
+            {
+                case "--mode":
+                    opt.Modes = v.Split(',').Select(m => Enum.Parse<ReaderMode>(m, ignoreCase: true)).ToList();
+                    break;
+                case "--scenario":
+                    opt.Scenarios = v.Split(',').ToList();
+                    break;
+                case "--runs":
+                    opt.Runs = int.Parse(v);
+                    break;
+                case "--lines":
+                    opt.Lines = long.Parse(v);
+                    break;
+                case "--children":
+                    opt.Children = int.Parse(v);
+                    break;
+                case "--backend":
+                    opt.Backend = v switch
+                    {
+                        "fork" => NativeProc.SpawnBackend.Fork,
+                        "posix_spawn" => NativeProc.SpawnBackend.PosixSpawn,
+                        "server" => NativeProc.SpawnBackend.Server,
+                        _ => throw new ArgumentException($"unknown backend {v}"),
+                    };
+                    break;
+                default:
+                    throw new ArgumentException($"unknown option {a}");
+            }
+        }
+    }
+
+    private static void PrintUsage()
+    {
+        Console.WriteLine();
+        Console.WriteLine("Usage:");
+        Console.WriteLine("  dotnet run -c Release -- [--mode poll,batch,loop,ring,span] [--scenario first-line,short-lines,long-lines,fan-out]");
+        Console.WriteLine("                           [--runs n] [--lines n] [--children n] [--backend fork|posix_spawn|server]");
+        Console.WriteLine();
+    }
+}
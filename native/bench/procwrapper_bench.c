@@ -0,0 +1,593 @@
+// procwrapper_bench: micro-benchmarks for the spawn, read and reap paths of libprocwrapper.
+//
+//   procwrapper_bench [--backend fork|posix_spawn|server|all] [--scenario name[,name...]]
+//                     [-n launches] [-j threads] [--bulk-mb MiB] [--lines count]
+//                     [--children count] [--batch size] [--bin-dir dir]
+//
+// Scenarios: spawn-seq, spawn-batch, spawn-par, bulk, lines, concurrent, stop (default:
+// all of them).
+// Every scenario runs once per backend, so the same binary compares fork, posix_spawn
+// and the spawn server on the host and on Android (adb push it next to the library).
+// Results are one line per scenario and backend: rate plus p50/p99 latencies.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// ---- libprocwrapper ABI (must match procwrapper.c) ----
+#define PW_SPAWN_FORK        0
+#define PW_SPAWN_POSIX_SPAWN 1
+#define PW_SPAWN_SERVER      2
+
+#define PW_EV_STDOUT 0x1
+#define PW_EV_STDERR 0x2
+#define PW_EV_EXIT   0x4
+
+#define PW_EVT_STDOUT 1
+#define PW_EVT_STDERR 2
+#define PW_EVT_EXIT   3
+
+typedef struct {
+    char* out_buf;
+    int   out_cap;
+    int   out_len;
+    char* err_buf;
+    int   err_cap;
+    int   err_len;
+    int   done;
+    int   exit_code;
+} pw_read_result;
+
+typedef struct {
+    int offset;
+    int length;
+    int flags;
+} pw_line;
+
+typedef struct {
+    int         kind;
+    int         fd;
+    const char* path;
+    int         flags;
+} pw_redirect;
+
+typedef struct {
+    int          size;
+    int          flags;
+    const char*  path;
+    char* const* argv;
+    pw_redirect  out;
+    pw_redirect  err;
+    const char*  argv_block;
+    const char*  env_block;
+    const char*  cwd;
+    long long    rlimit_as;
+    long long    rlimit_cpu;
+    int          argc;
+    int          envc;
+    int          nice;
+    int          pipe_size;
+} pw_spawn_opts;
+
+typedef void (*pw_event_cb)(int handle, int event, const char* data, int len, void* user);
+
+int start_process(const char* path, char* const argv[]);
+int start_processes(int count, const pw_spawn_opts* specs, int* handles);
+int read_streams(int handle, pw_read_result* r);
+int read_lines(int handle, int stream, char* buf, int buflen, pw_line* lines, int max_lines);
+int wait_events(int handle, int timeout_ms, int* mask);
+int get_exit_code(int handle);
+int stop_process(int handle);
+int subscribe_process(int handle, pw_event_cb cb, void* user);
+int set_spawn_backend(int backend);
+int spawn_server_start(void);
+int spawn_server_stop(void);
+
+// ---- options ----
+static int opt_launches = 1000;
+static int opt_threads = 4;
+static long long opt_bulk_mb = 1024;
+static long long opt_lines = 2000000;
+static int opt_children = 128;
+static int opt_batch = 64;
+static const char* opt_scenarios = "spawn-seq,spawn-batch,spawn-par,bulk,lines,concurrent,stop";
+static const char* opt_backend = "all";
+static char bin_sh[256] = "/bin/sh";
+static char bin_true[256] = "/bin/true";
+
+#define READ_BUF_SIZE (256 * 1024)
+
+// ---- helpers ----
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// p50/p99 of n samples in seconds, reported in milliseconds. Sorts v.
+static void percentiles(double* v, int n, double* p50, double* p99) {
+    *p50 = *p99 = 0;
+    if (n <= 0) return;
+    qsort(v, (size_t)n, sizeof(double), cmp_double);
+    *p50 = v[n / 2] * 1e3;
+    int i = (int)((long long)n * 99 / 100);
+    *p99 = v[i < n ? i : n - 1] * 1e3;
+}
+
+static void report(const char* scenario, const char* backend, const char* rate, double p50, double p99) {
+    printf("%-11s %-12s %-28s p50=%8.3fms p99=%8.3fms\n", scenario, backend, rate, p50, p99);
+    fflush(stdout);
+}
+
+static int start_sh(const char* script) {
+    char* argv[] = { bin_sh, "-c", (char*)script, NULL };
+    return start_process(bin_sh, argv);
+}
+
+static int start_true(void) {
+    char* argv[] = { bin_true, NULL };
+    return start_process(bin_true, argv);
+}
+
+// Drain both streams and wait for the exit, the way a reader thread does. Returns the
+// exit code (or -1) and adds the stdout bytes to *bytes.
+static int run_to_exit(int handle, char* out, char* err, long long* bytes) {
+    pw_read_result rs = { out, READ_BUF_SIZE, 0, err, READ_BUF_SIZE, 0, 0, -2 };
+    int done = 0, code = -1;
+    for (;;) {
+        rs.out_buf = out;
+        rs.err_buf = err;
+        int n = read_streams(handle, &rs);
+        if (n < 0 && rs.exit_code == -1) return code; // slot released after the last EOF
+        done |= rs.done;
+        if (rs.exit_code >= 0) code = rs.exit_code;
+        if (bytes) *bytes += rs.out_len;
+        if ((done & (PW_EV_STDOUT | PW_EV_STDERR | PW_EV_EXIT)) == (PW_EV_STDOUT | PW_EV_STDERR | PW_EV_EXIT))
+            return code;
+        if (n <= 0) {
+            int mask = (done & PW_EV_STDOUT ? 0 : PW_EV_STDOUT) | (done & PW_EV_STDERR ? 0 : PW_EV_STDERR) |
+                       (done & PW_EV_EXIT ? 0 : PW_EV_EXIT);
+            if (wait_events(handle, 1000, &mask) < 0) return code;
+        }
+    }
+}
+
+// ---- scenarios ----
+// /bin/true back to back: launch latency (start_process) and launch-to-reaped round trip.
+static void bench_spawn_seq(const char* backend) {
+    int n = opt_launches;
+    double* start_lat = calloc((size_t)n, sizeof(double));
+    double* total_lat = calloc((size_t)n, sizeof(double));
+    char* out = malloc(READ_BUF_SIZE);
+    char* err = malloc(READ_BUF_SIZE);
+    if (!start_lat || !total_lat || !out || !err) goto done;
+
+    int ok = 0;
+    double t0 = now_s();
+    for (int i = 0; i < n; ++i) {
+        double a = now_s();
+        int h = start_true();
+        double b = now_s();
+        if (h < 0) continue;
+        run_to_exit(h, out, err, NULL);
+        start_lat[ok] = b - a;
+        total_lat[ok] = now_s() - a;
+        ok++;
+    }
+    double elapsed = now_s() - t0;
+
+    char rate[64];
+    double p50, p99;
+    snprintf(rate, sizeof(rate), "%.1f launches/s", ok / elapsed);
+    percentiles(start_lat, ok, &p50, &p99);
+    report("spawn-seq", backend, rate, p50, p99);
+    percentiles(total_lat, ok, &p50, &p99);
+    report("  +reap", backend, "", p50, p99);
+    if (ok < n) printf("  %d of %d launches failed\n", n - ok, n);
+done:
+    free(start_lat);
+    free(total_lat);
+    free(out);
+    free(err);
+}
+
+// /bin/true in start_processes batches of --batch: launch cost per process, amortized
+// over the batch call, then launch-to-reaped for the whole batch.
+static void bench_spawn_batch(const char* backend) {
+    int n = opt_launches, batch = opt_batch < 1 ? 1 : opt_batch;
+    int rounds = (n + batch - 1) / batch;
+    double* start_lat = calloc((size_t)rounds, sizeof(double));
+    double* total_lat = calloc((size_t)rounds, sizeof(double));
+    pw_spawn_opts* specs = calloc((size_t)batch, sizeof(pw_spawn_opts));
+    int* handles = calloc((size_t)batch, sizeof(int));
+    char* out = malloc(READ_BUF_SIZE);
+    char* err = malloc(READ_BUF_SIZE);
+    if (!start_lat || !total_lat || !specs || !handles || !out || !err) goto done;
+
+    char* argv[] = { bin_true, NULL };
+    for (int i = 0; i < batch; ++i) {
+        specs[i].size = (int)sizeof(pw_spawn_opts);
+        specs[i].path = bin_true;
+        specs[i].argv = argv;
+    }
+
+    int ok = 0, tried = 0;
+    double t0 = now_s();
+    for (int r = 0; r < rounds; ++r) {
+        int count = n - tried < batch ? n - tried : batch;
+        tried += count;
+        double a = now_s();
+        int started = start_processes(count, specs, handles);
+        double b = now_s();
+        for (int i = 0; i < count; ++i) {
+            if (handles[i] > 0) run_to_exit(handles[i], out, err, NULL);
+        }
+        start_lat[r] = (b - a) / count;
+        total_lat[r] = now_s() - a;
+        if (started > 0) ok += started;
+    }
+    double elapsed = now_s() - t0;
+
+    char rate[64];
+    double p50, p99;
+    snprintf(rate, sizeof(rate), "%.1f launches/s", ok / elapsed);
+    percentiles(start_lat, rounds, &p50, &p99);
+    report("spawn-batch", backend, rate, p50, p99);
+    percentiles(total_lat, rounds, &p50, &p99);
+    report("  +reap", backend, "(per batch)", p50, p99);
+    if (ok < n) printf("  %d of %d launches failed\n", n - ok, n);
+done:
+    free(start_lat);
+    free(total_lat);
+    free(specs);
+    free(handles);
+    free(out);
+    free(err);
+}
+
+typedef struct {
+    int     count;
+    int     ok;
+    double* lat;
+} spawn_worker;
+
+static void* spawn_par_main(void* arg) {
+    spawn_worker* w = arg;
+    char* out = malloc(READ_BUF_SIZE);
+    char* err = malloc(READ_BUF_SIZE);
+    if (!out || !err) goto done;
+    for (int i = 0; i < w->count; ++i) {
+        double a = now_s();
+        int h = start_true();
+        double b = now_s();
+        if (h < 0) continue;
+        run_to_exit(h, out, err, NULL);
+        w->lat[w->ok++] = b - a;
+    }
+done:
+    free(out);
+    free(err);
+    return NULL;
+}
+
+// The same launches from opt_threads threads at once: handle table and spawn contention.
+static void bench_spawn_par(const char* backend) {
+    int t = opt_threads > 0 ? opt_threads : 1;
+    int per = opt_launches / t > 0 ? opt_launches / t : 1;
+    spawn_worker* w = calloc((size_t)t, sizeof(spawn_worker));
+    pthread_t* th = calloc((size_t)t, sizeof(pthread_t));
+    double* all = calloc((size_t)t * (size_t)per, sizeof(double));
+    if (!w || !th || !all) goto done;
+
+    double t0 = now_s();
+    int started = 0;
+    for (int i = 0; i < t; ++i) {
+        w[i].count = per;
+        w[i].lat = all + (size_t)i * (size_t)per;
+        if (pthread_create(&th[i], NULL, spawn_par_main, &w[i]) != 0) break;
+        started++;
+    }
+    for (int i = 0; i < started; ++i) pthread_join(th[i], NULL);
+    double elapsed = now_s() - t0;
+
+    // compact the per-thread samples
+    int ok = 0;
+    for (int i = 0; i < started; ++i) {
+        for (int k = 0; k < w[i].ok; ++k) all[ok++] = w[i].lat[k];
+    }
+    char rate[64];
+    double p50, p99;
+    snprintf(rate, sizeof(rate), "%.1f launches/s (%d thr)", ok / elapsed, started);
+    percentiles(all, ok, &p50, &p99);
+    report("spawn-par", backend, rate, p50, p99);
+done:
+    free(w);
+    free(th);
+    free(all);
+}
+
+// One child writing opt_bulk_mb MiB as fast as it can; both latency columns show the run time.
+static void bench_bulk(const char* backend) {
+    char script[128];
+    snprintf(script, sizeof(script), "exec head -c %lld /dev/zero", opt_bulk_mb * 1024 * 1024);
+    char* out = malloc(READ_BUF_SIZE);
+    char* err = malloc(READ_BUF_SIZE);
+    if (!out || !err) goto done;
+
+    double t0 = now_s();
+    int h = start_sh(script);
+    if (h < 0) {
+        report("bulk", backend, "start failed", 0, 0);
+        goto done;
+    }
+    long long bytes = 0;
+    run_to_exit(h, out, err, &bytes);
+    double elapsed = now_s() - t0;
+
+    char rate[64];
+    snprintf(rate, sizeof(rate), "%.1f MB/s (%lld MiB)", bytes / 1e6 / elapsed, bytes >> 20);
+    report("bulk", backend, rate, elapsed * 1e3, elapsed * 1e3);
+done:
+    free(out);
+    free(err);
+}
+
+// Many short lines framed natively by read_lines; p50/p99 are per-batch latencies.
+static void bench_lines(const char* backend) {
+    enum { MAX_LINES = 4096 };
+    char script[128];
+    snprintf(script, sizeof(script), "yes 0123456789abcdef | head -n %lld", opt_lines);
+    char* buf = malloc(READ_BUF_SIZE);
+    pw_line* lines = malloc(MAX_LINES * sizeof(pw_line));
+    int cap = 1 << 16, batches = 0;
+    double* lat = malloc((size_t)cap * sizeof(double));
+    if (!buf || !lines || !lat) goto done;
+
+    double t0 = now_s();
+    int h = start_sh(script);
+    if (h < 0) {
+        report("lines", backend, "start failed", 0, 0);
+        goto done;
+    }
+    long long count = 0;
+    int exited = 0;
+    double last = now_s();
+    for (;;) {
+        int n = read_lines(h, PW_EVT_STDOUT, buf, READ_BUF_SIZE, lines, MAX_LINES);
+        if (n < 0) break;
+        if (n > 0) {
+            count += n;
+            double now = now_s();
+            if (batches < cap) lat[batches++] = now - last;
+            last = now;
+            continue;
+        }
+        // nothing after the exit: every writer is gone, so stdout is at EOF
+        if (exited) break;
+        int mask = PW_EV_STDOUT | PW_EV_EXIT;
+        if (wait_events(h, 1000, &mask) < 0) break;
+        if (mask & PW_EV_EXIT) exited = 1;
+    }
+    double elapsed = now_s() - t0;
+    run_to_exit(h, buf, buf, NULL); // stderr EOF releases the handle
+
+    char rate[64];
+    double p50, p99;
+    snprintf(rate, sizeof(rate), "%.0f lines/s", count / elapsed);
+    percentiles(lat, batches, &p50, &p99);
+    report("lines", backend, rate, p50, p99);
+    if (count != opt_lines) printf("  got %lld of %lld lines\n", count, opt_lines);
+done:
+    free(buf);
+    free(lines);
+    free(lat);
+}
+
+typedef struct {
+    pthread_mutex_t mu;
+    pthread_cond_t  cv;
+    int             remaining;
+    long long       bytes;
+    double          t0;
+    double*         finish;
+    int             finished;
+} concurrent_state;
+
+static void concurrent_cb(int handle, int event, const char* data, int len, void* user) {
+    (void)handle;
+    (void)data;
+    concurrent_state* st = user;
+    pthread_mutex_lock(&st->mu);
+    if (event == PW_EVT_EXIT) {
+        st->finish[st->finished++] = now_s() - st->t0;
+        if (--st->remaining == 0) pthread_cond_signal(&st->cv);
+    } else {
+        st->bytes += len;
+    }
+    pthread_mutex_unlock(&st->mu);
+}
+
+// opt_children children at once, each writing 1 MiB, all served by the event loop;
+// p50/p99 are launch-to-finished times. Mirrors a ProcessPool burst.
+static void bench_concurrent(const char* backend) {
+    int n = opt_children;
+    concurrent_state st;
+    memset(&st, 0, sizeof(st));
+    pthread_mutex_init(&st.mu, NULL);
+    pthread_cond_init(&st.cv, NULL);
+    st.finish = calloc((size_t)n, sizeof(double));
+    if (!st.finish) goto done;
+
+    st.t0 = now_s();
+    int launched = 0;
+    for (int i = 0; i < n; ++i) {
+        int h = start_sh("exec head -c 1048576 /dev/zero");
+        if (h < 0) continue;
+        pthread_mutex_lock(&st.mu);
+        st.remaining++;
+        pthread_mutex_unlock(&st.mu);
+        if (subscribe_process(h, concurrent_cb, &st) != 0) {
+            pthread_mutex_lock(&st.mu);
+            st.remaining--;
+            pthread_mutex_unlock(&st.mu);
+            continue;
+        }
+        launched++;
+    }
+    pthread_mutex_lock(&st.mu);
+    while (st.remaining > 0) pthread_cond_wait(&st.cv, &st.mu);
+    pthread_mutex_unlock(&st.mu);
+    double elapsed = now_s() - st.t0;
+
+    char rate[64];
+    double p50, p99;
+    snprintf(rate, sizeof(rate), "%d children %.1f MB/s", launched, st.bytes / 1e6 / elapsed);
+    percentiles(st.finish, st.finished, &p50, &p99);
+    report("concurrent", backend, rate, p50, p99);
+done:
+    free(st.finish);
+    pthread_cond_destroy(&st.cv);
+    pthread_mutex_destroy(&st.mu);
+}
+
+// stop_process on a sleeping child (SIGTERM honoured at once): per-call latency.
+static void bench_stop(const char* backend) {
+    int n = opt_launches / 10 > 0 ? opt_launches / 10 : 1;
+    double* lat = calloc((size_t)n, sizeof(double));
+    char* out = malloc(READ_BUF_SIZE);
+    char* err = malloc(READ_BUF_SIZE);
+    if (!lat || !out || !err) goto done;
+
+    int ok = 0;
+    double t0 = now_s();
+    for (int i = 0; i < n; ++i) {
+        int h = start_sh("exec sleep 30");
+        if (h < 0) continue;
+        double a = now_s();
+        if (stop_process(h) != 0) continue;
+        lat[ok++] = now_s() - a;
+        run_to_exit(h, out, err, NULL);
+    }
+    double elapsed = now_s() - t0;
+
+    char rate[64];
+    double p50, p99;
+    snprintf(rate, sizeof(rate), "%.1f stops/s", ok / elapsed);
+    percentiles(lat, ok, &p50, &p99);
+    report("stop", backend, rate, p50, p99);
+done:
+    free(lat);
+    free(out);
+    free(err);
+}
+
+// ---- driver ----
+static const struct {
+    const char* name;
+    void (*run)(const char* backend);
+} scenarios[] = {
+    { "spawn-seq", bench_spawn_seq },
+    { "spawn-batch", bench_spawn_batch },
+    { "spawn-par", bench_spawn_par },
+    { "bulk", bench_bulk },
+    { "lines", bench_lines },
+    { "concurrent", bench_concurrent },
+    { "stop", bench_stop },
+};
+
+static const struct {
+    const char* name;
+    int id;
+} backends[] = {
+    { "fork", PW_SPAWN_FORK },
+    { "posix_spawn", PW_SPAWN_POSIX_SPAWN },
+    { "server", PW_SPAWN_SERVER },
+};
+
+static int listed(const char* list, const char* name) {
+    size_t len = strlen(name);
+    for (const char* p = list; (p = strstr(p, name)) != NULL; p += len) {
+        int starts = p == list || p[-1] == ',';
+        int ends = p[len] == 0 || p[len] == ',';
+        if (starts && ends) return 1;
+    }
+    return 0;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s [--backend fork|posix_spawn|server|all] [--scenario a,b,...]\n"
+            "          [-n launches] [-j threads] [--bulk-mb MiB] [--lines count]\n"
+            "          [--children count] [--batch size] [--bin-dir dir]\n"
+            "scenarios: spawn-seq spawn-batch spawn-par bulk lines concurrent stop\n",
+            argv0);
+}
+
+int main(int argc, char** argv) {
+    // Android has no /bin; toybox lives in /system/bin
+    if (access(bin_sh, X_OK) != 0 && access("/system/bin/sh", X_OK) == 0) {
+        snprintf(bin_sh, sizeof(bin_sh), "/system/bin/sh");
+        snprintf(bin_true, sizeof(bin_true), "/system/bin/true");
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        const char* a = argv[i];
+        const char* v = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!strcmp(a, "-h") || !strcmp(a, "--help")) {
+            usage(argv[0]);
+            return 0;
+        }
+        if (!v) {
+            usage(argv[0]);
+            return 2;
+        }
+        if (!strcmp(a, "--backend")) opt_backend = v;
+        else if (!strcmp(a, "--scenario")) opt_scenarios = v;
+        else if (!strcmp(a, "-n")) opt_launches = atoi(v);
+        else if (!strcmp(a, "-j")) opt_threads = atoi(v);
+        else if (!strcmp(a, "--bulk-mb")) opt_bulk_mb = atoll(v);
+        else if (!strcmp(a, "--lines")) opt_lines = atoll(v);
+        else if (!strcmp(a, "--children")) opt_children = atoi(v);
+        else if (!strcmp(a, "--batch")) opt_batch = atoi(v);
+        else if (!strcmp(a, "--bin-dir")) {
+            snprintf(bin_sh, sizeof(bin_sh), "%s/sh", v);
+            snprintf(bin_true, sizeof(bin_true), "%s/true", v);
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+        i++;
+    }
+
+    printf("procwrapper_bench: launches=%d threads=%d bulk=%lldMiB lines=%lld children=%d\n",
+           opt_launches, opt_threads, opt_bulk_mb, opt_lines, opt_children);
+
+    // The spawn server has to start while we are still small, before any scenario runs.
+    int want_server = !strcmp(opt_backend, "all") || !strcmp(opt_backend, "server");
+    int have_server = want_server && spawn_server_start() == 0;
+    if (want_server && !have_server) printf("spawn server unavailable: %s\n", strerror(errno));
+
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); ++b) {
+        if (strcmp(opt_backend, "all") != 0 && strcmp(opt_backend, backends[b].name) != 0) continue;
+        if (backends[b].id == PW_SPAWN_SERVER && !have_server) continue;
+        if (set_spawn_backend(backends[b].id) != 0) {
+            printf("%-11s %-12s not available\n", "-", backends[b].name);
+            continue;
+        }
+        for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); ++s) {
+            if (listed(opt_scenarios, scenarios[s].name)) scenarios[s].run(backends[b].name);
+        }
+    }
+
+    if (have_server) spawn_server_stop();
+    return 0;
+}
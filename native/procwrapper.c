@@ -10,18 +10,545 @@
 #include <pthread.h>
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <spawn.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#ifdef __ANDROID__
+#include <dlfcn.h>
+#endif
+
+extern char** environ;
+
+// pidfd_open gives us a pollable exit notification per child (Linux >= 5.3).
+// Bionic's seccomp policy on older Android kills the app on unknown syscalls,
+// so Android always uses the SIGCHLD self-pipe instead.
+#if defined(__linux__) && !defined(__ANDROID__)
+#define PW_HAVE_PIDFD 1
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#endif
+
+// close_range (Linux >= 5.9) lets the fork child drop every inherited fd in one call.
+// Android falls back to a close() loop for the same seccomp reason as pidfd.
+#if defined(__linux__) && !defined(__ANDROID__)
+#define PW_HAVE_CLOSE_RANGE 1
+#ifndef SYS_close_range
+#define SYS_close_range 436
+#endif
+#endif
+
+// posix_spawn (glibc implements it with clone(CLONE_VM|CLONE_VFORK), so the
+// parent's page tables are never copied). Bionic only has it from API 28.
+#if !defined(__ANDROID__) || __ANDROID_API__ >= 28
+#define PW_HAVE_POSIX_SPAWN 1
+#endif
+
+// memfd output capture. Bionic exposes memfd_create from API 30; older Android
+// (and anything without it) captures into an unlinked file under $TMPDIR instead.
+#if defined(__linux__) && (!defined(__ANDROID__) || __ANDROID_API__ >= 30)
+#define PW_HAVE_MEMFD 1
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#endif
+
+// spawn backends (set_spawn_backend / get_process_backend)
+#define PW_SPAWN_FORK        0
+#define PW_SPAWN_POSIX_SPAWN 1
+#define PW_SPAWN_SERVER      2 // sent to the spawn server (see spawn_server_start)
+
+// start_process_flags() flags
+#define PW_START_NEW_PGROUP  0x1 // child leads its own process group
+#define PW_START_NEW_SESSION 0x2 // child leads its own session (and group)
+#define PW_START_STDIN       0x4 // give the child a stdin pipe (see write_stdin)
+#define PW_START_CLEAR_ENV   0x8 // env_block is the child's whole environment
+
+// pw_redirect kinds: where a child's stdout/stderr goes (start_process_ex)
+#define PW_OUT_PIPE  0 // pipe read by read_* / the event loop (default)
+#define PW_OUT_FILE  1 // file at path, created or truncated (PW_REDIRECT_APPEND appends)
+#define PW_OUT_FD    2 // an fd of ours, dup'ed into the child
+#define PW_OUT_MEMFD 3 // anonymous memory file; map_output() it after the exit
+
+#define PW_REDIRECT_APPEND 0x1
+
+// pw_spawn_opts sched_policy
+#define PW_SCHED_INHERIT 0
+#define PW_SCHED_BATCH   1 // SCHED_BATCH: throughput work, no wakeup preemption
+#define PW_SCHED_IDLE    2 // SCHED_IDLE: runs only when a CPU has nothing else to do
+
+// get_exit_code of a child stopped for passing a deadline (pw_spawn_opts timeout_ms,
+// cpu_timeout_ms), whatever status it then exited with
+#define PW_EXIT_TIMED_OUT -3
+
+// pw_exit_info timed_out: which deadline stopped the child
+#define PW_TIMEOUT_WALL 1
+#define PW_TIMEOUT_CPU  2
+
+// wait_events() mask bits
+#define PW_EV_STDOUT 0x1
+#define PW_EV_STDERR 0x2
+#define PW_EV_EXIT   0x4
+#define PW_EV_STDIN  0x8 // write_stdin can make progress (or will report the reader gone)
+
+// Without a pidfd a SIGCHLD wakeup can be consumed by another waiter (or the event
+// loop), so fallback waits re-check the child at least this often. When the loop reaps
+// those children, wait_events sleeps on the entry's exit_efd instead.
+#define SIGCHLD_SLICE_MS 100
+
+// Event loop callback. event is PW_EVT_*; for stream events data/len is the chunk
+// read (len == 0 means EOF). PW_EVT_EXIT is delivered once both streams hit EOF and
+// the child was reaped, with len = exit code; it is the last callback for the handle.
+typedef void (*pw_event_cb)(int handle, int event, const char* data, int len, void* user);
+
+#define PW_EVT_STDOUT 1
+#define PW_EVT_STDERR 2
+#define PW_EVT_EXIT   3
+
+// How a child ended (see get_exit_info). Times are CLOCK_MONOTONIC nanoseconds; the
+// exit time is when the reaper collected the status, normally microseconds after it.
+typedef struct {
+    int       exit_code; // as get_exit_code
+    int       timed_out; // PW_TIMEOUT_* deadline that stopped the child, 0 = none
+    long long start_ns;  // just after the spawn returned
+    long long exit_ns;   // 0 while running
+    long long utime_us;  // rusage of the child (and its reaped descendants)
+    long long stime_us;
+    long long maxrss_kb;
+    long long spawn_ns;  // time spent launching, up to start_ns (see pw_proc_stats)
+    long long minflt;    // page faults and context switches, also from rusage
+    long long majflt;
+    long long nvcsw;
+    long long nivcsw;
+    long long stdout_stalls; // reads that found the pipe full (the child blocked on it)
+    long long stderr_stalls;
+    long long pipe_size;     // capacity of the stdout/stderr pipes, 0 if none
+    long long exec_ns;       // the fork-to-exec part of spawn_ns (fork backend), else 0
+} pw_exit_info;
+
+// Resource accounting for one child (see get_proc_stats). size is set by the caller
+// and only that many bytes are written, so fields can be appended later.
+typedef struct {
+    int       size;      // sizeof(pw_proc_stats)
+    int       exit_code; // as get_exit_code
+    long long spawn_ns;  // spawn-to-exec: posix_spawn and the fork backend (through its
+                         // exec-status pipe) both return after the exec; the helper
+                         // round trip for the spawn server
+    long long run_ns;    // exec-to-exit, or exec-to-now while running
+    long long utime_us;  // user / system CPU
+    long long stime_us;
+    long long maxrss_kb; // peak RSS
+    long long minflt;
+    long long majflt;
+    long long nvcsw;     // voluntary / involuntary context switches
+    long long nivcsw;
+    long long stdout_stalls; // as pw_exit_info
+    long long stderr_stalls;
+    long long pipe_size;
+    long long exec_ns;   // as pw_exit_info
+} pw_proc_stats;
+
+// Latency histogram (see procwrapper_get_stats): bucket 0 counts values under 1 us,
+// bucket i >= 1 values in [2^(i-1), 2^i) us; the last bucket also takes everything above.
+#define PW_HIST_BUCKETS 32
+typedef struct {
+    long long count;
+    long long sum_ns;
+    long long max_ns;
+    long long buckets[PW_HIST_BUCKETS];
+} pw_histogram;
+
+// Library-wide counters since load (or procwrapper_reset_stats). Like pw_proc_stats,
+// size is set by the caller and only that many bytes are written.
+typedef struct {
+    int       size;           // sizeof(pw_lib_stats)
+    int       reserved;
+    long long spawns;         // successful start_process* calls
+    long long spawn_failures; // start_process* calls that returned -1
+    long long exec_failures;  // fork children whose exec failed (reported via the status pipe)
+    long long spawns_fork;    // launches per backend
+    long long spawns_posix;
+    long long spawns_server;
+    long long stdout_bytes;   // bytes read from stdout/stderr pipes, all read paths
+    long long stderr_bytes;
+    long long reads;          // read() calls on those pipes
+    long long reads_eagain;   // ... that found nothing (EAGAIN)
+    long long lock_waits;     // handle lock acquisitions that had to wait
+    long long reaps;          // exits recorded
+    pw_histogram spawn;       // whole start_process_ex call
+    pw_histogram pipe_setup;  // pipes, redirects and F_SETPIPE_SZ
+    pw_histogram fork;        // fork() in the parent (fork backend)
+    pw_histogram exec;        // launch-to-exec: fork to exec seen through the status pipe,
+                              // the posix_spawn call, or the spawn server round trip
+    pw_histogram lock_wait;   // time blocked in those waits
+    pw_histogram reap;        // exit noticed (loop wakeup, or the reap call) to recorded
+    long long relay_bytes;    // spliced between monitored pipeline stages (PW_PIPELINE_MONITOR)
+    long long relay_dropped;  // ... of those, bytes that passed uncopied because the copy was full
+    long long timeouts;       // children stopped for passing a deadline
+} pw_lib_stats;
+
+// Exit callback (see watch_exit). It runs on whichever thread recorded the exit, with
+// the handle's lock held, so it must be short and must not call back into the library.
+typedef void (*pw_exit_cb)(int handle, const pw_exit_info* info, void* user);
+
+// Single-producer/single-consumer byte ring shared with the consumer (see
+// subscribe_process_ring). Positions are free-running byte counts; readable bytes
+// are [tail, head) modulo capacity. The layout is ABI: NativeProc.cs mirrors the
+// offsets, and head/tail sit on separate cache lines.
+#define PW_RING_DATA_OFFSET 128
+#define PW_RING_MIN_SIZE    4096u
+#define PW_RING_MAX_SIZE    (64u * 1024 * 1024)
+typedef struct {
+    uint32_t head;     // written by the event loop only
+    uint32_t capacity; // power of two
+    uint32_t eof;      // set once the pipe hit EOF; head is final
+    uint32_t stalled;  // ring was full and the loop stopped reading; see ring_resume
+    char     pad0[48];
+    uint32_t tail;     // written by the consumer only
+    char     pad1[60];
+} pw_ring;
+_Static_assert(sizeof(pw_ring) == PW_RING_DATA_OFFSET, "pw_ring header layout");
+_Static_assert(offsetof(pw_lib_stats, spawns) % sizeof(long long) == 0 && sizeof(pw_lib_stats) % sizeof(long long) == 0,
+               "pw_lib_stats is read as an array of long long");
+
+// read_lines() record: one line in the caller's buffer, newline (and a trailing \r) excluded
+typedef struct {
+    int offset;
+    int length;
+    int flags; // PW_LINE_*
+} pw_line;
+
+#define PW_LINE_CONTINUED 0x1 // the buffer filled before a newline: the next record goes on with this line
+
+// read_streams() in/out block. The caller fills the buffers and capacities; the call
+// fills the lengths, done (PW_EV_* bits: stream at EOF / child exited) and exit_code.
+typedef struct {
+    char* out_buf;
+    int   out_cap;
+    int   out_len;
+    char* err_buf;
+    int   err_cap;
+    int   err_len;
+    int   done;
+    int   exit_code;
+} pw_read_result;
 
 typedef struct {
+    int         kind;  // PW_OUT_*
+    int         fd;    // PW_OUT_FD
+    const char* path;  // PW_OUT_FILE
+    int         flags; // PW_REDIRECT_*
+} pw_redirect;
+
+// start_process_ex() options. Zero-initialize, then set size = sizeof(pw_spawn_opts);
+// fields past a caller's size read as zero, so older callers keep working.
+typedef struct {
+    int          size;
+    int          flags; // PW_START_*
+    const char*  path;
+    char* const* argv;  // NULL-terminated; or use argv_block
+    pw_redirect  out;   // stdout
+    pw_redirect  err;   // stderr
+    // packed strings, so a launch needs a single buffer from the caller
+    const char*  argv_block; // argc NUL-terminated strings back to back (used if argv is NULL)
+    const char*  env_block;  // envc "NAME=value" strings back to back, set over our environ
+    const char*  cwd;        // NULL = inherit
+    long long    rlimit_as;  // RLIMIT_AS in bytes, 0 = inherit
+    long long    rlimit_cpu; // RLIMIT_CPU in seconds, 0 = inherit
+    int          argc;
+    int          envc;
+    int          nice;       // added to the child's nice value, 0 = inherit
+    int          pipe_size;  // F_SETPIPE_SZ for the stdout/stderr pipes, 0 = kernel default
+    // deadlines, enforced by the event loop: SIGTERM (SIGKILL after timeout_grace_ms,
+    // or at once if that is <= 0), then the exit reads as PW_EXIT_TIMED_OUT
+    long long    timeout_ms;       // wall-clock time from the start, 0 = none
+    long long    cpu_timeout_ms;   // CPU time (user + system, all threads), 0 = none
+    int          timeout_grace_ms;
+    int          reserved;
+    // placement, applied in the child before exec (which takes the fork backend)
+    const unsigned char* cpu_affinity; // CPU bitmask as for sched_setaffinity (bit i = CPU i), NULL = inherit
+    int          cpu_affinity_size;     // bytes at cpu_affinity
+    int          sched_policy;          // PW_SCHED_*
+    int          ioprio;                // as ioprio_set(2) takes it: class << 13 | level, 0 = inherit
+    int          reserved2;
+    const char*  cgroup;                // cgroup v2 directory to join, NULL = stay in ours
+} pw_spawn_opts;
+
+// Size of the first pw_spawn_opts layout (through err).
+#define PW_SPAWN_OPTS_MIN_SIZE ((int)offsetof(pw_spawn_opts, argv_block))
+
+// PW_OUT_MEMFD capture kept by the slot until release_output.
+typedef struct {
+    int    fd;  // -1 if the stream is not captured
+    void*  map; // map_output() mapping, NULL until then
+    size_t len;
+} out_capture;
+
+// Partial line kept between read_lines calls.
+typedef struct {
+    char* buf;
+    int   len;
+    int   cap;
+} line_carry;
+
+// Each entry has its own lock and a cache line (or a few) to itself, so threads working
+// on different handles neither contend nor false-share.
+typedef struct __attribute__((aligned(64))) {
+    pthread_mutex_t lock; // guards everything below
     int   used;
+    uint32_t gen;    // bumped on release; part of the handle so stale handles miss
+    int   next_free; // free-list link while the slot is unused (under table_mutex)
     pid_t pid;
+    int   backend;   // PW_SPAWN_* used to launch this child
+    pid_t pgid;      // process group the child leads (pgid == pid) or joined (pipeline), 0 = ours
+    int   stdin_fd;  // our (non-blocking) write end, -1 if none or closed
     int   stdout_fd;
     int   stderr_fd;
-    int   exit_code; // -2 = running/not set, >=0 real exit code, -1 = error
+    int   pidfd;     // -1 if unavailable (old kernel / Android)
+    int   exit_code; // -2 = running/not set, >=0 real exit code, -1 = error, PW_EXIT_TIMED_OUT
+    // event loop subscription (see subscribe_process)
+    int         watched;
+    pw_event_cb cb;
+    void*       cb_user;
+    pw_ring*    ring[2]; // per-stream rings in ring mode (stdout, stderr), else NULL
+    int         paused[2]; // pause_stream: the loop is not draining this pipe
+    int         pipe_cap[2]; // F_GETPIPE_SZ of the stdout/stderr pipes, 0 if not a pipe
+    line_carry  carry[2]; // read_lines partial lines (stdout, stderr)
+    long long   kill_at; // stop_process_async: SIGKILL deadline (now_ms clock), 0 = none
+    long long   deadline_check; // next look at the deadlines below (now_ms clock), 0 = none
+    long long   wall_deadline;  // now_ms past which the child has timed out, 0 = none
+    long long   cpu_budget_ns;  // CPU time past which it has, 0 = none
+    int         timeout_grace;  // ms from the deadline's SIGTERM to SIGKILL
+    int         timed_out;      // PW_TIMEOUT_* that fired, 0 = none
+    out_capture capture[2]; // PW_OUT_MEMFD streams (stdout, stderr)
+    pw_exit_info exit_info; // exit_code mirrors the field above once final
+    pw_exit_cb   exit_cb;   // watch_exit: called once when the exit is recorded
+    void*        exit_user;
+    int          reaper;    // the event loop watches pidfd, so polls need not reap
+    int          exit_efd;  // eventfd record_exit_locked signals, made by wait_events on demand, -1 = none
 } proc_entry;
 
-#define MAX_PROCS 64
-static proc_entry procs[MAX_PROCS];
-static pthread_mutex_t procs_mutex = PTHREAD_MUTEX_INITIALIZER;
+// The handle table grows in fixed-size slabs so entries never move; a handle is
+// (generation << HANDLE_SLOT_BITS) | slot, always > 0.
+#define PROC_CHUNK_SHIFT 6
+#define PROC_CHUNK_SIZE  (1 << PROC_CHUNK_SHIFT)
+#define PROC_MAX_CHUNKS  1024
+#define HANDLE_SLOT_BITS 16
+#define HANDLE_SLOT_MASK ((1u << HANDLE_SLOT_BITS) - 1)
+#define HANDLE_GEN_MAX   0x7fffu
+
+// Lock order: loop_mutex, server_mutex, entry locks, table_mutex. A thread holds at
+// most one entry lock, except the spawn server's exit bookkeeping (see server_recv).
+static proc_entry* proc_chunks[PROC_MAX_CHUNKS];
+static int proc_nchunks = 0;    // written under table_mutex, read atomically
+static int proc_free_head = -1; // head of the free-slot list, under table_mutex
+static int stops_pending = 0;   // entries with a kill_at deadline (atomic)
+static int deadlines_pending = 0; // entries with a deadline_check (atomic)
+static int slots_in_use = 0;    // allocated slots, live or being set up (atomic)
+static pthread_mutex_t table_mutex = PTHREAD_MUTEX_INITIALIZER; // table growth and the free list
+static pthread_mutex_t nil_mutex = PTHREAD_MUTEX_INITIALIZER;   // stands in for slots that do not exist
+
+// ---- stats ----
+// Always on: relaxed atomic adds on a static block, plus two clock reads per timed
+// section. procwrapper_get_stats copies it out field by field.
+static pw_lib_stats lib_stats;
+
+static long long now_ns(void);
+
+static void stat_add(long long* counter, long long n) {
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+static void stat_time(pw_histogram* h, long long ns) {
+    if (ns < 0) ns = 0;
+    long long us = ns / 1000;
+    int b = us ? 64 - __builtin_clzll((unsigned long long)us) : 0;
+    if (b >= PW_HIST_BUCKETS) b = PW_HIST_BUCKETS - 1;
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum_ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->buckets[b], 1, __ATOMIC_RELAXED);
+    long long max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&h->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { }
+}
+
+// Trace sections for systrace/Perfetto. On Android, ATrace_* (API 23+) is looked up
+// at run time, so older devices simply get no markers; elsewhere these are no-ops.
+#ifdef __ANDROID__
+static void (*atrace_begin)(const char*);
+static void (*atrace_end)(void);
+static int (*atrace_enabled)(void);
+static pthread_once_t atrace_once = PTHREAD_ONCE_INIT;
+
+static void atrace_init(void) {
+    void* lib = dlopen("libandroid.so", RTLD_NOW | RTLD_LOCAL);
+    if (!lib) return;
+    atrace_enabled = (int (*)(void))dlsym(lib, "ATrace_isEnabled");
+    atrace_begin = (void (*)(const char*))dlsym(lib, "ATrace_beginSection");
+    atrace_end = (void (*)(void))dlsym(lib, "ATrace_endSection");
+    if (!atrace_enabled || !atrace_begin || !atrace_end) atrace_enabled = NULL;
+}
+
+// Returns 1 if a section was opened; pass that to trace_end.
+static int trace_begin(const char* name) {
+    pthread_once(&atrace_once, atrace_init);
+    if (!atrace_enabled || !atrace_enabled()) return 0;
+    atrace_begin(name);
+    return 1;
+}
+
+static void trace_end(int opened) {
+    if (opened) atrace_end();
+}
+#else
+static int trace_begin(const char* name) {
+    (void)name;
+    return 0;
+}
+
+static void trace_end(int opened) {
+    (void)opened;
+}
+#endif
+
+static proc_entry* slot_entry(uint32_t slot) {
+    uint32_t c = slot >> PROC_CHUNK_SHIFT;
+    if (c >= PROC_MAX_CHUNKS) return NULL;
+    proc_entry* chunk = __atomic_load_n(&proc_chunks[c], __ATOMIC_ACQUIRE);
+    return chunk ? &chunk[slot & (PROC_CHUNK_SIZE - 1)] : NULL;
+}
+
+static int slot_count(void) {
+    return __atomic_load_n(&proc_nchunks, __ATOMIC_ACQUIRE) * PROC_CHUNK_SIZE;
+}
+
+static int make_handle(uint32_t slot, uint32_t gen) {
+    return (int)((gen << HANDLE_SLOT_BITS) | slot);
+}
+
+// The lock of handle's slot, whether or not the handle is still live.
+static pthread_mutex_t* slot_mutex(int handle) {
+    proc_entry* p = handle > 0 ? slot_entry((uint32_t)handle & HANDLE_SLOT_MASK) : NULL;
+    return p ? &p->lock : &nil_mutex;
+}
+
+// The uncontended path is a single trylock; only waits are timed.
+static void slot_lock(int handle) {
+    pthread_mutex_t* m = slot_mutex(handle);
+    if (pthread_mutex_trylock(m) == 0) return;
+    long long t0 = now_ns();
+    pthread_mutex_lock(m);
+    stat_add(&lib_stats.lock_waits, 1);
+    stat_time(&lib_stats.lock_wait, now_ns() - t0);
+}
+
+static void slot_unlock(int handle) {
+    pthread_mutex_unlock(slot_mutex(handle));
+}
+
+// Resolve a handle to its live entry, or NULL if malformed/stale. Call with slot_lock(handle) held.
+static proc_entry* entry_locked(int handle) {
+    if (handle <= 0) return NULL;
+    proc_entry* p = slot_entry((uint32_t)handle & HANDLE_SLOT_MASK);
+    if (!p || !p->used || p->gen != ((uint32_t)handle >> HANDLE_SLOT_BITS)) return NULL;
+    return p;
+}
+
+// Called with table_mutex held.
+static int grow_table(void) {
+    if (proc_nchunks >= PROC_MAX_CHUNKS) return -1;
+    void* mem = NULL;
+    if (posix_memalign(&mem, 64, PROC_CHUNK_SIZE * sizeof(proc_entry)) != 0) return -1;
+    proc_entry* chunk = memset(mem, 0, PROC_CHUNK_SIZE * sizeof(proc_entry));
+    int base = proc_nchunks * PROC_CHUNK_SIZE;
+    for (int i = 0; i < PROC_CHUNK_SIZE; ++i) {
+        pthread_mutex_init(&chunk[i].lock, NULL);
+        chunk[i].gen = 1;
+        chunk[i].stdin_fd = chunk[i].stdout_fd = chunk[i].stderr_fd = chunk[i].pidfd = chunk[i].exit_efd = -1;
+        chunk[i].capture[0].fd = chunk[i].capture[1].fd = -1;
+        chunk[i].next_free = i + 1 < PROC_CHUNK_SIZE ? base + i + 1 : proc_free_head;
+    }
+    __atomic_store_n(&proc_chunks[proc_nchunks], chunk, __ATOMIC_RELEASE);
+    __atomic_store_n(&proc_nchunks, proc_nchunks + 1, __ATOMIC_RELEASE);
+    proc_free_head = base;
+    return 0;
+}
+
+// Pop a free slot (not yet visible to handle lookups).
+static int slot_alloc(void) {
+    pthread_mutex_lock(&table_mutex);
+    int slot = -1;
+    if (proc_free_head >= 0 || grow_table() == 0) {
+        slot = proc_free_head;
+        proc_entry* p = slot_entry((uint32_t)slot);
+        proc_free_head = p->next_free;
+        p->next_free = -1;
+        __atomic_add_fetch(&slots_in_use, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&table_mutex);
+    return slot;
+}
+
+static void capture_close(out_capture* c) {
+    if (c->map) munmap(c->map, c->len);
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+    c->map = NULL;
+    c->len = 0;
+}
+
+static void deadline_clear(proc_entry* p) {
+    if (!p->deadline_check) return;
+    p->deadline_check = 0;
+    __atomic_sub_fetch(&deadlines_pending, 1, __ATOMIC_RELAXED);
+}
+
+// Push a slot back and invalidate outstanding handles. Called with the slot's lock held
+// (or before it was ever published).
+static void slot_release(uint32_t slot) {
+    proc_entry* p = slot_entry(slot);
+    capture_close(&p->capture[0]);
+    capture_close(&p->capture[1]);
+    if (p->exit_efd >= 0) {
+        close(p->exit_efd);
+        p->exit_efd = -1;
+    }
+    if (p->stdin_fd >= 0) {
+        close(p->stdin_fd);
+        p->stdin_fd = -1;
+    }
+    if (p->kill_at) {
+        p->kill_at = 0;
+        __atomic_sub_fetch(&stops_pending, 1, __ATOMIC_RELAXED);
+    }
+    deadline_clear(p);
+    for (int i = 0; i < 2; ++i) {
+        free(p->carry[i].buf);
+        p->carry[i].buf = NULL;
+        p->carry[i].len = p->carry[i].cap = 0;
+    }
+    p->exit_cb = NULL;
+    p->exit_user = NULL;
+    p->used = 0;
+    p->gen = p->gen >= HANDLE_GEN_MAX ? 1 : p->gen + 1;
+    pthread_mutex_lock(&table_mutex);
+    p->next_free = proc_free_head;
+    proc_free_head = (int)slot;
+    __atomic_sub_fetch(&slots_in_use, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&table_mutex);
+}
 
 static int set_nonblocking(int fd) {
     int flags = fcntl(fd, F_GETFL, 0);
@@ -29,63 +556,401 @@ static int set_nonblocking(int fd) {
     return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
-// Reap child if finished; ONLY set exit_code here.
-// Do NOT close fds or clear 'used' so readers can drain and observe EOF.
-static void reap_if_finished(int idx) {
-    if (idx < 0 || idx >= MAX_PROCS) return;
+// Both ends are close-on-exec from birth, so no concurrently spawned child can
+// inherit them; only the read end (ours) is non-blocking, the child's end stays blocking.
+static int make_pipe(int p[2]) {
+    if (pipe2(p, O_CLOEXEC) == -1) return -1;
+    if (set_nonblocking(p[0]) == -1) {
+        close(p[0]);
+        close(p[1]);
+        return -1;
+    }
+    return 0;
+}
 
-    // Fast check: if we already have a final code, don't call waitpid again.
-    pthread_mutex_lock(&procs_mutex);
-    if (!procs[idx].used || procs[idx].exit_code != -2) {
-        pthread_mutex_unlock(&procs_mutex);
-        return;
+// Resize a pipe (size > 0) and return its capacity, or 0 if that is unknown. The kernel
+// rounds up to a power-of-two number of pages and refuses sizes above
+// /proc/sys/fs/pipe-max-size for unprivileged callers; the default is kept then.
+static int pipe_resize(int fd, int size) {
+#if defined(F_SETPIPE_SZ) && defined(F_GETPIPE_SZ)
+    if (size > 0) (void)fcntl(fd, F_SETPIPE_SZ, size);
+    int cap = fcntl(fd, F_GETPIPE_SZ);
+    return cap > 0 ? cap : 0;
+#else
+    (void)fd;
+    (void)size;
+    return 0;
+#endif
+}
+
+// Account one read() of stream si (bytes, EAGAIN), and count it as a stall if it found
+// the pipe full, i.e. the child was (or was about to be) blocked writing. n is what the
+// read returned into cap bytes of buffer; only a read that filled the buffer can have
+// emptied a full pipe, so the FIONREAD check is rare. errno must still be the read's.
+// Entries never move, so this is safe without the lock while the caller pins the slot.
+static void note_pipe_read(proc_entry* p, int si, int fd, ssize_t n, int cap) {
+    stat_add(&lib_stats.reads, 1);
+    if (n > 0) stat_add(si ? &lib_stats.stderr_bytes : &lib_stats.stdout_bytes, n);
+    else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) stat_add(&lib_stats.reads_eagain, 1);
+    int size = p->pipe_cap[si];
+    if (size <= 0 || n <= 0) return;
+    if (n < size) {
+        if (n < cap) return;
+        int avail = 0;
+        if (ioctl(fd, FIONREAD, &avail) == -1 || n + avail < size) return;
     }
-    pid_t pid = procs[idx].pid;
-    pthread_mutex_unlock(&procs_mutex);
+    __atomic_add_fetch(si ? &p->exit_info.stderr_stalls : &p->exit_info.stdout_stalls, 1, __ATOMIC_RELAXED);
+}
 
-    int status = 0;
-    pid_t r = waitpid(pid, &status, WNOHANG);
+// Same as make_pipe, but for the child's stdin: the write end (ours) is non-blocking.
+static int make_stdin_pipe(int p[2]) {
+    if (pipe2(p, O_CLOEXEC) == -1) return -1;
+    if (set_nonblocking(p[1]) == -1) {
+        close(p[0]);
+        close(p[1]);
+        return -1;
+    }
+    return 0;
+}
+
+// Anonymous file for PW_OUT_MEMFD, close-on-exec. Returns the fd or -1.
+static int capture_open(void) {
+    int fd;
+#if defined(PW_HAVE_MEMFD) && defined(SYS_memfd_create)
+    fd = (int)syscall(SYS_memfd_create, "procwrapper-out", MFD_CLOEXEC);
+    if (fd >= 0 || errno != ENOSYS) return fd;
+#endif
+    const char* dir = getenv("TMPDIR");
+    char tmpl[512];
+    snprintf(tmpl, sizeof(tmpl), "%s/procwrapper-out-XXXXXX", dir && *dir ? dir : "/tmp");
+    fd = mkostemp(tmpl, O_CLOEXEC);
+    if (fd >= 0) unlink(tmpl);
+    return fd;
+}
+
+// Upper bound for the close() loop in the fork child; computed before fork.
+static int max_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < 65536)
+        return (int)rl.rlim_cur;
+    return 65536;
+}
+
+// Fork child only: close every fd >= first, including ones the host opened without O_CLOEXEC.
+static void close_fds_from(int first, int limit) {
+#ifdef PW_HAVE_CLOSE_RANGE
+    if (syscall(SYS_close_range, (unsigned)first, ~0u, 0) == 0) return;
+#endif
+    for (int fd = first; fd < limit; ++fd) close(fd);
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// CPU deadlines are polled no more often than this
+#define DEADLINE_MIN_CHECK_MS 10
+
+// CPU time a running child has used so far (all its threads), -1 if unreadable.
+static long long child_cpu_ns(pid_t pid) {
+    clockid_t clk;
+    struct timespec ts;
+    if (clock_getcpuclockid(pid, &clk) != 0 || clock_gettime(clk, &ts) != 0) return -1;
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// When to look at p's deadlines next (now_ms clock), given the CPU time it used so far:
+// the wall deadline, or the soonest its CPU budget could run out with every CPU busy.
+static long long deadline_next(const proc_entry* p, long long now, long long cpu_used_ns) {
+    static long ncpu;
+    long long next = p->wall_deadline;
+    if (p->cpu_budget_ns) {
+        if (ncpu <= 0) ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        long long left = (p->cpu_budget_ns - cpu_used_ns) / 1000000 / (ncpu > 0 ? ncpu : 1);
+        if (left < DEADLINE_MIN_CHECK_MS) left = DEADLINE_MIN_CHECK_MS;
+        if (!next || now + left < next) next = now + left;
+    }
+    return next;
+}
+
+static int open_pidfd(pid_t pid) {
+#ifdef PW_HAVE_PIDFD
+    static int pidfd_unsupported = 0;
+    if (__atomic_load_n(&pidfd_unsupported, __ATOMIC_RELAXED)) return -1;
+    int fd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (fd < 0 && (errno == ENOSYS || errno == EPERM))
+        __atomic_store_n(&pidfd_unsupported, 1, __ATOMIC_RELAXED);
+    return fd;
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+// ---- SIGCHLD self-pipe (fallback exit notification) ----
+static int sigchld_pipe[2] = { -1, -1 };
+static struct sigaction old_sigchld_action;
+static pthread_once_t sigchld_once = PTHREAD_ONCE_INIT;
+
+static void on_sigchld(int sig, siginfo_t* info, void* uctx) {
+    int saved = errno;
+    char b = 0;
+    if (sigchld_pipe[1] >= 0) (void)!write(sigchld_pipe[1], &b, 1);
+    // Chain to whoever was installed before us (e.g. the .NET runtime).
+    if (old_sigchld_action.sa_flags & SA_SIGINFO) {
+        if (old_sigchld_action.sa_sigaction) old_sigchld_action.sa_sigaction(sig, info, uctx);
+    } else if (old_sigchld_action.sa_handler != SIG_DFL && old_sigchld_action.sa_handler != SIG_IGN) {
+        old_sigchld_action.sa_handler(sig);
+    }
+    errno = saved;
+}
 
-    pthread_mutex_lock(&procs_mutex);
-    // Another thread might have set exit_code while we were in waitpid.
-    if (!procs[idx].used || procs[idx].exit_code != -2) {
-        pthread_mutex_unlock(&procs_mutex);
+static void install_sigchld_pipe(void) {
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        sigchld_pipe[0] = sigchld_pipe[1] = -1;
         return;
     }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = on_sigchld;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, &old_sigchld_action);
+}
+
+static int sigchld_fd(void) {
+    pthread_once(&sigchld_once, install_sigchld_pipe);
+    return sigchld_pipe[0];
+}
+
+static void drain_fd(int fd) {
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0) { }
+}
+
+static int exit_code_from_status(int status) {
+    if (WIFEXITED(status))   return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return -1;
+}
+
+// The child exited and this is its code (not -2 running, not -1 error).
+static int exit_final(int code) {
+    return code >= 0 || code == PW_EXIT_TIMED_OUT;
+}
+
+// Spawn-server children are not ours to wait for; their exits arrive over the socket.
+static void server_poll(void);
+static void server_poll_locked(const proc_entry* held);
+static void reaper_watch(int handle);
+static int loop_reaps_locked(const proc_entry* p);
+static int loop_start(void);
+static void loop_wakeup(void);
+static int stop_signal_locked(proc_entry* p, int grace_ms);
+
+// When this thread began the check that found the current exit, for the reap histogram:
+// the loop thread's last wakeup, or the start of a reap call elsewhere.
+static __thread long long reap_from_ns;
+static __thread int reap_on_loop;
+
+static long long timeval_us(struct timeval tv) {
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// Every exit goes through here: store the code, time and rusage (ru may be NULL), then
+// fire the watch_exit callback. Called with p's lock held and p->exit_code == -2.
+static void record_exit_locked(proc_entry* p, int handle, int code, const struct rusage* ru) {
+    if (p->timed_out) code = PW_EXIT_TIMED_OUT;
+    deadline_clear(p);
+    p->exit_code = code;
+    p->exit_info.exit_code = code;
+    p->exit_info.timed_out = p->timed_out;
+    p->exit_info.exit_ns = now_ns();
+    stat_add(&lib_stats.reaps, 1);
+    if (reap_from_ns) stat_time(&lib_stats.reap, p->exit_info.exit_ns - reap_from_ns);
+    if (ru) {
+        p->exit_info.utime_us = timeval_us(ru->ru_utime);
+        p->exit_info.stime_us = timeval_us(ru->ru_stime);
+        p->exit_info.maxrss_kb = ru->ru_maxrss;
+        p->exit_info.minflt = ru->ru_minflt;
+        p->exit_info.majflt = ru->ru_majflt;
+        p->exit_info.nvcsw = ru->ru_nvcsw;
+        p->exit_info.nivcsw = ru->ru_nivcsw;
+    }
+    if (p->exit_efd >= 0) {
+        uint64_t one = 1;
+        (void)!write(p->exit_efd, &one, sizeof(one)); // left readable: the exit is final
+    }
+    pw_exit_cb cb = p->exit_cb;
+    p->exit_cb = NULL;
+    if (cb) cb(handle, &p->exit_info, p->exit_user);
+}
 
-    if (r == pid) {
-        if (WIFEXITED(status))       procs[idx].exit_code = WEXITSTATUS(status);
-        else if (WIFSIGNALED(status)) procs[idx].exit_code = 128 + WTERMSIG(status);
-        else                          procs[idx].exit_code = -1;
+// Non-blocking reap; called with p's lock held and p->exit_code == -2. The lock also
+// serializes concurrent reapers, so none of them can see ECHILD for a child another one
+// just collected.
+static void reap_locked(proc_entry* p, int handle) {
+    if (!reap_on_loop) reap_from_ns = now_ns();
+    if (p->backend == PW_SPAWN_SERVER) {
+        server_poll_locked(p);
+        return;
+    }
+    int status = 0;
+    struct rusage ru;
+    pid_t r = wait4(p->pid, &status, WNOHANG, &ru);
+    if (r == p->pid) {
+        record_exit_locked(p, handle, exit_code_from_status(status), &ru);
     } else if (r == -1) {
-        // Only mark -1 if we truly haven't recorded anything yet.
-        procs[idx].exit_code = -1;
+        record_exit_locked(p, handle, -1, NULL);
     }
-    pthread_mutex_unlock(&procs_mutex);
 }
 
-// start_process: path is full path to binary, argv is NULL-terminated array of char* (C strings)
-__attribute__((visibility("default")))
-int start_process(const char* path, char* const argv[]) {
-    if (!path || !argv) return -1;
+// Reap child if finished; ONLY set exit_code here.
+// Do NOT close fds or clear 'used' so readers can drain and observe EOF.
+static void reap_if_finished(int handle) {
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    // Fast check: if we already have a final code, don't call waitpid again.
+    if (p && p->exit_code == -2) {
+        if (p->backend == PW_SPAWN_SERVER) {
+            // wait for a spawn in progress rather than skip, so pollers do not spin
+            slot_unlock(handle);
+            if (!reap_on_loop) reap_from_ns = now_ns();
+            server_poll();
+            return;
+        }
+        reap_locked(p, handle);
+    }
+    slot_unlock(handle);
+}
+
+// ---- spawn backends ----
+
+// Child-side setup besides the fds, applied between fork and exec.
+typedef struct {
+    char* const* envp; // NULL = our environ
+    const char*  cwd;
+    long long    rlimit_as;
+    long long    rlimit_cpu;
+    int          nice;
+    pid_t        pgid;   // join this process group (later pipeline stages), 0 = none
+    const unsigned char* cpu_mask; // sched_setaffinity mask, NULL = inherit
+    int          cpu_mask_size;
+    int          sched_policy; // PW_SCHED_*
+    int          ioprio;       // ioprio_set value, 0 = inherit
+    const char*  cgroup_procs; // <cgroup v2 dir>/cgroup.procs to move into, NULL = none
+} child_setup;
 
-    pthread_mutex_lock(&procs_mutex);
-    int idx = -1;
-    for (int i = 0; i < MAX_PROCS; ++i) {
-        if (!procs[i].used) { idx = i; break; }
+// Whether setup needs the fork backend (posix_spawn has no attribute for it).
+static int setup_needs_fork(const child_setup* cs) {
+#if !(defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 29))
+    if (cs->cwd) return 1; // no posix_spawn_file_actions_addchdir_np
+#endif
+    return cs->rlimit_as || cs->rlimit_cpu || cs->nice || cs->cpu_mask || cs->sched_policy || cs->ioprio || cs->cgroup_procs;
+}
+
+// Lower the soft limit only; it is capped at the hard limit rather than failing.
+static int set_soft_limit(int resource, long long value) {
+    struct rlimit rl;
+    if (getrlimit(resource, &rl) == -1) return -1;
+    rlim_t v = (rlim_t)value;
+    rl.rlim_cur = rl.rlim_max != RLIM_INFINITY && v > rl.rlim_max ? rl.rlim_max : v;
+    return setrlimit(resource, &rl);
+}
+
+// Fork child only: move ourselves into the cgroup whose cgroup.procs file is procs (the
+// path is built by the parent; only async-signal-safe calls here). Writing "0" means the
+// writer, and the migration takes all our threads (just one here).
+static int join_cgroup(const char* procs) {
+    int fd = open(procs, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    ssize_t n = write(fd, "0", 1);
+    int e = errno;
+    close(fd);
+    errno = e;
+    return n == 1 ? 0 : -1;
+}
+
+// In the fork child. Returns 0, or -1 with errno set.
+static int apply_child_setup(const child_setup* cs) {
+    if (cs->cwd && chdir(cs->cwd) == -1) return -1;
+    if (cs->rlimit_as && set_soft_limit(RLIMIT_AS, cs->rlimit_as) == -1) return -1;
+    if (cs->rlimit_cpu && set_soft_limit(RLIMIT_CPU, cs->rlimit_cpu) == -1) return -1;
+    // the cgroup first, so its cpuset cannot undo the affinity below
+    if (cs->cgroup_procs && join_cgroup(cs->cgroup_procs) == -1) return -1;
+    if (cs->cpu_mask && sched_setaffinity(0, (size_t)cs->cpu_mask_size, (const cpu_set_t*)(const void*)cs->cpu_mask) == -1) return -1;
+    if (cs->sched_policy) {
+        struct sched_param sp = { 0 }; // both policies take priority 0; nice still applies
+        if (sched_setscheduler(0, cs->sched_policy == PW_SCHED_IDLE ? SCHED_IDLE : SCHED_BATCH, &sp) == -1) return -1;
     }
-    pthread_mutex_unlock(&procs_mutex);
-    if (idx == -1) return -1;
+#ifdef SYS_ioprio_set
+    if (cs->ioprio && syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, cs->ioprio) == -1) return -1;
+#else
+    if (cs->ioprio) { errno = ENOSYS; return -1; }
+#endif
+    if (cs->nice) {
+        errno = 0;
+        if (nice(cs->nice) == -1 && errno != 0) return -1;
+    }
+    return 0;
+}
+
+#ifdef PW_HAVE_POSIX_SPAWN
+static int spawn_backend = PW_SPAWN_POSIX_SPAWN;
+#else
+static int spawn_backend = PW_SPAWN_FORK;
+#endif
+
+// Fork child only: hand errno to the parent through the exec-status pipe; the parent
+// reaps us and fails the start with it.
+static void child_fail(int status_fd, int e) {
+    (void)!write(status_fd, &e, sizeof(e));
+    _exit(127);
+}
 
-    int outpipe[2];
-    int errpipe[2];
-    if (pipe(outpipe) == -1) return -1;
-    if (pipe(errpipe) == -1) { close(outpipe[0]); close(outpipe[1]); return -1; }
+// Move fd above stderr, so the child's dup2s onto 0-2 cannot clobber it. Returns the
+// (close-on-exec) fd, or -1 with fd closed.
+static int fd_above_stdio(int fd) {
+    if (fd > STDERR_FILENO) return fd;
+    int moved = fcntl(fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+    close(fd);
+    return moved;
+}
+
+// Start the child with stdin/stdout/stderr on the given fds. Returns 0 or -1 with errno set.
+// Like posix_spawn, this returns once the child has exec'ed: the exec-status pipe is
+// close-on-exec, so the parent reads EOF on success and the child's errno on failure
+// (the child is reaped then, so a failed exec leaves nothing behind). *exec_ns is the
+// fork-to-exec part of the launch.
+static int spawn_fork(const char* path, char* const argv[], int flags, int child_in, int child_out, int child_err, const child_setup* cs, pid_t* out_pid, long long* exec_ns) {
+    int fd_limit = max_fd_limit();
+    int status[2];
+    if (pipe2(status, O_CLOEXEC) == -1) return -1;
+    status[0] = fd_above_stdio(status[0]);
+    status[1] = fd_above_stdio(status[1]);
+    if (status[0] < 0 || status[1] < 0) {
+        int e = errno;
+        if (status[0] >= 0) close(status[0]);
+        if (status[1] >= 0) close(status[1]);
+        errno = e;
+        return -1;
+    }
 
+    long long t0 = now_ns();
     pid_t pid = fork();
     if (pid < 0) {
-        close(outpipe[0]); close(outpipe[1]);
-        close(errpipe[0]); close(errpipe[1]);
+        int e = errno;
+        close(status[0]);
+        close(status[1]);
+        errno = e;
         return -1;
     }
 
@@ -93,160 +958,2739 @@ int start_process(const char* path, char* const argv[]) {
         // child
         signal(SIGINT,  SIG_DFL);
         signal(SIGTERM, SIG_DFL);
+        if (flags & PW_START_NEW_SESSION) setsid();
+        else if (flags & PW_START_NEW_PGROUP) setpgid(0, 0);
+        else if (cs->pgid) setpgid(0, cs->pgid);
 
-        close(outpipe[0]);
-        close(errpipe[0]);
-        dup2(outpipe[1], STDOUT_FILENO);
-        dup2(errpipe[1], STDERR_FILENO);
-        close(outpipe[1]);
-        close(errpipe[1]);
+        // dup2 clears O_CLOEXEC on the targets; the source fds themselves go away below
+        if (child_in >= 0) dup2(child_in, STDIN_FILENO);
+        dup2(child_out, STDOUT_FILENO);
+        dup2(child_err, STDERR_FILENO);
+        // the status pipe becomes fd 3 (still close-on-exec); everything above goes
+        int sfd = status[1];
+        if (sfd != STDERR_FILENO + 1) {
+            sfd = dup3(status[1], STDERR_FILENO + 1, O_CLOEXEC);
+            if (sfd == -1) sfd = status[1]; // keep it where it is; it may be closed below
+        }
+        close_fds_from(STDERR_FILENO + 2, fd_limit);
 
-        // execv - use provided argv
-        execv(path, argv);
-        // if execv fails: report reason then exit 127
-        int e = errno;
-        dprintf(STDERR_FILENO, "execv failed: %s (%d) path=%s\n", strerror(e), e, path);
-        _exit(127);
-    }
+        if (apply_child_setup(cs) == -1) child_fail(sfd, errno);
 
-    // parent
-    close(outpipe[1]);
-    close(errpipe[1]);
+        // execve - use provided argv
+        execve(path, argv, cs->envp ? cs->envp : environ);
+        child_fail(sfd, errno);
+    }
 
-    set_nonblocking(outpipe[0]);
-    set_nonblocking(errpipe[0]);
+    long long forked = now_ns();
+    close(status[1]);
+    // also from the parent, so the group exists before anyone signals it
+    if ((flags & PW_START_NEW_PGROUP) && !(flags & PW_START_NEW_SESSION)) setpgid(pid, pid);
+    else if (cs->pgid && !(flags & PW_START_NEW_SESSION)) setpgid(pid, cs->pgid);
 
-    pthread_mutex_lock(&procs_mutex);
-    procs[idx].used      = 1;
-    procs[idx].pid       = pid;
-    procs[idx].stdout_fd = outpipe[0];
-    procs[idx].stderr_fd = errpipe[0];
-    procs[idx].exit_code = -2; // running
-    pthread_mutex_unlock(&procs_mutex);
+    int child_errno = 0;
+    ssize_t n;
+    do {
+        n = read(status[0], &child_errno, sizeof(child_errno));
+    } while (n == -1 && errno == EINTR);
+    close(status[0]);
+    long long execd = now_ns();
+    stat_time(&lib_stats.fork, forked - t0);
+    stat_time(&lib_stats.exec, execd - forked);
+    if (n == (ssize_t)sizeof(child_errno)) {
+        stat_add(&lib_stats.exec_failures, 1);
+        // it _exits right after writing; nobody else waits for a pid we never published
+        while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) { }
+        errno = child_errno ? child_errno : ENOEXEC;
+        return -1;
+    }
 
-    return idx;
+    *out_pid = pid;
+    *exec_ns = execd - forked;
+    return 0;
 }
 
-static void maybe_clear_slot_after_eof(int handle) {
-    // Called with mutex locked by caller
-    if (handle < 0 || handle >= MAX_PROCS) return;
-    if (!procs[handle].used) return;
-    if (procs[handle].stdout_fd < 0 && procs[handle].stderr_fd < 0 && procs[handle].exit_code >= 0) {
-        procs[handle].used = 0;
+#ifdef PW_HAVE_POSIX_SPAWN
+// Same contract as spawn_fork. Note glibc reports exec failures (e.g. ENOENT)
+// straight from posix_spawn, so no child is left behind to exit with 127.
+static int spawn_posix(const char* path, char* const argv[], int flags, int child_in, int child_out, int child_err, const child_setup* cs, pid_t* out_pid, long long* exec_ns) {
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    int rc = posix_spawn_file_actions_init(&fa);
+    if (rc != 0) { errno = rc; return -1; }
+    rc = posix_spawnattr_init(&attr);
+    if (rc != 0) { posix_spawn_file_actions_destroy(&fa); errno = rc; return -1; }
+
+    // our fds are O_CLOEXEC, so only the dup2 targets survive exec
+    if (child_in >= 0) posix_spawn_file_actions_adddup2(&fa, child_in, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, child_out, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, child_err, STDERR_FILENO);
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 34)
+    // also drop fds the host opened without O_CLOEXEC
+    posix_spawn_file_actions_addclosefrom_np(&fa, STDERR_FILENO + 1);
+#endif
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 29)
+    if (cs->cwd) posix_spawn_file_actions_addchdir_np(&fa, cs->cwd);
+#endif
+
+    // like the fork path: the child must not inherit ignored SIGINT/SIGTERM
+    sigset_t def;
+    sigemptyset(&def);
+    sigaddset(&def, SIGINT);
+    sigaddset(&def, SIGTERM);
+    posix_spawnattr_setsigdefault(&attr, &def);
+    short attr_flags = POSIX_SPAWN_SETSIGDEF;
+#ifdef POSIX_SPAWN_SETSID
+    if (flags & PW_START_NEW_SESSION) attr_flags |= POSIX_SPAWN_SETSID;
+    else
+#endif
+    if (flags & PW_START_NEW_PGROUP) {
+        posix_spawnattr_setpgroup(&attr, 0);
+        attr_flags |= POSIX_SPAWN_SETPGROUP;
+    } else if (cs->pgid) {
+        posix_spawnattr_setpgroup(&attr, cs->pgid);
+        attr_flags |= POSIX_SPAWN_SETPGROUP;
     }
+    posix_spawnattr_setflags(&attr, attr_flags);
+
+    pid_t pid = 0;
+    long long t0 = now_ns();
+    rc = posix_spawn(&pid, path, &fa, &attr, argv, cs->envp ? cs->envp : environ);
+    stat_time(&lib_stats.exec, now_ns() - t0);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+    if (rc != 0) { errno = rc; return -1; }
+
+    *out_pid = pid;
+    *exec_ns = 0; // one call; the fork/exec split is not visible
+    return 0;
 }
+#endif
 
-__attribute__((visibility("default")))
-int read_stdout(int handle, char* buffer, int buflen) {
-    if (!buffer || buflen <= 0) return -1;
-    if (handle < 0 || handle >= MAX_PROCS) return -1;
+// child_* are the fds the child gets as stdin (or -1 to inherit ours), stdout and stderr.
+// Both backends report a failed exec here, with errno set; *exec_ns is the fork-to-exec
+// time where the backend can tell it apart, else 0.
+static int spawn_child(int backend, const char* path, char* const argv[], int flags, int child_in, int child_out, int child_err, const child_setup* cs, pid_t* out_pid, long long* exec_ns) {
+#ifdef PW_HAVE_POSIX_SPAWN
+    if (backend == PW_SPAWN_POSIX_SPAWN) return spawn_posix(path, argv, flags, child_in, child_out, child_err, cs, out_pid, exec_ns);
+#endif
+    (void)backend;
+    return spawn_fork(path, argv, flags, child_in, child_out, child_err, cs, out_pid, exec_ns);
+}
 
-    pthread_mutex_lock(&procs_mutex);
-    int fd = procs[handle].stdout_fd;
-    pthread_mutex_unlock(&procs_mutex);
-    if (fd < 0) return 0;
+// ---- spawn server ----
+// fork() cost grows with the host's address space (page tables, and on Android it
+// competes with the GC). spawn_server_start forks a helper while the host is still
+// small; later launches are sent to it over a SOCK_SEQPACKET socketpair together with
+// the child's stdio fds (SCM_RIGHTS), it spawns the child and reports the pid, and it
+// forwards each exit status when it reaps one. The helper exits when the socket closes.
 
-    ssize_t n = read(fd, buffer, buflen);
-    if (n == 0) {
-        // EOF: close and possibly free slot
-        pthread_mutex_lock(&procs_mutex);
-        if (procs[handle].stdout_fd >= 0) {
-            close(procs[handle].stdout_fd);
-            procs[handle].stdout_fd = -1;
-            maybe_clear_slot_after_eof(handle);
-        }
-        pthread_mutex_unlock(&procs_mutex);
-        return 0;
+#define SRV_OP_SPAWN   1
+#define SRV_OP_SPAWNED 2
+#define SRV_OP_EXIT    3
+#define SRV_MAX_MSG    (64 * 1024) // request: srv_request + packed strings
+#define SRV_MAX_STRS   2048        // argv + env pointers, NULL terminators included
+
+typedef struct {
+    int       op;      // SRV_OP_SPAWN
+    int       flags;   // PW_START_*; PW_START_STDIN means three fds come along, else two
+    int       argc;
+    int       envc;    // -1 = the helper's environment
+    int       has_cwd;
+    int       nice;
+    int       pgid;    // child_setup.pgid
+    int       reserved;
+    long long rlimit_as;
+    long long rlimit_cpu;
+    int       sched_policy;
+    int       ioprio;
+    int       cpu_mask_size; // 0 = inherit
+    int       has_cgroup;
+    // then NUL-terminated: path, argv[argc], env[envc], cwd if has_cwd, the cgroup.procs
+    // path if has_cgroup; then cpu_mask_size bytes of affinity mask
+} srv_request;
+
+typedef struct {
+    int       op;    // SRV_OP_SPAWNED or SRV_OP_EXIT
+    int       pid;
+    int       value; // SPAWNED: 0 or the spawn errno; EXIT: exit code (exit_code_from_status)
+    int       reserved;
+    long long utime_us, stime_us, maxrss_kb; // EXIT: the child's rusage
+    long long minflt, majflt, nvcsw, nivcsw;
+} srv_reply;
+
+// Host side. server_fd changes with both server_mutex and table_mutex held; a spawn holds
+// server_mutex until its entry is published, so an exit message can never arrive for a
+// pid the table does not know yet.
+static int server_fd = -1;
+static pid_t server_pid = -1;
+static int loop_server_fd = -1; // server_fd as registered with the event loop, under table_mutex
+static pthread_mutex_t server_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Helper side: fixed buffers sized for the largest request, so receiving and unpacking
+// one allocates nothing (the spawn itself still does, in posix_spawn's file actions).
+static int srv_chld_pipe[2] = { -1, -1 };
+static char srv_buf[SRV_MAX_MSG];
+static char* srv_strs[SRV_MAX_STRS];
+
+static void srv_on_chld(int sig) {
+    (void)sig;
+    int saved = errno;
+    char b = 0;
+    (void)!write(srv_chld_pipe[1], &b, 1);
+    errno = saved;
+}
+
+static void srv_on_term(int sig) {
+    (void)sig; // caught rather than ignored, so children still start with the default
+}
+
+static void srv_send(int sock, int op, int pid, int value, const struct rusage* ru) {
+    srv_reply m;
+    memset(&m, 0, sizeof(m));
+    m.op = op;
+    m.pid = pid;
+    m.value = value;
+    if (ru) {
+        m.utime_us = timeval_us(ru->ru_utime);
+        m.stime_us = timeval_us(ru->ru_stime);
+        m.maxrss_kb = ru->ru_maxrss;
+        m.minflt = ru->ru_minflt;
+        m.majflt = ru->ru_majflt;
+        m.nvcsw = ru->ru_nvcsw;
+        m.nivcsw = ru->ru_nivcsw;
     }
-    if (n < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
-        return -1;
+    while (send(sock, &m, sizeof(m), MSG_NOSIGNAL) == -1 && errno == EINTR) { }
+}
+
+// Point out[0..count) at count strings packed at *pos, followed by NULL.
+// Returns 0, or -1 if they run past end.
+static int srv_take_strings(char** pos, const char* end, char** out, int count) {
+    for (int i = 0; i < count; ++i) {
+        char* nul = memchr(*pos, 0, (size_t)(end - *pos));
+        if (!nul) return -1;
+        out[i] = *pos;
+        *pos = nul + 1;
     }
-    return (int)n;
+    out[count] = NULL;
+    return 0;
 }
 
-__attribute__((visibility("default")))
-int read_stderr(int handle, char* buffer, int buflen) {
-    if (!buffer || buflen <= 0) return -1;
-    if (handle < 0 || handle >= MAX_PROCS) return -1;
+// Handle one SRV_OP_SPAWN; fds are the (close-on-exec) stdio fds that came with it.
+static void srv_spawn(int sock, ssize_t len, const int* fds, int nfds) {
+    srv_request rq;
+    int err = EINVAL;
+    pid_t pid = -1;
+    if ((size_t)len < sizeof(rq)) goto reply;
+    memcpy(&rq, srv_buf, sizeof(rq));
+    int want_fds = (rq.flags & PW_START_STDIN) ? 3 : 2;
+    if (rq.op != SRV_OP_SPAWN || nfds != want_fds || rq.argc <= 0 || rq.envc < -1) goto reply;
+    if (rq.argc + 1 + (rq.envc > 0 ? rq.envc : 0) + 1 > SRV_MAX_STRS) goto reply;
 
-    pthread_mutex_lock(&procs_mutex);
-    int fd = procs[handle].stderr_fd;
-    pthread_mutex_unlock(&procs_mutex);
-    if (fd < 0) return 0;
+    char* pos = srv_buf + sizeof(rq);
+    const char* end = srv_buf + len;
+    char* path[2];
+    char* cwd[2] = { NULL, NULL };
+    char* cgroup[2] = { NULL, NULL };
+    char** argv = srv_strs;
+    char** envp = rq.envc >= 0 ? srv_strs + rq.argc + 1 : NULL;
+    if (srv_take_strings(&pos, end, path, 1) == -1 ||
+        srv_take_strings(&pos, end, argv, rq.argc) == -1 ||
+        (envp && srv_take_strings(&pos, end, envp, rq.envc) == -1) ||
+        (rq.has_cwd && srv_take_strings(&pos, end, cwd, 1) == -1) ||
+        (rq.has_cgroup && srv_take_strings(&pos, end, cgroup, 1) == -1))
+        goto reply;
+    if (rq.cpu_mask_size < 0 || rq.cpu_mask_size > end - pos) goto reply;
 
-    ssize_t n = read(fd, buffer, buflen);
-    if (n == 0) {
-        // EOF: close and possibly free slot
-        pthread_mutex_lock(&procs_mutex);
-        if (procs[handle].stderr_fd >= 0) {
-            close(procs[handle].stderr_fd);
-            procs[handle].stderr_fd = -1;
-            maybe_clear_slot_after_eof(handle);
+    child_setup cs = { envp, cwd[0], rq.rlimit_as, rq.rlimit_cpu, rq.nice, (pid_t)rq.pgid,
+                       rq.cpu_mask_size ? (const unsigned char*)pos : NULL, rq.cpu_mask_size,
+                       rq.sched_policy, rq.ioprio, cgroup[0] };
+    int backend = setup_needs_fork(&cs) ? PW_SPAWN_FORK : spawn_backend;
+#ifndef POSIX_SPAWN_SETSID
+    if (rq.flags & PW_START_NEW_SESSION) backend = PW_SPAWN_FORK;
+#endif
+    int child_in = want_fds == 3 ? fds[0] : -1;
+    long long exec_ns = 0;
+    err = spawn_child(backend, path[0], argv, rq.flags, child_in, fds[want_fds - 2], fds[want_fds - 1], &cs, &pid, &exec_ns) == 0 ? 0 : errno;
+
+reply:
+    for (int i = 0; i < nfds; ++i) close(fds[i]);
+    srv_send(sock, SRV_OP_SPAWNED, err ? -1 : (int)pid, err, NULL);
+}
+
+// Helper main loop; never returns.
+static void srv_main(int sock) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = srv_on_term;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGQUIT, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sa.sa_handler = SIG_DFL;
+    sigaction(SIGPIPE, &sa, NULL);
+    if (pipe2(srv_chld_pipe, O_CLOEXEC | O_NONBLOCK) == -1) _exit(1);
+    sa.sa_handler = srv_on_chld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+    // the forking host thread may have had signals blocked; children inherit our mask
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    for (;;) {
+        struct pollfd pfd[2] = { { sock, POLLIN, 0 }, { srv_chld_pipe[0], POLLIN, 0 } };
+        if (poll(pfd, 2, -1) < 0) continue;
+
+        if (pfd[1].revents) {
+            drain_fd(srv_chld_pipe[0]);
+            int status;
+            struct rusage ru;
+            pid_t pid;
+            while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0)
+                srv_send(sock, SRV_OP_EXIT, (int)pid, exit_code_from_status(status), &ru);
         }
-        pthread_mutex_unlock(&procs_mutex);
-        return 0;
-    }
-    if (n < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
-        return -1;
+        if (!pfd[0].revents) continue;
+
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(3 * sizeof(int))];
+        } ctl;
+        struct iovec iov = { srv_buf, sizeof(srv_buf) };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) _exit(0); // host gone (or closed the socket): children live on
+
+        int fds[3];
+        int nfds = 0;
+        for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+            int k = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for (int i = 0; i < k && nfds < 3; ++i) memcpy(&fds[nfds++], CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+        }
+        if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) n = 0; // rejected below, fds closed
+        srv_spawn(sock, n, fds, nfds);
     }
-    return (int)n;
 }
 
-// is_running: returns 1 if running, 0 if not running (exited or invalid)
-__attribute__((visibility("default")))
-int is_running(int handle) {
-    if (handle < 0 || handle >= MAX_PROCS) return 0;
-    reap_if_finished(handle);
-    pthread_mutex_lock(&procs_mutex);
-    int in_use = procs[handle].used && procs[handle].exit_code == -2;
-    pthread_mutex_unlock(&procs_mutex);
-    return in_use ? 1 : 0;
+// Lock p unless it is the entry the caller already holds.
+static void server_lock_entry(proc_entry* p, const proc_entry* held) {
+    if (p != held) pthread_mutex_lock(&p->lock);
 }
 
-// get_exit_code: >=0 exit code, -2 still running, -1 error/invalid handle
-__attribute__((visibility("default")))
-int get_exit_code(int handle) {
-    if (handle < 0 || handle >= MAX_PROCS) return -1;
-    reap_if_finished(handle);
-    pthread_mutex_lock(&procs_mutex);
-    int ec = procs[handle].exit_code;
-    pthread_mutex_unlock(&procs_mutex);
-    return ec;
+static void server_unlock_entry(proc_entry* p, const proc_entry* held) {
+    if (p != held) pthread_mutex_unlock(&p->lock);
 }
 
-// stop_process: try SIGTERM then SIGKILL; returns 0 on success, -1 on error
-__attribute__((visibility("default")))
-int stop_process(int handle) {
-    if (handle < 0 || handle >= MAX_PROCS) return -1;
-
-    pthread_mutex_lock(&procs_mutex);
-    if (!procs[handle].used && procs[handle].exit_code != -2) {
-        pthread_mutex_unlock(&procs_mutex);
-        return 0; // already not running
+// Record a forwarded exit. held is the entry lock the caller holds, if any; taking the
+// others is safe because entry lock holders only ever trylock server_mutex.
+static void server_record_exit(const proc_entry* held, const srv_reply* m) {
+    struct rusage ru;
+    memset(&ru, 0, sizeof(ru));
+    ru.ru_utime.tv_sec = (time_t)(m->utime_us / 1000000);
+    ru.ru_utime.tv_usec = (suseconds_t)(m->utime_us % 1000000);
+    ru.ru_stime.tv_sec = (time_t)(m->stime_us / 1000000);
+    ru.ru_stime.tv_usec = (suseconds_t)(m->stime_us % 1000000);
+    ru.ru_maxrss = (long)m->maxrss_kb;
+    ru.ru_minflt = (long)m->minflt;
+    ru.ru_majflt = (long)m->majflt;
+    ru.ru_nvcsw = (long)m->nvcsw;
+    ru.ru_nivcsw = (long)m->nivcsw;
+    int count = slot_count();
+    for (int i = 0; i < count; ++i) {
+        proc_entry* p = slot_entry((uint32_t)i);
+        server_lock_entry(p, held);
+        int match = p->used && p->backend == PW_SPAWN_SERVER && p->pid == (pid_t)m->pid && p->exit_code == -2;
+        if (match) record_exit_locked(p, make_handle((uint32_t)i, p->gen), m->value, &ru);
+        server_unlock_entry(p, held);
+        if (match) return;
     }
-    pid_t pid = procs[handle].pid;
-    pthread_mutex_unlock(&procs_mutex);
+}
 
-    if (kill(pid, SIGTERM) == -1) {
-        if (errno == ESRCH) return 0; // no such process
+// Drop the helper connection: later launches spawn locally, and children it still runs
+// report -1 since their exits can no longer be observed. Called with server_mutex held.
+static void server_close(const proc_entry* held) {
+    if (server_fd < 0) return;
+    pthread_mutex_lock(&table_mutex);
+    close(server_fd);
+    __atomic_store_n(&server_fd, -1, __ATOMIC_RELAXED);
+    loop_server_fd = -1;
+    pthread_mutex_unlock(&table_mutex);
+    int count = slot_count();
+    for (int i = 0; i < count; ++i) {
+        proc_entry* p = slot_entry((uint32_t)i);
+        server_lock_entry(p, held);
+        if (p->used && p->backend == PW_SPAWN_SERVER && p->exit_code == -2)
+            record_exit_locked(p, make_handle((uint32_t)i, p->gen), -1, NULL);
+        server_unlock_entry(p, held);
     }
 
-    // small wait for graceful shutdown
-    for (int i = 0; i < 10; ++i) {
-        int status = 0;
-        pid_t r = waitpid(pid, &status, WNOHANG);
-        if (r == pid) break;
-        usleep(100 * 1000);
+    // the helper exits on EOF; reap it so it does not linger as a zombie
+    while (waitpid(server_pid, NULL, 0) == -1 && errno == EINTR) { }
+    server_pid = -1;
+    int expected = PW_SPAWN_SERVER;
+#ifdef PW_HAVE_POSIX_SPAWN
+    int local = PW_SPAWN_POSIX_SPAWN;
+#else
+    int local = PW_SPAWN_FORK;
+#endif
+    __atomic_compare_exchange_n(&spawn_backend, &expected, local, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// Handle one message from the helper; blocking waits for one. Spawn replies only come
+// while their sender holds server_mutex and reads them itself. Called with server_mutex
+// held (and held's lock, if not NULL). Returns 1 if a message was handled, 0 if none
+// was ready, -1 if the helper is gone.
+static int server_recv(const proc_entry* held, int blocking, srv_reply* out) {
+    srv_reply m;
+    ssize_t n;
+    do n = recv(server_fd, &m, sizeof(m), blocking ? 0 : MSG_DONTWAIT); while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (n != (ssize_t)sizeof(m)) {
+        server_close(held);
+        return -1;
+    }
+    if (m.op == SRV_OP_EXIT) server_record_exit(held, &m);
+    if (out) *out = m;
+    return 1;
+}
+
+static void server_poll(void) {
+    pthread_mutex_lock(&server_mutex);
+    while (server_fd >= 0 && server_recv(NULL, 0, NULL) > 0) { }
+    pthread_mutex_unlock(&server_mutex);
+}
+
+// With held's lock held, which ranks below server_mutex: if a spawn is in progress,
+// its exits are picked up on the next poll.
+static void server_poll_locked(const proc_entry* held) {
+    if (pthread_mutex_trylock(&server_mutex) != 0) return;
+    while (server_fd >= 0 && server_recv(held, 0, NULL) > 0) { }
+    pthread_mutex_unlock(&server_mutex);
+}
+
+static size_t pack_strings(char* dst, char* const* v, int count) {
+    size_t n = 0;
+    for (int i = 0; i < count; ++i) {
+        size_t len = strlen(v[i]) + 1;
+        if (dst) memcpy(dst + n, v[i], len);
+        n += len;
+    }
+    return n;
+}
+
+// Send one SRV_OP_SPAWN to the helper. Called with server_mutex held. Returns 0 once
+// sent, 1 if the helper could not take the request (not running, lost, or a request too
+// large), in which case the caller spawns locally, or 2 if nonblock and the socket is
+// full (nothing was sent; read a reply and retry).
+static int server_send_spawn(const char* path, char* const argv[], int flags, int child_in, int child_out, int child_err, const child_setup* cs, int nonblock) {
+    if (server_fd < 0) return 1;
+    int argc = 0, envc = -1;
+    while (argv[argc]) argc++;
+    if (cs->envp) for (envc = 0; cs->envp[envc]; ) envc++;
+    if (argc + 1 + (envc > 0 ? envc : 0) + 1 > SRV_MAX_STRS) return 1;
+
+    char* const path_v[1] = { (char*)path };
+    char* const cwd_v[1] = { (char*)cs->cwd };
+    char* const cgroup_v[1] = { (char*)cs->cgroup_procs };
+    int mask_size = cs->cpu_mask ? cs->cpu_mask_size : 0;
+    size_t len = sizeof(srv_request) + pack_strings(NULL, path_v, 1) + pack_strings(NULL, argv, argc)
+        + (envc > 0 ? pack_strings(NULL, cs->envp, envc) : 0) + (cs->cwd ? pack_strings(NULL, cwd_v, 1) : 0)
+        + (cs->cgroup_procs ? pack_strings(NULL, cgroup_v, 1) : 0) + (size_t)mask_size;
+    if (len > SRV_MAX_MSG) return 1;
+    char* msg_buf = malloc(len);
+    if (!msg_buf) return 1;
+    srv_request rq = { SRV_OP_SPAWN, flags, argc, envc, cs->cwd != NULL, cs->nice, (int)cs->pgid, 0, cs->rlimit_as, cs->rlimit_cpu,
+                       cs->sched_policy, cs->ioprio, mask_size, cs->cgroup_procs != NULL };
+    memcpy(msg_buf, &rq, sizeof(rq));
+    size_t pos = sizeof(rq);
+    pos += pack_strings(msg_buf + pos, path_v, 1);
+    pos += pack_strings(msg_buf + pos, argv, argc);
+    if (envc > 0) pos += pack_strings(msg_buf + pos, cs->envp, envc);
+    if (cs->cwd) pos += pack_strings(msg_buf + pos, cwd_v, 1);
+    if (cs->cgroup_procs) pos += pack_strings(msg_buf + pos, cgroup_v, 1);
+    if (mask_size) memcpy(msg_buf + pos, cs->cpu_mask, (size_t)mask_size);
+
+    int fds[3];
+    int nfds = 0;
+    if (flags & PW_START_STDIN) fds[nfds++] = child_in;
+    fds[nfds++] = child_out;
+    fds[nfds++] = child_err;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } ctl;
+    memset(&ctl, 0, sizeof(ctl));
+    struct iovec iov = { msg_buf, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = CMSG_SPACE((size_t)nfds * sizeof(int));
+    struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN((size_t)nfds * sizeof(int));
+    memcpy(CMSG_DATA(c), fds, (size_t)nfds * sizeof(int));
+
+    ssize_t n;
+    do n = sendmsg(server_fd, &msg, MSG_NOSIGNAL | (nonblock ? MSG_DONTWAIT : 0)); while (n < 0 && errno == EINTR);
+    free(msg_buf);
+    if (n < 0) {
+        if (nonblock && (errno == EAGAIN || errno == EWOULDBLOCK)) return 2;
+        if (errno != EMSGSIZE && errno != ENOBUFS) server_close(NULL);
+        return 1;
+    }
+    return 0;
+}
+
+// Wait for the reply to the oldest spawn request in flight; the helper answers in
+// order. Called with server_mutex held. Returns 0 with *out_pid set, or -1 with errno.
+static int server_wait_spawned(pid_t* out_pid) {
+    if (server_fd < 0) {
+        errno = ECONNRESET; // lost while the request was queued
+        return -1;
+    }
+    // exits of earlier children may be queued ahead of our reply
+    for (;;) {
+        srv_reply m;
+        if (server_recv(NULL, 1, &m) <= 0) {
+            errno = ECONNRESET; // it may or may not have started the child; do not retry
+            return -1;
+        }
+        if (m.op != SRV_OP_SPAWNED) continue;
+        if (m.value != 0) { errno = m.value; return -1; }
+        *out_pid = (pid_t)m.pid;
+        return 0;
+    }
+}
+
+// Spawn through the helper. Called with server_mutex held. Returns as server_send_spawn,
+// or 0 with *out_pid set / -1 with errno set once the helper answered.
+static int server_spawn(const char* path, char* const argv[], int flags, int child_in, int child_out, int child_err, const child_setup* cs, pid_t* out_pid) {
+    int rc = server_send_spawn(path, argv, flags, child_in, child_out, child_err, cs, 0);
+    return rc != 0 ? rc : server_wait_spawned(out_pid);
+}
+
+// spawn_server_start: fork the spawn server and make PW_SPAWN_SERVER the default backend.
+// Call it early, while the host is small: the helper keeps the address space it had at
+// this point, which is what every later fork copies. Children it starts see the
+// environment as of this call unless env is passed explicitly; they are not our children,
+// so their exit codes reach us via the helper, and get_process_backend reports
+// PW_SPAWN_SERVER for them. Returns 0 (also if already running), -1 on error.
+__attribute__((visibility("default")))
+int spawn_server_start(void) {
+    pthread_mutex_lock(&server_mutex);
+    if (server_fd >= 0) {
+        pthread_mutex_unlock(&server_mutex);
+        return 0;
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        pthread_mutex_unlock(&server_mutex);
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        // keep only stdio and the socket (as fd 3) from the host
+        int sock = sv[1];
+        if (sock != 3) {
+            sock = dup3(sv[1], 3, O_CLOEXEC);
+            if (sock == -1) _exit(1);
+        }
+        close_fds_from(4, max_fd_limit());
+        srv_main(sock);
+    }
+    close(sv[1]);
+    if (pid < 0) {
+        close(sv[0]);
+        pthread_mutex_unlock(&server_mutex);
+        return -1;
+    }
+    pthread_mutex_lock(&table_mutex);
+    __atomic_store_n(&server_fd, sv[0], __ATOMIC_RELAXED);
+    server_pid = pid;
+    pthread_mutex_unlock(&table_mutex);
+    __atomic_store_n(&spawn_backend, PW_SPAWN_SERVER, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&server_mutex);
+    return 0;
+}
+
+// spawn_server_stop: shut the spawn server down and go back to spawning locally.
+// Children it started keep running, but their exit codes read as -1.
+// Returns 0, or -1 if no server was running.
+__attribute__((visibility("default")))
+int spawn_server_stop(void) {
+    pthread_mutex_lock(&server_mutex);
+    int was = server_fd >= 0;
+    server_close(NULL);
+    pthread_mutex_unlock(&server_mutex);
+    return was ? 0 : -1;
+}
+
+// set_spawn_backend: choose PW_SPAWN_FORK, PW_SPAWN_POSIX_SPAWN or (while the spawn
+// server runs) PW_SPAWN_SERVER for later start_process calls.
+// Returns 0 on success, -1 if the backend is unknown or not available on this platform.
+__attribute__((visibility("default")))
+int set_spawn_backend(int backend) {
+    if (backend == PW_SPAWN_SERVER) {
+        pthread_mutex_lock(&server_mutex);
+        int ok = server_fd >= 0;
+        if (ok) __atomic_store_n(&spawn_backend, backend, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&server_mutex);
+        return ok ? 0 : -1;
+    }
+    if (backend == PW_SPAWN_FORK) {
+        __atomic_store_n(&spawn_backend, backend, __ATOMIC_RELAXED);
+        return 0;
+    }
+#ifdef PW_HAVE_POSIX_SPAWN
+    if (backend == PW_SPAWN_POSIX_SPAWN) {
+        __atomic_store_n(&spawn_backend, backend, __ATOMIC_RELAXED);
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+// get_spawn_backend: backend used by the next start_process call.
+__attribute__((visibility("default")))
+int get_spawn_backend(void) {
+    return __atomic_load_n(&spawn_backend, __ATOMIC_RELAXED);
+}
+
+// Where redirect r sends a child stream. Returns the fd the child gets, or -1 with errno
+// set. For PW_OUT_PIPE *read_fd receives our read end; for PW_OUT_MEMFD *capture_fd
+// receives the capture file (which is also the child's fd). *owned is set when the
+// returned fd is ours to close once the child has it.
+static int redirect_open(const pw_redirect* r, int* read_fd, int* capture_fd, int* owned) {
+    int kind = r ? r->kind : PW_OUT_PIPE;
+    *owned = 0;
+    switch (kind) {
+    case PW_OUT_PIPE: {
+        int p[2];
+        if (make_pipe(p) == -1) return -1;
+        *read_fd = p[0];
+        *owned = 1;
+        return p[1];
+    }
+    case PW_OUT_FILE: {
+        if (!r->path) { errno = EINVAL; return -1; }
+        int mode = (r->flags & PW_REDIRECT_APPEND) ? O_APPEND : O_TRUNC;
+        int fd = open(r->path, O_WRONLY | O_CREAT | O_CLOEXEC | mode, 0644);
+        if (fd >= 0) *owned = 1;
+        return fd;
+    }
+    case PW_OUT_FD:
+        if (r->fd < 0) { errno = EBADF; return -1; }
+        return r->fd; // the caller's; dup2 in the child leaves it alone
+    case PW_OUT_MEMFD: {
+        int fd = capture_open();
+        if (fd >= 0) *capture_fd = fd;
+        return fd;
+    }
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+// Pointers to count NUL-terminated strings packed back to back in block, NULL-terminated.
+// Returns a malloc'ed array (pointing into block), or NULL on OOM.
+static char** unpack_block(const char* block, int count) {
+    char** v = malloc(sizeof(char*) * ((size_t)count + 1));
+    if (!v) return NULL;
+    for (int i = 0; i < count; ++i) {
+        v[i] = (char*)block;
+        block += strlen(block) + 1;
+    }
+    v[count] = NULL;
+    return v;
+}
+
+static int env_same_name(const char* a, const char* b) {
+    while (*a && *a != '=' && *a == *b) { a++; b++; }
+    return (*a == '=' || !*a) && (*b == '=' || !*b);
+}
+
+// Child environment: the envc entries of block set over our environ (or on their own with
+// clear). Returns a malloc'ed NULL-terminated array pointing into both, NULL on OOM.
+static char** build_envp(const char* block, int envc, int clear) {
+    char** add = unpack_block(block, envc);
+    if (!add) return NULL;
+    size_t base = 0;
+    if (!clear) while (environ[base]) base++;
+
+    char** env = malloc(sizeof(char*) * (base + (size_t)envc + 1));
+    if (!env) { free(add); return NULL; }
+    size_t n = 0;
+    for (size_t i = 0; i < base; ++i) {
+        int overridden = 0;
+        for (int j = 0; j < envc && !overridden; ++j) overridden = env_same_name(environ[i], add[j]);
+        if (!overridden) env[n++] = environ[i];
+    }
+    for (int j = 0; j < envc; ++j) env[n++] = add[j];
+    env[n] = NULL;
+    free(add);
+    return env;
+}
+
+// errno of this thread's last failed start_process* call. Kept apart from errno, which
+// any later libc call may overwrite before the caller (e.g. through P/Invoke) reads it.
+static __thread int last_start_error;
+
+static int start_failed(int e) {
+    last_start_error = e;
+    errno = e;
+    return -1;
+}
+
+// procwrapper_last_error: errno of the calling thread's last failed start_process*
+// call (0 if none failed yet). Not reset by successful calls.
+__attribute__((visibility("default")))
+int procwrapper_last_error(void) {
+    return last_start_error;
+}
+
+// One start in progress: a copy of its options and everything set up around the spawn.
+// launch_parse, then (with a slot reserved) launch_open, a spawn, and launch_publish or
+// launch_fail.
+typedef struct {
+    pw_spawn_opts o;
+    char**        argv_vec; // unpacked argv_block, NULL if argv was passed
+    char**        envp;
+    char* const*  argv;
+    char*         cgroup_procs; // o.cgroup + "/cgroup.procs", formatted before the fork
+    child_setup   cs;
+    int           slot;          // -1 until reserved
+    int           stdin_from;    // pipeline: the child's stdin (read end from the previous stage), else -1
+    int           stdout_to;     // pipeline: the child's stdout (write end toward the next stage), else -1
+    int           stdout_copy;   // pipeline with a monitor: our read end of the copy, else -1
+    int           inpipe[2];
+    int           read_fd[2];    // our ends of pipe-mode streams
+    int           capture_fd[2]; // memfd captures
+    int           child_fd[2];
+    int           owned[2];
+    int           pipe_cap[2];
+    int           backend;
+    pid_t         pid;
+    long long     call_begin;
+    long long     spawn_begin;
+    long long     exec_ns;
+} launch;
+
+// Validate and copy opts (size-versioned) and unpack its strings. Returns 0, or -1 with
+// errno set and nothing left to free.
+static int launch_parse(launch* l, const pw_spawn_opts* opts) {
+    memset(l, 0, sizeof(*l));
+    l->slot = l->stdin_from = l->stdout_to = l->stdout_copy = -1;
+    for (int i = 0; i < 2; ++i) l->inpipe[i] = l->read_fd[i] = l->capture_fd[i] = l->child_fd[i] = -1;
+    l->call_begin = now_ns();
+
+    if (!opts || opts->size < PW_SPAWN_OPTS_MIN_SIZE) { errno = EINVAL; return -1; }
+    pw_spawn_opts* o = &l->o;
+    memcpy(o, opts, opts->size < (int)sizeof(*o) ? (size_t)opts->size : sizeof(*o));
+    if (!o->path || (!o->argv && (!o->argv_block || o->argc <= 0))) { errno = EINVAL; return -1; }
+    if (o->envc < 0 || (o->envc > 0 && !o->env_block)) { errno = EINVAL; return -1; }
+    if (o->flags & ~(PW_START_NEW_PGROUP | PW_START_NEW_SESSION | PW_START_STDIN | PW_START_CLEAR_ENV)) { errno = EINVAL; return -1; }
+    if (o->timeout_ms < 0 || o->cpu_timeout_ms < 0) { errno = EINVAL; return -1; }
+    if (o->cpu_affinity && o->cpu_affinity_size <= 0) { errno = EINVAL; return -1; }
+    if (o->sched_policy < PW_SCHED_INHERIT || o->sched_policy > PW_SCHED_IDLE) { errno = EINVAL; return -1; }
+    // deadlines are the loop's to enforce
+    if ((o->timeout_ms || o->cpu_timeout_ms) && loop_start() != 0) { errno = ENOSYS; return -1; }
+
+    l->argv = o->argv;
+    if (!l->argv) {
+        l->argv_vec = unpack_block(o->argv_block, o->argc);
+        if (!l->argv_vec) { errno = ENOMEM; return -1; }
+        l->argv = l->argv_vec;
+    }
+    if (o->envc > 0 || (o->flags & PW_START_CLEAR_ENV)) {
+        l->envp = build_envp(o->env_block, o->envc, o->flags & PW_START_CLEAR_ENV);
+        if (!l->envp) {
+            free(l->argv_vec);
+            l->argv_vec = NULL;
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    if (o->cgroup) {
+        size_t n = strlen(o->cgroup);
+        l->cgroup_procs = malloc(n + sizeof("/cgroup.procs"));
+        if (!l->cgroup_procs) {
+            free(l->argv_vec);
+            free(l->envp);
+            l->argv_vec = NULL;
+            l->envp = NULL;
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(l->cgroup_procs, o->cgroup, n);
+        memcpy(l->cgroup_procs + n, "/cgroup.procs", sizeof("/cgroup.procs"));
+    }
+    child_setup cs = { l->envp, o->cwd, o->rlimit_as, o->rlimit_cpu, o->nice, 0,
+                       o->cpu_affinity, o->cpu_affinity_size, o->sched_policy, o->ioprio, l->cgroup_procs };
+    l->cs = cs;
+    return 0;
+}
+
+// Open the stdin pipe and the output redirects (a pipeline stage takes over the fds set
+// in stdin_from/stdout_to/stdout_copy instead). Returns 0, or -1 with errno set.
+static int launch_open(launch* l) {
+    if (l->stdin_from >= 0) {
+        l->inpipe[0] = l->stdin_from; // passed like a stdin pipe, but nothing to write_stdin
+        l->stdin_from = -1;
+    } else if ((l->o.flags & PW_START_STDIN) && make_stdin_pipe(l->inpipe) == -1) {
+        return -1;
+    }
+    if (l->stdout_to >= 0) {
+        l->child_fd[0] = l->stdout_to;
+        l->owned[0] = 1;
+        l->read_fd[0] = l->stdout_copy;
+        l->stdout_to = l->stdout_copy = -1;
+    } else {
+        l->child_fd[0] = redirect_open(&l->o.out, &l->read_fd[0], &l->capture_fd[0], &l->owned[0]);
+    }
+    if (l->child_fd[0] == -1) return -1;
+    l->child_fd[1] = redirect_open(&l->o.err, &l->read_fd[1], &l->capture_fd[1], &l->owned[1]);
+    if (l->child_fd[1] == -1) return -1;
+    for (int i = 0; i < 2; ++i) {
+        if (l->read_fd[i] >= 0) l->pipe_cap[i] = pipe_resize(l->read_fd[i], l->o.pipe_size);
+    }
+    l->spawn_begin = now_ns();
+    stat_time(&lib_stats.pipe_setup, l->spawn_begin - l->call_begin);
+    return 0;
+}
+
+// What a spawn the helper could not take falls back to.
+static int server_fallback_backend(void) {
+#ifdef PW_HAVE_POSIX_SPAWN
+    return PW_SPAWN_POSIX_SPAWN;
+#else
+    return PW_SPAWN_FORK;
+#endif
+}
+
+// Spawn with backend (fork or posix_spawn), or with fork where the options need it.
+static int launch_spawn_local(launch* l, int backend) {
+#ifndef POSIX_SPAWN_SETSID
+    if (l->o.flags & PW_START_NEW_SESSION) backend = PW_SPAWN_FORK;
+#endif
+    if (setup_needs_fork(&l->cs)) backend = PW_SPAWN_FORK;
+    l->backend = backend;
+    return spawn_child(backend, l->o.path, l->argv, l->o.flags, l->inpipe[0], l->child_fd[0], l->child_fd[1], &l->cs, &l->pid, &l->exec_ns);
+}
+
+// The child is running: fill its slot and make the handle live. For the helper backend
+// call with server_mutex held, so its exit cannot be read before the entry exists.
+// The caller still owes reaper_watch (outside server_mutex). Returns the handle.
+static int launch_publish(launch* l) {
+    long long started = now_ns();
+    free(l->argv_vec);
+    free(l->envp);
+    free(l->cgroup_procs);
+    l->argv_vec = NULL;
+    l->envp = NULL;
+    l->cgroup_procs = NULL;
+
+    // parent: drop the child's ends
+    if (l->inpipe[0] >= 0) close(l->inpipe[0]);
+    for (int i = 0; i < 2; ++i) {
+        if (l->owned[i]) close(l->child_fd[i]);
+    }
+
+    // a pidfd would turn readable before the helper forwards the status; the socket is the signal
+    int pidfd = l->backend == PW_SPAWN_SERVER ? -1 : open_pidfd(l->pid);
+
+    proc_entry* p = slot_entry((uint32_t)l->slot);
+    pthread_mutex_lock(&p->lock);
+    p->pid       = l->pid;
+    p->backend   = l->backend;
+    p->pgid      = (l->o.flags & (PW_START_NEW_PGROUP | PW_START_NEW_SESSION)) ? l->pid : l->cs.pgid;
+    p->stdin_fd  = l->inpipe[1];
+    p->stdout_fd = l->read_fd[0];
+    p->stderr_fd = l->read_fd[1];
+    p->pidfd     = pidfd;
+    p->exit_code = -2; // running
+    p->watched   = 0;
+    p->cb        = NULL;
+    p->cb_user   = NULL;
+    p->ring[0]   = NULL;
+    p->ring[1]   = NULL;
+    p->paused[0] = p->paused[1] = 0;
+    p->pipe_cap[0] = l->pipe_cap[0];
+    p->pipe_cap[1] = l->pipe_cap[1];
+    p->kill_at   = 0;
+    p->wall_deadline = l->o.timeout_ms ? started / 1000000 + l->o.timeout_ms : 0;
+    p->cpu_budget_ns = l->o.cpu_timeout_ms * 1000000;
+    p->timeout_grace = l->o.timeout_grace_ms;
+    p->timed_out     = 0;
+    p->deadline_check = 0;
+    int deadline = p->wall_deadline || p->cpu_budget_ns;
+    if (deadline) {
+        p->deadline_check = deadline_next(p, started / 1000000, 0);
+        __atomic_add_fetch(&deadlines_pending, 1, __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < 2; ++i) {
+        p->capture[i].fd  = l->capture_fd[i];
+        p->capture[i].map = NULL;
+        p->capture[i].len = 0;
+    }
+    memset(&p->exit_info, 0, sizeof(p->exit_info));
+    p->exit_info.exit_code = -2;
+    p->exit_info.start_ns  = started;
+    p->exit_info.spawn_ns  = started - l->spawn_begin;
+    p->exit_info.exec_ns   = l->exec_ns;
+    p->exit_info.pipe_size = l->pipe_cap[0] > l->pipe_cap[1] ? l->pipe_cap[0] : l->pipe_cap[1];
+    p->exit_cb   = NULL;
+    p->exit_user = NULL;
+    p->reaper    = 0;
+    p->used      = 1;
+    int handle = make_handle((uint32_t)l->slot, p->gen);
+    pthread_mutex_unlock(&p->lock);
+    if (deadline) loop_wakeup(); // to take the new deadline into its timeout
+
+    stat_add(&lib_stats.spawns, 1);
+    stat_add(l->backend == PW_SPAWN_SERVER ? &lib_stats.spawns_server
+             : l->backend == PW_SPAWN_POSIX_SPAWN ? &lib_stats.spawns_posix : &lib_stats.spawns_fork, 1);
+    return handle;
+}
+
+// Undo a parsed launch that did not start: close what launch_open made, free the
+// strings, release the slot. Returns the errno it failed with.
+static int launch_fail(launch* l) {
+    int err = errno;
+    if (l->inpipe[0] >= 0) close(l->inpipe[0]);
+    if (l->inpipe[1] >= 0) close(l->inpipe[1]);
+    if (l->stdin_from >= 0) close(l->stdin_from);
+    if (l->stdout_to >= 0) close(l->stdout_to);
+    if (l->stdout_copy >= 0) close(l->stdout_copy);
+    l->inpipe[0] = l->inpipe[1] = l->stdin_from = l->stdout_to = l->stdout_copy = -1;
+    for (int i = 0; i < 2; ++i) {
+        if (l->owned[i]) close(l->child_fd[i]);
+        if (l->read_fd[i] >= 0) close(l->read_fd[i]);
+        if (l->capture_fd[i] >= 0) close(l->capture_fd[i]);
+    }
+    free(l->argv_vec);
+    free(l->envp);
+    free(l->cgroup_procs);
+    l->argv_vec = NULL;
+    l->envp = NULL;
+    l->cgroup_procs = NULL;
+    if (l->slot >= 0) slot_release((uint32_t)l->slot);
+    l->slot = -1;
+    stat_add(&lib_stats.spawn_failures, 1);
+    return err;
+}
+
+// Spawn an opened launch with backend. For PW_SPAWN_SERVER call with server_mutex held;
+// a request the helper cannot take goes to a local backend. Returns 0, or -1 with errno.
+static int launch_spawn(launch* l, int backend) {
+    if (backend == PW_SPAWN_SERVER) {
+        int rc = server_spawn(l->o.path, l->argv, l->o.flags, l->inpipe[0], l->child_fd[0], l->child_fd[1], &l->cs, &l->pid);
+        if (rc == 0) {
+            stat_time(&lib_stats.exec, now_ns() - l->spawn_begin);
+            l->backend = PW_SPAWN_SERVER;
+            return 0;
+        }
+        if (rc < 0) return -1;
+        backend = server_fallback_backend();
+    }
+    return launch_spawn_local(l, backend);
+}
+
+// Spawn an opened launch with the current backend and publish it. Returns the handle,
+// or -1 with errno set (the launch is then still to be failed).
+static int launch_run(launch* l) {
+    int backend = get_spawn_backend();
+    // held until the entry is published, so its exit cannot be read before then
+    if (backend == PW_SPAWN_SERVER) pthread_mutex_lock(&server_mutex);
+    int handle = launch_spawn(l, backend) == 0 ? launch_publish(l) : -1;
+    int err = errno;
+    if (backend == PW_SPAWN_SERVER) pthread_mutex_unlock(&server_mutex);
+    errno = err;
+    return handle;
+}
+
+// Pop a free slot for each of the count launches (those with handles[i] != 0 skipped,
+// if handles is given) under one table_mutex round. Returns how many got one.
+static int slots_reserve(launch* ls, int count, const int* handles) {
+    int got = 0;
+    pthread_mutex_lock(&table_mutex);
+    for (int i = 0; i < count; ++i) {
+        if ((handles && handles[i] != 0) || (proc_free_head < 0 && grow_table() != 0)) continue;
+        proc_entry* p = slot_entry((uint32_t)proc_free_head);
+        ls[i].slot = proc_free_head;
+        proc_free_head = p->next_free;
+        p->next_free = -1;
+        __atomic_add_fetch(&slots_in_use, 1, __ATOMIC_RELAXED);
+        got++;
+    }
+    pthread_mutex_unlock(&table_mutex);
+    return got;
+}
+
+// start_process_ex: start opts->path with PW_START_* flags and per-stream output
+// redirects. The arguments come from argv (NULL-terminated) or, if that is NULL, from
+// argc strings packed in argv_block; env_block, cwd, rlimit_* and nice are optional.
+// opts->size is sizeof(pw_spawn_opts) as the caller knows it, so the struct can grow.
+// A stream redirected away from the pipe default reads as EOF at once: the bytes go
+// straight from the child to the target. cwd (without addchdir_np), rlimits and nice
+// need the fork backend, which is then used regardless of set_spawn_backend (the spawn
+// server picks it on its side). Returns the handle, or -1 on error with errno set (and
+// kept for procwrapper_last_error); a binary that cannot be exec'ed (ENOENT, EACCES,
+// ENOEXEC, ...) fails here with its errno rather than as a child exiting 127.
+__attribute__((visibility("default")))
+int start_process_ex(const pw_spawn_opts* opts) {
+    launch l;
+    if (launch_parse(&l, opts) == -1) return start_failed(errno);
+
+    int traced = trace_begin("pw:start_process");
+    // Reserve the slot up front; it only becomes visible to lookups once published.
+    int handle = -1;
+    l.slot = slot_alloc();
+    if (l.slot == -1) errno = EAGAIN; // every handle slot is taken
+    else if (launch_open(&l) == 0) handle = launch_run(&l);
+    if (handle < 0) {
+        int err = launch_fail(&l);
+        trace_end(traced);
+        return start_failed(err);
+    }
+
+    reaper_watch(handle);
+    stat_time(&lib_stats.spawn, now_ns() - l.call_begin);
+    trace_end(traced);
+    return handle;
+}
+
+// Spawn requests queued in the helper at once by start_processes.
+#define PW_BATCH_WINDOW 16
+
+// Pipelined spawns through the helper for every launch still pending (handles[i] == 0):
+// up to PW_BATCH_WINDOW requests are queued while earlier replies are read, and each
+// child is published as its reply arrives. Launches the helper cannot take stay pending.
+static void batch_spawn_server(launch* ls, int* handles, int count) {
+    int queue[PW_BATCH_WINDOW];
+    int head = 0, inflight = 0, next = 0;
+    pthread_mutex_lock(&server_mutex);
+    for (;;) {
+        while (next < count && handles[next] != 0) next++;
+        if (next < count && inflight < PW_BATCH_WINDOW && server_fd >= 0) {
+            launch* l = &ls[next];
+            // never block on a full socket while replies are owed: the helper may be
+            // blocked sending them to us
+            int rc = server_send_spawn(l->o.path, l->argv, l->o.flags, l->inpipe[0], l->child_fd[0], l->child_fd[1], &l->cs, inflight > 0);
+            if (rc == 0) {
+                queue[(head + inflight++) % PW_BATCH_WINDOW] = next++;
+                continue;
+            }
+            if (rc == 1) {
+                next++; // left for a local spawn
+                continue;
+            }
+        }
+        if (inflight == 0) break;
+
+        int i = queue[head];
+        head = (head + 1) % PW_BATCH_WINDOW;
+        inflight--;
+        launch* l = &ls[i];
+        if (server_wait_spawned(&l->pid) == 0) {
+            stat_time(&lib_stats.exec, now_ns() - l->spawn_begin);
+            l->backend = PW_SPAWN_SERVER;
+            handles[i] = launch_publish(l);
+        } else {
+            handles[i] = -launch_fail(l);
+        }
+    }
+    pthread_mutex_unlock(&server_mutex);
+}
+
+// start_processes: start count processes in one call. specs points at count
+// pw_spawn_opts back to back, each specs->size bytes (the caller's sizeof, the same for
+// all). Slots are reserved under one table lock and, with the spawn server, requests are
+// pipelined instead of waiting out each round trip. handles[i] receives the handle for
+// specs[i], or its negated errno (-EAGAIN, -ENOENT, ...) if that one failed; the rest
+// still start. Returns how many started, or -1 with errno set for invalid arguments.
+// procwrapper_last_error reports the first failure.
+__attribute__((visibility("default")))
+int start_processes(int count, const pw_spawn_opts* specs, int* handles) {
+    if (count <= 0 || !specs || !handles || specs->size < PW_SPAWN_OPTS_MIN_SIZE) return start_failed(EINVAL);
+    launch* ls = malloc(sizeof(launch) * (size_t)count);
+    if (!ls) return start_failed(ENOMEM);
+    size_t stride = (size_t)specs->size;
+    int traced = trace_begin("pw:start_processes");
+
+    for (int i = 0; i < count; ++i) {
+        const pw_spawn_opts* spec = (const pw_spawn_opts*)((const char*)specs + stride * (size_t)i);
+        handles[i] = launch_parse(&ls[i], spec) == 0 ? 0 : -errno;
+    }
+
+    slots_reserve(ls, count, handles);
+
+    for (int i = 0; i < count; ++i) {
+        if (handles[i] != 0) continue;
+        if (ls[i].slot == -1) errno = EAGAIN; // every handle slot is taken
+        if (ls[i].slot == -1 || launch_open(&ls[i]) == -1) handles[i] = -launch_fail(&ls[i]);
+    }
+
+    int backend = get_spawn_backend();
+    if (backend == PW_SPAWN_SERVER) {
+        batch_spawn_server(ls, handles, count);
+        backend = server_fallback_backend();
+    }
+    for (int i = 0; i < count; ++i) {
+        if (handles[i] != 0) continue;
+        handles[i] = launch_spawn_local(&ls[i], backend) == 0 ? launch_publish(&ls[i]) : -launch_fail(&ls[i]);
+    }
+
+    int started = 0, first_err = 0;
+    for (int i = 0; i < count; ++i) {
+        if (handles[i] > 0) {
+            reaper_watch(handles[i]);
+            stat_time(&lib_stats.spawn, now_ns() - ls[i].call_begin);
+            started++;
+        } else if (!first_err) {
+            first_err = -handles[i];
+        }
+    }
+    free(ls);
+    trace_end(traced);
+    if (first_err) last_start_error = first_err;
+    return started;
+}
+
+// start_process_flags: path is full path to binary, argv is NULL-terminated array of
+// char* (C strings), flags are PW_START_*. With PW_START_NEW_PGROUP or
+// PW_START_NEW_SESSION the child leads its own process group, so signal_process and
+// stop_process reach every helper it forks. Returns the handle, or -1 on error.
+__attribute__((visibility("default")))
+int start_process_flags(const char* path, char* const argv[], int flags) {
+    pw_spawn_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.size  = (int)sizeof(opts);
+    opts.path  = path;
+    opts.argv  = argv;
+    opts.flags = flags;
+    return start_process_ex(&opts);
+}
+
+// start_process: path is full path to binary, argv is NULL-terminated array of char* (C strings)
+__attribute__((visibility("default")))
+int start_process(const char* path, char* const argv[]) {
+    return start_process_flags(path, argv, 0);
+}
+
+// get_process_backend: PW_SPAWN_* that launched handle, or -1 for an invalid handle.
+__attribute__((visibility("default")))
+int get_process_backend(int handle) {
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    int backend = p ? p->backend : -1;
+    slot_unlock(handle);
+    return backend;
+}
+
+// get_slot_usage: handle slots in use (children not yet released, including exited ones
+// whose output was not drained) and the most the table can ever hold. Either pointer may
+// be NULL. Returns the number in use.
+__attribute__((visibility("default")))
+int get_slot_usage(int* in_use, int* capacity) {
+    int n = __atomic_load_n(&slots_in_use, __ATOMIC_RELAXED);
+    if (in_use) *in_use = n;
+    if (capacity) *capacity = PROC_MAX_CHUNKS * PROC_CHUNK_SIZE;
+    return n;
+}
+
+// procwrapper_get_stats: snapshot the library-wide counters and histograms into out,
+// writing out->size bytes at most (set it to sizeof(pw_lib_stats)). Fields are read one
+// by one, so a snapshot taken under load is consistent per field, not across fields.
+// Returns 0, or -1 if out is NULL or too small for the header.
+__attribute__((visibility("default")))
+int procwrapper_get_stats(pw_lib_stats* out) {
+    if (!out || out->size < (int)offsetof(pw_lib_stats, spawns)) return -1;
+    int size = out->size < (int)sizeof(pw_lib_stats) ? out->size : (int)sizeof(pw_lib_stats);
+    size_t first = offsetof(pw_lib_stats, spawns) / sizeof(long long);
+    size_t count = (size_t)size / sizeof(long long);
+    const long long* src = (const long long*)&lib_stats;
+    long long* dst = (long long*)out;
+    for (size_t i = first; i < count; ++i) dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    out->size = size;
+    return 0;
+}
+
+// procwrapper_reset_stats: zero every counter, e.g. before a measured run.
+__attribute__((visibility("default")))
+void procwrapper_reset_stats(void) {
+    long long* v = (long long*)&lib_stats;
+    size_t first = offsetof(pw_lib_stats, spawns) / sizeof(long long);
+    for (size_t i = first; i < sizeof(pw_lib_stats) / sizeof(long long); ++i)
+        __atomic_store_n(&v[i], 0, __ATOMIC_RELAXED);
+}
+
+// get_child_fd_count: number of open fds in the child (from /proc/<pid>/fd),
+// for spotting leaked descriptors. Returns -1 if the handle is invalid, the
+// child already exited, or /proc is not readable.
+__attribute__((visibility("default")))
+int get_child_fd_count(int handle) {
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    pid_t pid = p && p->exit_code == -2 ? p->pid : -1;
+    slot_unlock(handle);
+    if (pid <= 0) return -1;
+
+    char dir[64];
+    snprintf(dir, sizeof(dir), "/proc/%d/fd", (int)pid);
+    DIR* d = opendir(dir);
+    if (!d) return -1;
+    int count = 0;
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] != '.') count++;
+    }
+    closedir(d);
+    return count;
+}
+
+// Live counters of a running child from /proc/<pid>/stat and /proc/<pid>/status.
+// Fields /proc does not provide stay as they are. Returns -1 if /proc is not readable.
+static int read_live_stats(pid_t pid, pw_proc_stats* s) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return -1;
+    buf[n] = 0;
+    // comm may contain anything, so fields are counted from its closing ')': state is field 3
+    char* f = strrchr(buf, ')');
+    if (!f) return -1;
+    unsigned long long v[12] = { 0 }; // fields 4..15
+    if (sscanf(f + 2, "%*c %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+               &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8], &v[9], &v[10], &v[11]) != 12)
+        return -1;
+    long tck = sysconf(_SC_CLK_TCK);
+    if (tck <= 0) tck = 100;
+    s->minflt = (long long)v[6];
+    s->majflt = (long long)v[8];
+    s->utime_us = (long long)v[10] * 1000000 / tck;
+    s->stime_us = (long long)v[11] * 1000000 / tck;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE* st = fopen(path, "re");
+    if (!st) return 0;
+    long long x;
+    while (fgets(buf, sizeof(buf), st)) {
+        if (sscanf(buf, "VmHWM: %lld", &x) == 1) s->maxrss_kb = x;
+        else if (sscanf(buf, "voluntary_ctxt_switches: %lld", &x) == 1) s->nvcsw = x;
+        else if (sscanf(buf, "nonvoluntary_ctxt_switches: %lld", &x) == 1) s->nivcsw = x;
+    }
+    fclose(st);
+    return 0;
+}
+
+static void stats_from_exit(const pw_exit_info* e, pw_proc_stats* s) {
+    s->exit_code = e->exit_code;
+    s->spawn_ns = e->spawn_ns;
+    s->run_ns = (e->exit_ns ? e->exit_ns : now_ns()) - e->start_ns;
+    s->utime_us = e->utime_us;
+    s->stime_us = e->stime_us;
+    s->maxrss_kb = e->maxrss_kb;
+    s->minflt = e->minflt;
+    s->majflt = e->majflt;
+    s->nvcsw = e->nvcsw;
+    s->nivcsw = e->nivcsw;
+    s->stdout_stalls = __atomic_load_n(&e->stdout_stalls, __ATOMIC_RELAXED);
+    s->stderr_stalls = __atomic_load_n(&e->stderr_stalls, __ATOMIC_RELAXED);
+    s->pipe_size = e->pipe_size;
+    s->exec_ns = e->exec_ns;
+}
+
+// get_proc_stats: fill the first out->size bytes of *out with the child's accounting:
+// the wait4 rusage once it exited, live /proc counters while it runs (zero where /proc
+// is unavailable). Returns 0 if the child has exited, 1 if it is still running, -1 if
+// the handle is invalid or out->size is too small.
+__attribute__((visibility("default")))
+int get_proc_stats(int handle, pw_proc_stats* out) {
+    if (!out || out->size < (int)offsetof(pw_proc_stats, spawn_ns)) return -1;
+    pw_proc_stats s;
+    memset(&s, 0, sizeof(s));
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    if (p && p->exit_code == -2 && !p->reaper) reap_locked(p, handle);
+    pid_t pid = -1;
+    if (p) {
+        stats_from_exit(&p->exit_info, &s);
+        if (p->exit_code == -2) pid = p->pid;
+    }
+    slot_unlock(handle);
+    if (!p) return -1;
+    // outside the lock: if the child exits meanwhile this is at worst one stale sample
+    if (pid > 0) (void)read_live_stats(pid, &s);
+
+    int size = out->size < (int)sizeof(s) ? out->size : (int)sizeof(s);
+    s.size = size;
+    memcpy(out, &s, (size_t)size);
+    return pid > 0 ? 1 : 0;
+}
+
+static void maybe_clear_slot_after_eof(int handle) {
+    // Called with mutex locked by caller
+    proc_entry* p = entry_locked(handle);
+    if (!p || p->watched) return; // the event loop releases its own handles
+    if (p->carry[0].len || p->carry[1].len) return; // read_lines still owes a partial line
+    if (p->capture[0].fd >= 0 || p->capture[1].fd >= 0) return; // until release_output
+    if (p->stdout_fd < 0 && p->stderr_fd < 0 && exit_final(p->exit_code)) {
+        if (p->pidfd >= 0) {
+            close(p->pidfd);
+            p->pidfd = -1;
+        }
+        slot_release((uint32_t)handle & HANDLE_SLOT_MASK);
+    }
+}
+
+__attribute__((visibility("default")))
+int read_stdout(int handle, char* buffer, int buflen) {
+    if (!buffer || buflen <= 0) return -1;
+
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    int fd = p ? p->stdout_fd : -1;
+    slot_unlock(handle);
+    if (!p) return -1;
+    if (fd < 0) return 0;
+
+    ssize_t n = read(fd, buffer, buflen);
+    note_pipe_read(p, 0, fd, n, buflen);
+    if (n == 0) {
+        // EOF: close and possibly free slot
+        slot_lock(handle);
+        p = entry_locked(handle);
+        if (p && p->stdout_fd == fd) {
+            close(fd);
+            p->stdout_fd = -1;
+            maybe_clear_slot_after_eof(handle);
+        }
+        slot_unlock(handle);
+        return 0;
+    }
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        return -1;
+    }
+    return (int)n;
+}
+
+__attribute__((visibility("default")))
+int read_stderr(int handle, char* buffer, int buflen) {
+    if (!buffer || buflen <= 0) return -1;
+
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    int fd = p ? p->stderr_fd : -1;
+    slot_unlock(handle);
+    if (!p) return -1;
+    if (fd < 0) return 0;
+
+    ssize_t n = read(fd, buffer, buflen);
+    note_pipe_read(p, 1, fd, n, buflen);
+    if (n == 0) {
+        // EOF: close and possibly free slot
+        slot_lock(handle);
+        p = entry_locked(handle);
+        if (p && p->stderr_fd == fd) {
+            close(fd);
+            p->stderr_fd = -1;
+            maybe_clear_slot_after_eof(handle);
+        }
+        slot_unlock(handle);
+        return 0;
+    }
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        return -1;
+    }
+    return (int)n;
+}
+
+// read_lines: read what is available on stream (PW_EVT_STDOUT/PW_EVT_STDERR) into buf
+// and split it into lines (memchr, which libc vectorizes). Up to max_lines records are
+// written to lines; a trailing partial line is kept natively and prepended on the next
+// call. A line longer than buflen is returned in buflen pieces, all but the last marked
+// PW_LINE_CONTINUED (a trailing \r is kept on those), and the last partial line is
+// returned once the stream hits EOF. Returns the number of lines (0 if none
+// are complete yet, or at EOF), -1 on error/invalid handle.
+__attribute__((visibility("default")))
+int read_lines(int handle, int stream, char* buf, int buflen, pw_line* lines, int max_lines) {
+    if (!buf || buflen <= 0 || !lines || max_lines <= 0) return -1;
+    if (stream != PW_EVT_STDOUT && stream != PW_EVT_STDERR) return -1;
+    int si = stream - 1;
+
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    if (!p) {
+        slot_unlock(handle);
+        return -1;
+    }
+    int fd = si ? p->stderr_fd : p->stdout_fd;
+    char* carry = p->carry[si].buf;
+    int carry_len = p->carry[si].len;
+    slot_unlock(handle);
+
+    // A pending carry pins the slot, so it stays valid without the lock.
+    int used = carry_len < buflen ? carry_len : buflen;
+    if (used) memcpy(buf, carry, (size_t)used);
+    int from_carry_only = carry_len >= buflen;
+
+    int eof = 0, err = 0;
+    while (fd >= 0 && used < buflen) {
+        ssize_t n = read(fd, buf + used, (size_t)(buflen - used));
+        note_pipe_read(p, si, fd, n, buflen - used);
+        if (n > 0) { used += (int)n; continue; }
+        if (n == 0) { eof = 1; break; }
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) err = 1;
+        break;
+    }
+    int done = (eof || fd < 0) && !from_carry_only;
+
+    int count = 0, start = 0;
+    while (count < max_lines && start < used) {
+        char* nl = memchr(buf + start, '\n', (size_t)(used - start));
+        int end, flags = 0;
+        if (nl) end = (int)(nl - buf);
+        else if (done) end = used;
+        else if (start == 0 && used == buflen) { end = used; flags = PW_LINE_CONTINUED; }
+        else break;
+
+        int len = end - start;
+        if (!flags && len > 0 && buf[start + len - 1] == '\r') len--;
+        lines[count].offset = start;
+        lines[count].length = len;
+        lines[count].flags = flags;
+        count++;
+        start = nl ? end + 1 : end;
+    }
+
+    slot_lock(handle);
+    p = entry_locked(handle);
+    if (p) {
+        line_carry* c = &p->carry[si];
+        if (from_carry_only) {
+            // no read happened; just drop what was consumed from the carry
+            memmove(c->buf, c->buf + start, (size_t)(c->len - start));
+            c->len -= start;
+        } else {
+            int rest = used - start;
+            if (rest > c->cap) {
+                char* nb = realloc(c->buf, (size_t)rest);
+                if (nb) { c->buf = nb; c->cap = rest; }
+                else rest = 0; // out of memory: drop the partial line rather than fail the read
+            }
+            if (rest) memcpy(c->buf, buf + start, (size_t)rest);
+            c->len = rest;
+        }
+        // Close only once a call delivers nothing, so EOF reads as 0 like read_stdout.
+        int* slot_fd = si ? &p->stderr_fd : &p->stdout_fd;
+        if (eof && count == 0 && c->len == 0 && *slot_fd == fd) {
+            close(fd);
+            *slot_fd = -1;
+        }
+        maybe_clear_slot_after_eof(handle);
+    }
+    slot_unlock(handle);
+
+    if (count == 0 && err) return -1;
+    return count;
+}
+
+// Read one chunk from stream si of p into buf (nonblocking). Returns bytes read, 0 if
+// nothing is available, -1 on error; on EOF closes the fd and sets *eof. Called with the
+// entry's lock held.
+static int read_chunk_locked(proc_entry* p, int si, char* buf, int cap, int* eof) {
+    int* fd = si ? &p->stderr_fd : &p->stdout_fd;
+    if (*fd < 0) {
+        *eof = 1;
+        return 0;
+    }
+    if (!buf || cap <= 0) return 0;
+    for (;;) {
+        ssize_t n = read(*fd, buf, (size_t)cap);
+        note_pipe_read(p, si, *fd, n, cap);
+        if (n > 0) return (int)n;
+        if (n == 0) {
+            close(*fd);
+            *fd = -1;
+            *eof = 1;
+            return 0;
+        }
+        if (errno == EINTR) continue;
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+}
+
+// read_streams: one call per reader iteration instead of read_stdout + read_stderr +
+// get_exit_code. Reaps the child first (so "exited" plus both EOF bits means nothing
+// is left), then reads one chunk from each stream, all under a single lock acquisition.
+// A NULL buffer or zero capacity skips that stream. Once done has all three bits set
+// the handle is released. Returns total bytes read, -1 on error/invalid handle.
+__attribute__((visibility("default")))
+int read_streams(int handle, pw_read_result* r) {
+    if (!r) return -1;
+    r->out_len = r->err_len = 0;
+    r->done = 0;
+
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    if (!p) {
+        slot_unlock(handle);
+        r->exit_code = -1;
+        return -1;
+    }
+    if (p->exit_code == -2) reap_locked(p, handle);
+    r->exit_code = p->exit_code;
+    if (exit_final(p->exit_code)) r->done |= PW_EV_EXIT;
+
+    int out_eof = 0, err_eof = 0;
+    int no = read_chunk_locked(p, 0, r->out_buf, r->out_cap, &out_eof);
+    int ne = read_chunk_locked(p, 1, r->err_buf, r->err_cap, &err_eof);
+    if (out_eof) r->done |= PW_EV_STDOUT;
+    if (err_eof) r->done |= PW_EV_STDERR;
+    if (out_eof || err_eof) maybe_clear_slot_after_eof(handle);
+    slot_unlock(handle);
+
+    // An error on one stream must not drop a chunk already read from the other.
+    if (no < 0 && ne <= 0) return -1;
+    if (ne < 0 && no <= 0) return -1;
+    r->out_len = no > 0 ? no : 0;
+    r->err_len = ne > 0 ? ne : 0;
+    return r->out_len + r->err_len;
+}
+
+// write() that reports a vanished reader as EPIPE instead of raising SIGPIPE in the host.
+static ssize_t write_nosigpipe(int fd, const void* buf, size_t len) {
+    sigset_t pipe_set, pending, old;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    sigpending(&pending);
+    int was_pending = sigismember(&pending, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old);
+
+    ssize_t n;
+    do n = write(fd, buf, len); while (n < 0 && errno == EINTR);
+    int e = errno;
+    if (n < 0 && e == EPIPE && !was_pending) {
+        // swallow the SIGPIPE this write raised (it is blocked, so still pending)
+        struct timespec zero = { 0, 0 };
+        while (sigtimedwait(&pipe_set, NULL, &zero) == -1 && errno == EINTR) {}
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    errno = e;
+    return n;
+}
+
+// write_stdin: non-blocking write to the stdin of a child started with PW_START_STDIN.
+// Returns bytes accepted, which may be fewer than len; 0 means the pipe is full, so wait
+// for PW_EV_STDIN before retrying. Returns -1 on error (invalid handle, no stdin pipe or
+// already closed, or the child closed its end).
+__attribute__((visibility("default")))
+int write_stdin(int handle, const char* buf, int len) {
+    if (!buf || len < 0) return -1;
+
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    int fd = p ? p->stdin_fd : -1;
+    slot_unlock(handle);
+    if (fd < 0) return -1;
+    if (len == 0) return 0;
+
+    ssize_t n = write_nosigpipe(fd, buf, (size_t)len);
+    if (n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    return (int)n;
+}
+
+// close_stdin: close the child's stdin pipe so it reads EOF.
+// Returns 0 on success, -1 if the handle is invalid or has no open stdin pipe.
+__attribute__((visibility("default")))
+int close_stdin(int handle) {
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    int fd = p ? p->stdin_fd : -1;
+    if (fd >= 0) p->stdin_fd = -1;
+    slot_unlock(handle);
+    if (fd < 0) return -1;
+    close(fd);
+    return 0;
+}
+
+// map_output: map a PW_OUT_MEMFD stream's capture (stream = PW_EVT_STDOUT/PW_EVT_STDERR)
+// read-only and store its length in *len. Call after the exit, once the size is final;
+// later calls return the same mapping. It stays valid until release_output, and the
+// handle stays valid until every capture is released. Returns NULL on error or if the
+// stream is not captured; an empty capture gives a non-NULL pointer with *len = 0.
+__attribute__((visibility("default")))
+const char* map_output(int handle, int stream, long long* len) {
+    static const char empty[1];
+    if (!len || (stream != PW_EVT_STDOUT && stream != PW_EVT_STDERR)) return NULL;
+    *len = 0;
+
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    out_capture* c = p ? &p->capture[stream - 1] : NULL;
+    const char* data = NULL;
+    if (c && c->fd >= 0) {
+        if (!c->map) {
+            struct stat st;
+            if (fstat(c->fd, &st) == 0) {
+                void* m = st.st_size > 0
+                    ? mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, c->fd, 0)
+                    : MAP_FAILED;
+                if (m != MAP_FAILED) {
+                    c->map = m;
+                    c->len = (size_t)st.st_size;
+                } else if (st.st_size == 0) {
+                    data = empty;
+                }
+            }
+        }
+        if (c->map) {
+            data = c->map;
+            *len = (long long)c->len;
+        }
+    }
+    slot_unlock(handle);
+    return data;
+}
+
+// release_output: unmap and drop a PW_OUT_MEMFD capture. Once both are released (and
+// the child was reaped) the handle is freed. Returns 0, or -1 if nothing was captured.
+__attribute__((visibility("default")))
+int release_output(int handle, int stream) {
+    if (stream != PW_EVT_STDOUT && stream != PW_EVT_STDERR) return -1;
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    out_capture* c = p ? &p->capture[stream - 1] : NULL;
+    int had = c && c->fd >= 0;
+    if (had) {
+        capture_close(c);
+        maybe_clear_slot_after_eof(handle);
+    }
+    slot_unlock(handle);
+    return had ? 0 : -1;
+}
+
+// is_running: returns 1 if running, 0 if not running (exited or invalid). Children the
+// reaper watches cost no syscall here; others are polled with wait4(WNOHANG).
+__attribute__((visibility("default")))
+int is_running(int handle) {
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    if (p && p->exit_code == -2 && !p->reaper) reap_locked(p, handle);
+    int in_use = p && p->exit_code == -2;
+    slot_unlock(handle);
+    return in_use ? 1 : 0;
+}
+
+// get_exit_code: >=0 exit code, -2 still running, -1 error/invalid handle,
+// PW_EXIT_TIMED_OUT if a deadline stopped the child
+__attribute__((visibility("default")))
+int get_exit_code(int handle) {
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    if (p && p->exit_code == -2 && !p->reaper) reap_locked(p, handle);
+    int ec = p ? p->exit_code : -1;
+    // Both streams may have hit EOF before the exit was observed; release now.
+    maybe_clear_slot_after_eof(handle);
+    slot_unlock(handle);
+    return ec;
+}
+
+// watch_exit: register cb to run once when the child's exit is recorded, from the thread
+// that records it (normally the event loop). If the exit is already known, cb runs before
+// watch_exit returns. Replaces any earlier registration; cb == NULL just unregisters.
+// Returns 1 if an earlier registration was dropped without firing, 0 if not, -1 if the
+// handle is invalid.
+__attribute__((visibility("default")))
+int watch_exit(int handle, pw_exit_cb cb, void* user) {
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    if (!p) {
+        slot_unlock(handle);
+        return -1;
+    }
+    int dropped = p->exit_cb != NULL;
+    p->exit_cb = NULL;
+    p->exit_user = NULL;
+    if (cb) {
+        if (p->exit_code == -2 && !p->reaper) reap_locked(p, handle);
+        if (p->exit_code == -2) {
+            p->exit_cb = cb;
+            p->exit_user = user;
+        } else {
+            cb(handle, &p->exit_info, user);
+        }
+    }
+    slot_unlock(handle);
+    return dropped;
+}
+
+// get_exit_info: copy the exit record (code, start/exit CLOCK_MONOTONIC ns, user/system
+// CPU us, peak RSS KiB) into *out. Returns 0 if the child has exited, 1 if it is still
+// running (only start_ns is meaningful), -1 if the handle is invalid.
+__attribute__((visibility("default")))
+int get_exit_info(int handle, pw_exit_info* out) {
+    if (!out) return -1;
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    if (p && p->exit_code == -2 && !p->reaper) reap_locked(p, handle);
+    int rc = -1;
+    if (p) {
+        *out = p->exit_info;
+        rc = p->exit_code == -2 ? 1 : 0;
+    }
+    slot_unlock(handle);
+    return rc;
+}
+
+// wait_events: block until one of the requested events is ready, instead of polling.
+// On entry *mask selects the PW_EV_* events of interest (0 = stdout|stderr|exit);
+// on return it holds the ready subset. A stream counts as ready when read_* will
+// return data or observe EOF; PW_EV_STDIN when write_stdin will accept data or fail.
+// timeout_ms < 0 waits indefinitely.
+// Returns 1 if any event is ready, 0 on timeout, -1 on error/invalid handle.
+__attribute__((visibility("default")))
+int wait_events(int handle, int timeout_ms, int* mask) {
+    if (!mask) return -1;
+
+    int want = *mask ? *mask : (PW_EV_STDOUT | PW_EV_STDERR | PW_EV_EXIT);
+    *mask = 0;
+    long long deadline = timeout_ms >= 0 ? now_ms() + timeout_ms : -1;
+
+    for (;;) {
+        reap_if_finished(handle);
+
+        slot_lock(handle);
+        proc_entry* p = entry_locked(handle);
+        if (!p) {
+            slot_unlock(handle);
+            return -1;
+        }
+        int infd  = p->stdin_fd;
+        int outfd = p->stdout_fd;
+        int errfd = p->stderr_fd;
+        int pidfd = p->pidfd;
+        int ec    = p->exit_code;
+        int srvfd = p->backend == PW_SPAWN_SERVER ? __atomic_load_n(&server_fd, __ATOMIC_RELAXED) : -2;
+        // The loop would take the shared wakeup (server socket, SIGCHLD pipe) before us;
+        // record_exit_locked signals exit_efd instead. Made under the lock that exit is
+        // recorded under, so the signal cannot be missed.
+        if ((want & PW_EV_EXIT) && ec == -2 && pidfd < 0 && p->exit_efd < 0 && loop_reaps_locked(p))
+            p->exit_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        int exitfd = ec == -2 ? p->exit_efd : -1;
+        slot_unlock(handle);
+
+        int ready = 0;
+        if ((want & PW_EV_EXIT) && ec != -2) ready |= PW_EV_EXIT;
+        if ((want & PW_EV_STDIN) && infd < 0) ready |= PW_EV_STDIN; // write_stdin fails at once
+
+        struct pollfd pfd[4];
+        int n = 0, in_i = -1, out_i = -1, err_i = -1, exit_i = -1;
+        if ((want & PW_EV_STDIN) && infd >= 0) { in_i = n; pfd[n].fd = infd; pfd[n].events = POLLOUT; n++; }
+        if ((want & PW_EV_STDOUT) && outfd >= 0) { out_i = n; pfd[n].fd = outfd; pfd[n].events = POLLIN; n++; }
+        if ((want & PW_EV_STDERR) && errfd >= 0) { err_i = n; pfd[n].fd = errfd; pfd[n].events = POLLIN; n++; }
+        int use_sigchld = 0, use_server = 0;
+        if ((want & PW_EV_EXIT) && ec == -2) {
+            int efd = pidfd;
+            if (exitfd >= 0) efd = exitfd;
+            else if (srvfd != -2) { efd = srvfd; use_server = 1; }
+            else if (efd < 0) { efd = sigchld_fd(); use_sigchld = 1; }
+            if (efd >= 0) { exit_i = n; pfd[n].fd = efd; pfd[n].events = POLLIN; n++; }
+        }
+
+        int wait_ms;
+        if (ready) {
+            wait_ms = 0; // exit already known; just report stream readiness
+        } else if (deadline < 0) {
+            wait_ms = -1;
+        } else {
+            long long left = deadline - now_ms();
+            wait_ms = left > 0 ? (int)left : 0;
+        }
+        // shared wakeup sources: another waiter may consume the one meant for us
+        if ((use_sigchld || use_server) && (wait_ms < 0 || wait_ms > SIGCHLD_SLICE_MS)) wait_ms = SIGCHLD_SLICE_MS;
+
+        int r = poll(pfd, (nfds_t)n, wait_ms);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        if (in_i >= 0 && (pfd[in_i].revents & (POLLOUT | POLLERR | POLLHUP))) ready |= PW_EV_STDIN;
+        if (out_i >= 0 && (pfd[out_i].revents & (POLLIN | POLLHUP | POLLERR))) ready |= PW_EV_STDOUT;
+        if (err_i >= 0 && (pfd[err_i].revents & (POLLIN | POLLHUP | POLLERR))) ready |= PW_EV_STDERR;
+        int exit_woke = exit_i >= 0 && pfd[exit_i].revents;
+        if (exit_woke && use_sigchld) drain_fd(pfd[exit_i].fd);
+        // With the self-pipe or the server socket, the wakeup may have gone to another waiter.
+        if (exit_woke || use_sigchld || use_server) {
+            reap_if_finished(handle);
+            slot_lock(handle);
+            p = entry_locked(handle);
+            if (!p || p->exit_code != -2) ready |= PW_EV_EXIT;
+            slot_unlock(handle);
+        }
+
+        if (ready) { *mask = ready; return 1; }
+        if (deadline >= 0 && now_ms() >= deadline) return 0;
+    }
+}
+
+// Whether stopping p still has something to signal: the child itself, or for a group
+// leader that already exited, helpers that keep its pipes open. Called with the entry's lock held.
+static int stop_needed_locked(const proc_entry* p) {
+    if (p->exit_code == -2) return 1;
+    return p->pgid && (p->stdout_fd >= 0 || p->stderr_fd >= 0);
+}
+
+// Send sig to p's child, or to its whole process group if it is in one of its own
+// (leader, or a pipeline stage). An exited
+// (reaped) child is only reachable through its group: the pgid cannot be handed out
+// again while members remain. Called with the entry's lock held; returns kill()'s result.
+static int signal_entry_locked(const proc_entry* p, int sig, int group) {
+    if (group) {
+        if (!p->pgid) { errno = EINVAL; return -1; }
+        return kill(-p->pgid, sig);
+    }
+    if (p->exit_code != -2) { errno = ESRCH; return -1; }
+    return kill(p->pid, sig);
+}
+
+// signal_process: send sig to the child, or with group != 0 to its whole process group
+// (children started with PW_START_NEW_PGROUP/SESSION, and pipeline stages, which share
+// the first stage's group). The group stays reachable
+// after the leader exited, for as long as the handle is valid.
+// Returns 0 on success, -1 on error (invalid handle, no group, child gone).
+__attribute__((visibility("default")))
+int signal_process(int handle, int sig, int group) {
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    int rc = p ? signal_entry_locked(p, sig, group) : -1;
+    slot_unlock(handle);
+    return rc;
+}
+
+// Reap the child if it exited; with kill set, SIGKILL it (and its group) first. The
+// kill happens under the lock with the child not yet reaped, so the pid cannot have
+// been reused. Returns 1 if the child is still running.
+static int stop_still_running(int handle, int kill_it) {
+    reap_if_finished(handle);
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    int running = p && p->exit_code == -2;
+    if (p && kill_it && stop_needed_locked(p)) signal_entry_locked(p, SIGKILL, p->pgid != 0);
+    slot_unlock(handle);
+    return running;
+}
+
+// stop_process: try SIGTERM then SIGKILL; returns 0 on success, -1 on error.
+// A child that leads its own process group is stopped together with the group.
+__attribute__((visibility("default")))
+int stop_process(int handle) {
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    if (!p) {
+        slot_unlock(handle);
+        return -1;
+    }
+    if (!stop_needed_locked(p)) {
+        slot_unlock(handle);
+        return 0; // already not running
+    }
+    int rc = signal_entry_locked(p, SIGTERM, p->pgid != 0);
+    slot_unlock(handle);
+    if (rc == -1 && errno == ESRCH) return 0; // no such process
+
+    // small wait for graceful shutdown; reap through the slot so the exit code is kept
+    for (int i = 0; i < 10 && stop_still_running(handle, 0); ++i) usleep(100 * 1000);
+
+    // if still alive, SIGKILL and wait for it to go
+    if (stop_still_running(handle, 1)) {
+        while (stop_still_running(handle, 0)) usleep(1000);
+    }
+    return 0;
+}
+
+// ---- event loop ----
+// One epoll thread serves every subscribed handle: it drains stdout/stderr as data
+// arrives, watches pidfds (or the SIGCHLD self-pipe) for exits, and hands everything
+// to the handle's callback. Callbacks run on the loop thread and should be short.
+// It is also the reaper for every child, subscribed or not: each one is watched from
+// start_process on, so exits are recorded (with rusage) as they happen.
+
+#define LOOP_TAG_STDOUT  1
+#define LOOP_TAG_STDERR  2
+#define LOOP_TAG_PIDFD   3
+#define LOOP_TAG_WAKE    4
+#define LOOP_TAG_SIGCHLD 5
+#define LOOP_TAG_SERVER  6
+#define LOOP_TAG_RELAY_IN  7 // pipeline relay input readable (handle field = relay id)
+#define LOOP_TAG_RELAY_OUT 8 // ... its stalled output writable again
+#define LOOP_READ_SIZE   (64 * 1024)   // scratch buffer to start with
+#define LOOP_READ_MAX    (1024 * 1024) // grown up to this while reads keep filling it
+#define LOOP_MAX_EVENTS  64
+
+static int loop_epfd = -1;
+static int loop_wake[2] = { -1, -1 };
+static pthread_t loop_thread;
+static pthread_once_t loop_once = PTHREAD_ONCE_INIT;
+static int loop_sigchld_added = 0; // under table_mutex
+// Held by the loop thread while it services an event (including the callback),
+// so unsubscribe_process can wait out a delivery in flight.
+static pthread_mutex_t loop_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t loop_key(int handle, int tag) {
+    return ((uint64_t)(uint32_t)handle << 8) | (uint64_t)tag;
+}
+
+static int loop_add_events(int fd, int handle, int tag, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = loop_key(handle, tag);
+    return epoll_ctl(loop_epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int loop_add(int fd, int handle, int tag) {
+    return loop_add_events(fd, handle, tag, EPOLLIN);
+}
+
+static void loop_del(int fd) {
+    if (fd >= 0) epoll_ctl(loop_epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static void loop_wakeup(void) {
+    char b = 0;
+    (void)!write(loop_wake[1], &b, 1);
+}
+
+static int on_loop_thread(void) {
+    return loop_epfd >= 0 && pthread_equal(pthread_self(), loop_thread);
+}
+
+static void loop_watch_sigchld(void) {
+    int sfd = sigchld_fd();
+    pthread_mutex_lock(&table_mutex);
+    if (!loop_sigchld_added && sfd >= 0 && loop_add(sfd, 0, LOOP_TAG_SIGCHLD) == 0) loop_sigchld_added = 1;
+    pthread_mutex_unlock(&table_mutex);
+}
+
+// Closing the socket drops it from epoll by itself. Returns 1 if the socket is watched.
+static int loop_watch_server(void) {
+    pthread_mutex_lock(&table_mutex);
+    if (server_fd >= 0 && loop_server_fd != server_fd && loop_add(server_fd, 0, LOOP_TAG_SERVER) == 0)
+        loop_server_fd = server_fd;
+    int watched = server_fd >= 0 && loop_server_fd == server_fd;
+    pthread_mutex_unlock(&table_mutex);
+    return watched;
+}
+
+static void loop_dispatch(pw_event_cb cb, void* user, int handle, int event, const char* data, int len) {
+    if (cb) cb(handle, event, data, len, user);
+}
+
+static char* ring_data(pw_ring* r) {
+    return (char*)r + PW_RING_DATA_OFFSET;
+}
+
+static pw_ring* ring_new(int requested) {
+    uint32_t cap = PW_RING_MIN_SIZE;
+    while (cap < (uint32_t)requested && cap < PW_RING_MAX_SIZE) cap <<= 1;
+    void* mem = NULL;
+    if (posix_memalign(&mem, 64, PW_RING_DATA_OFFSET + cap) != 0) return NULL;
+    memset(mem, 0, PW_RING_DATA_OFFSET);
+    ((pw_ring*)mem)->capacity = cap;
+    return (pw_ring*)mem;
+}
+
+// Resume reading a stalled ring's pipe. Whoever clears 'stalled' re-arms the fd,
+// so the loop and a consumer racing on it cannot both add it.
+static void ring_unstall(pw_ring* r, int fd, int handle, int tag) {
+    uint32_t expected = 1;
+    if (__atomic_compare_exchange_n(&r->stalled, &expected, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        loop_add(fd, handle, tag);
+}
+
+// Ring full: stop reading so backpressure reaches the child through the pipe.
+static void ring_stall(pw_ring* r, int fd, int handle, int tag) {
+    loop_del(fd);
+    __atomic_store_n(&r->stalled, 1, __ATOMIC_SEQ_CST);
+    // the consumer may have freed space before it could see the flag
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+    if (r->head - tail < r->capacity) ring_unstall(r, fd, handle, tag);
+}
+
+// Deliver PW_EVT_EXIT and drop the subscription once the handle is fully drained.
+static void loop_check_done(int handle) {
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    if (!p || !p->watched || p->stdout_fd >= 0 || p->stderr_fd >= 0 || p->exit_code == -2) {
+        slot_unlock(handle);
+        return;
     }
-    // if still alive, SIGKILL
-    if (kill(pid, 0) == 0) {
-        kill(pid, SIGKILL);
-        waitpid(pid, NULL, 0);
+    pw_event_cb cb = p->cb;
+    void* user = p->cb_user;
+    int ec = p->exit_code;
+    slot_unlock(handle);
+
+    // Deliver before the slot can be recycled, so the handle is still valid in the callback.
+    loop_dispatch(cb, user, handle, PW_EVT_EXIT, NULL, ec);
+
+    pw_ring* rings[2] = { NULL, NULL };
+    slot_lock(handle);
+    p = entry_locked(handle);
+    if (p) {
+        rings[0] = p->ring[0];
+        rings[1] = p->ring[1];
+        p->ring[0] = p->ring[1] = NULL;
+        p->watched = 0;
+        p->cb = NULL;
+        p->cb_user = NULL;
+        maybe_clear_slot_after_eof(handle);
     }
+    slot_unlock(handle);
+    free(rings[0]);
+    free(rings[1]);
+}
 
-    // mark exit code if we can reap here too
+static void loop_check_exit(int handle) {
     reap_if_finished(handle);
+    slot_lock(handle);
+    // pidfds stay readable after exit; stop watching it once the code is known
+    proc_entry* p = entry_locked(handle);
+    if (p && p->exit_code != -2) loop_del(p->pidfd);
+    slot_unlock(handle);
+    loop_check_done(handle);
+}
+
+static void loop_read(int handle, int tag) {
+    // loop thread only; doubled whenever a read fills it, so busy pipes take fewer reads
+    static char small_buf[LOOP_READ_SIZE];
+    static char* buf = small_buf;
+    static int buf_size = LOOP_READ_SIZE;
+    int event = tag == LOOP_TAG_STDOUT ? PW_EVT_STDOUT : PW_EVT_STDERR;
+
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    if (!p || !p->watched) {
+        slot_unlock(handle);
+        return;
+    }
+    int fd = event == PW_EVT_STDOUT ? p->stdout_fd : p->stderr_fd;
+    pw_event_cb cb = p->cb;
+    void* user = p->cb_user;
+    pw_ring* r = p->ring[event - 1];
+    int paused = p->paused[event - 1]; // an event already queued when pause_stream ran
+    slot_unlock(handle);
+    if (fd < 0 || paused) return;
+
+    ssize_t n;
+    if (r) {
+        // ring mode: read straight into the consumer-visible ring
+        uint32_t head = r->head;
+        uint32_t used = head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        uint32_t space = r->capacity - used;
+        if (space == 0) {
+            // under the lock, so a pause_stream in between is not undone by the re-check
+            slot_lock(handle);
+            p = entry_locked(handle);
+            if (p && !p->paused[event - 1]) ring_stall(r, fd, handle, tag);
+            slot_unlock(handle);
+            return;
+        }
+        uint32_t off = head & (r->capacity - 1);
+        uint32_t chunk = r->capacity - off < space ? r->capacity - off : space;
+        n = read(fd, ring_data(r) + off, chunk);
+        note_pipe_read(p, event - 1, fd, n, (int)chunk);
+        if (n > 0) {
+            __atomic_store_n(&r->head, head + (uint32_t)n, __ATOMIC_RELEASE);
+            loop_dispatch(cb, user, handle, event, (const char*)r, (int)(used + (uint32_t)n));
+            return;
+        }
+    } else {
+        n = read(fd, buf, (size_t)buf_size);
+        note_pipe_read(p, event - 1, fd, n, buf_size);
+        if (n > 0) {
+            loop_dispatch(cb, user, handle, event, buf, (int)n);
+            if (n == buf_size && buf_size < LOOP_READ_MAX) {
+                char* nb = malloc((size_t)buf_size * 2);
+                if (nb) {
+                    if (buf != small_buf) free(buf);
+                    buf = nb;
+                    buf_size *= 2;
+                }
+            }
+            return;
+        }
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+
+    // EOF (or a hard read error, treated the same)
+    slot_lock(handle);
+    p = entry_locked(handle);
+    int* slot_fd = p ? (event == PW_EVT_STDOUT ? &p->stdout_fd : &p->stderr_fd) : NULL;
+    if (slot_fd && *slot_fd == fd) {
+        loop_del(fd);
+        close(fd);
+        *slot_fd = -1;
+    }
+    slot_unlock(handle);
+    if (r) __atomic_store_n(&r->eof, 1, __ATOMIC_RELEASE);
+    loop_dispatch(cb, user, handle, event, (const char*)r, 0);
+
+    // The child usually exits right around EOF; reap now rather than waiting for a wakeup.
+    loop_check_exit(handle);
+}
+
+// Finish every subscribed handle and reap every child without a pidfd. Returns 1 if
+// any child is still running without one (so the loop must keep re-checking).
+static int loop_sweep(void) {
+    int needs_slice = 0;
+    int count = slot_count();
+    for (int i = 0; i < count; ++i) {
+        proc_entry* p = slot_entry((uint32_t)i);
+        pthread_mutex_lock(&p->lock);
+        int check = p->used && (p->watched || (p->exit_code == -2 && p->pidfd < 0));
+        int handle = check ? make_handle((uint32_t)i, p->gen) : 0;
+        pthread_mutex_unlock(&p->lock);
+        if (!handle) continue;
+
+        pthread_mutex_lock(&loop_mutex);
+        loop_check_exit(handle);
+        slot_lock(handle);
+        p = entry_locked(handle);
+        if (p && p->exit_code == -2 && p->pidfd < 0) needs_slice = 1;
+        slot_unlock(handle);
+        pthread_mutex_unlock(&loop_mutex);
+    }
+    return needs_slice;
+}
+
+// A deadline check came due for running p (lock held): stop it if it timed out, else
+// schedule the next check.
+static void deadline_check_locked(proc_entry* p, long long now) {
+    int kind = 0;
+    long long used = 0;
+    if (p->wall_deadline && now >= p->wall_deadline) kind = PW_TIMEOUT_WALL;
+    else if (p->cpu_budget_ns && (used = child_cpu_ns(p->pid)) >= p->cpu_budget_ns) kind = PW_TIMEOUT_CPU;
+    if (!kind) {
+        p->deadline_check = deadline_next(p, now, used > 0 ? used : 0);
+        return;
+    }
+    deadline_clear(p);
+    p->timed_out = kind;
+    stat_add(&lib_stats.timeouts, 1);
+    stop_signal_locked(p, p->timeout_grace);
+}
+
+// Stop children past a deadline, and SIGKILL those whose stop_process_async (or
+// deadline) grace period ran out. Returns the ms until the next pending deadline, -1
+// if there is none.
+static int loop_escalate(void) {
+    int next = -1;
+    if (!__atomic_load_n(&stops_pending, __ATOMIC_RELAXED) && !__atomic_load_n(&deadlines_pending, __ATOMIC_RELAXED))
+        return -1;
+    long long now = now_ms();
+    int count = slot_count();
+    for (int i = 0; i < count; ++i) {
+        proc_entry* p = slot_entry((uint32_t)i);
+        pthread_mutex_lock(&p->lock);
+        if (p->used && p->deadline_check && p->exit_code == -2 && now >= p->deadline_check) deadline_check_locked(p, now);
+        if (p->used && p->deadline_check) {
+            long long due = p->deadline_check - now;
+            int left = due <= 0 ? 0 : due < INT_MAX ? (int)due : INT_MAX;
+            if (next < 0 || left < next) next = left;
+        }
+        if (p->used && p->kill_at) {
+            int needed = stop_needed_locked(p);
+            if (needed && now < p->kill_at) {
+                int left = (int)(p->kill_at - now);
+                if (next < 0 || left < next) next = left;
+            } else {
+                // not reaped yet (or a live group), so the target is still ours
+                if (needed) signal_entry_locked(p, SIGKILL, p->pgid != 0);
+                p->kill_at = 0;
+                __atomic_sub_fetch(&stops_pending, 1, __ATOMIC_RELAXED);
+            }
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+    return next;
+}
+
+static void relay_pump(int id);
+static void relay_unstall(int id);
+
+static void* loop_main(void* arg) {
+    (void)arg;
+    struct epoll_event evs[LOOP_MAX_EVENTS];
+    int needs_slice = 0;
+    reap_on_loop = 1;
+
+    // relays splice into pipes whose reader may be gone: take EPIPE, not the signal
+    sigset_t pipe_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, NULL);
+
+    for (;;) {
+        int timeout = loop_escalate();
+        if (needs_slice && (timeout < 0 || timeout > SIGCHLD_SLICE_MS)) timeout = SIGCHLD_SLICE_MS;
+        int n = epoll_wait(loop_epfd, evs, LOOP_MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        reap_from_ns = now_ns();
+        int traced = n > 0 ? trace_begin("pw:loop") : 0;
+
+        int sweep = (n == 0);
+        for (int i = 0; i < n; ++i) {
+            int tag = (int)(evs[i].data.u64 & 0xff);
+            int handle = (int)(uint32_t)(evs[i].data.u64 >> 8);
+            pthread_mutex_lock(&loop_mutex);
+            switch (tag) {
+            case LOOP_TAG_STDOUT:
+            case LOOP_TAG_STDERR:
+                loop_read(handle, tag);
+                break;
+            case LOOP_TAG_PIDFD:
+                loop_check_exit(handle);
+                break;
+            case LOOP_TAG_WAKE:
+                drain_fd(loop_wake[0]);
+                sweep = 1;
+                break;
+            case LOOP_TAG_SIGCHLD:
+                drain_fd(sigchld_fd());
+                sweep = 1;
+                break;
+            case LOOP_TAG_SERVER:
+                server_poll();
+                sweep = 1;
+                break;
+            case LOOP_TAG_RELAY_OUT:
+                relay_unstall(handle);
+                /* fall through */
+            case LOOP_TAG_RELAY_IN:
+                relay_pump(handle);
+                break;
+            }
+            pthread_mutex_unlock(&loop_mutex);
+        }
+        if (sweep || needs_slice) needs_slice = loop_sweep();
+        trace_end(traced);
+    }
+    return NULL;
+}
+
+static void loop_init(void) {
+    loop_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop_epfd < 0) return;
+    if (pipe2(loop_wake, O_CLOEXEC | O_NONBLOCK) == -1 ||
+        loop_add(loop_wake[0], 0, LOOP_TAG_WAKE) == -1) {
+        close(loop_epfd);
+        loop_epfd = -1;
+        return;
+    }
+    if (pthread_create(&loop_thread, NULL, loop_main, NULL) != 0) {
+        close(loop_epfd);
+        loop_epfd = -1;
+    }
+}
+
+// Start the loop thread if needed. Returns 0 if it is running, -1 if unavailable.
+static int loop_start(void) {
+    pthread_once(&loop_once, loop_init);
+    return loop_epfd >= 0 ? 0 : -1;
+}
+
+static int loop_subscribe(int handle, pw_event_cb cb, void* user, pw_ring* out_ring, pw_ring* err_ring) {
+    if (loop_start() != 0) return -1;
+
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    if (!p || p->watched) {
+        slot_unlock(handle);
+        return -1;
+    }
+    p->cb = cb;
+    p->cb_user = user;
+    p->ring[0] = out_ring;
+    p->ring[1] = err_ring;
+    p->watched = 1;
+    if (p->stdout_fd >= 0) loop_add(p->stdout_fd, handle, LOOP_TAG_STDOUT);
+    if (p->stderr_fd >= 0) loop_add(p->stderr_fd, handle, LOOP_TAG_STDERR);
+    slot_unlock(handle);
+
+    // The exit is already watched (see reaper_watch); let the loop finish a child that
+    // exited before we subscribed.
+    loop_wakeup();
+    return 0;
+}
+
+// Have the loop reap handle's child as soon as it exits. Without the loop, exits are
+// still found by the wait4 calls in get_exit_code and friends.
+static void reaper_watch(int handle) {
+    if (loop_start() != 0) return;
+    int fallback = 0;
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    if (p && p->exit_code == -2) {
+        if (p->backend == PW_SPAWN_SERVER) {
+            p->reaper = loop_watch_server();
+            fallback = !p->reaper;
+        } else if (p->pidfd >= 0 && loop_add(p->pidfd, handle, LOOP_TAG_PIDFD) == 0) {
+            p->reaper = 1;
+        } else {
+            loop_watch_sigchld();
+            fallback = 1;
+        }
+    }
+    slot_unlock(handle);
+    if (fallback) loop_wakeup(); // arm the periodic re-check
+}
+
+// Whether the loop reaps p's child off a shared wakeup source (the server socket, or
+// the SIGCHLD pipe a sweep answers), which a poller can then wait for in vain.
+// Called with p's lock held.
+static int loop_reaps_locked(const proc_entry* p) {
+    if (p->backend == PW_SPAWN_SERVER) return p->reaper;
+    return p->pidfd < 0 && __atomic_load_n(&loop_sigchld_added, __ATOMIC_RELAXED);
+}
+
+// Signal a running entry: SIGTERM plus a SIGKILL deadline grace_ms from now, or
+// SIGKILL right away if grace_ms <= 0. Called with the entry's lock held.
+// Returns 1 if the child was signalled, 0 if it is not running.
+static int stop_signal_locked(proc_entry* p, int grace_ms) {
+    if (!stop_needed_locked(p)) return 0;
+    if (grace_ms <= 0) {
+        signal_entry_locked(p, SIGKILL, p->pgid != 0);
+        return 1;
+    }
+    if (signal_entry_locked(p, SIGTERM, p->pgid != 0) == -1 && errno == ESRCH) return 0;
+    long long at = now_ms() + grace_ms;
+    if (!p->kill_at) __atomic_add_fetch(&stops_pending, 1, __ATOMIC_RELAXED);
+    if (!p->kill_at || at < p->kill_at) p->kill_at = at;
+    return 1;
+}
+
+// stop_process_async: like stop_process, but returns immediately. SIGTERM is sent
+// now and the event loop escalates to SIGKILL after grace_ms if the child is still
+// running (grace_ms <= 0 kills at once). The exit is then observed as usual
+// (get_exit_code, wait_events, PW_EVT_EXIT); the handle stays valid until then.
+// Returns 0 on success (including a child that already exited), -1 on error.
+__attribute__((visibility("default")))
+int stop_process_async(int handle, int grace_ms) {
+    if (grace_ms > 0 && loop_start() != 0) return -1;
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    int signalled = p ? stop_signal_locked(p, grace_ms) : 0;
+    slot_unlock(handle);
+    if (!p) return -1;
+    if (signalled && grace_ms > 0) loop_wakeup();
+    return 0;
+}
+
+// stop_all: stop_process_async for every running handle in one pass.
+// Returns the number of children signalled, -1 on error.
+__attribute__((visibility("default")))
+int stop_all(int grace_ms) {
+    if (grace_ms > 0 && loop_start() != 0) return -1;
+    int signalled = 0;
+    int count = slot_count();
+    for (int i = 0; i < count; ++i) {
+        proc_entry* p = slot_entry((uint32_t)i);
+        pthread_mutex_lock(&p->lock);
+        if (p->used) signalled += stop_signal_locked(p, grace_ms);
+        pthread_mutex_unlock(&p->lock);
+    }
+    if (signalled && grace_ms > 0) loop_wakeup();
+    return signalled;
+}
+
+// subscribe_process: hand the handle's stdout/stderr and exit over to the shared
+// event loop thread; cb receives PW_EVT_* events (see pw_event_cb). Do not call
+// read_stdout/read_stderr on a subscribed handle.
+// Returns 0 on success, -1 on error (invalid handle, already subscribed, no loop).
+__attribute__((visibility("default")))
+int subscribe_process(int handle, pw_event_cb cb, void* user) {
+    if (!cb) return -1;
+    return loop_subscribe(handle, cb, user, NULL, NULL);
+}
+
+// subscribe_process_ring: like subscribe_process, but the loop reads each pipe
+// straight into a pw_ring of at least ring_size bytes (rounded up to a power of two)
+// instead of a scratch buffer. Stream callbacks get data = the pw_ring and len = bytes
+// readable; the consumer parses [tail, head) in place and advances tail. A full ring
+// stops draining that pipe until ring_resume. Rings are freed after PW_EVT_EXIT
+// returns or unsubscribe_process, so they must not be touched afterwards.
+// Returns 0 on success, -1 on error.
+__attribute__((visibility("default")))
+int subscribe_process_ring(int handle, int ring_size, pw_event_cb cb, void* user) {
+    if (!cb) return -1;
+    pw_ring* out_ring = ring_new(ring_size);
+    pw_ring* err_ring = ring_new(ring_size);
+    if (!out_ring || !err_ring || loop_subscribe(handle, cb, user, out_ring, err_ring) != 0) {
+        free(out_ring);
+        free(err_ring);
+        return -1;
+    }
+    return 0;
+}
+
+// get_ring: the pw_ring behind stream (PW_EVT_STDOUT/PW_EVT_STDERR) of a handle
+// subscribed in ring mode, or NULL.
+__attribute__((visibility("default")))
+pw_ring* get_ring(int handle, int stream) {
+    if (stream != PW_EVT_STDOUT && stream != PW_EVT_STDERR) return NULL;
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    pw_ring* r = p && p->watched ? p->ring[stream - 1] : NULL;
+    slot_unlock(handle);
+    return r;
+}
+
+// ring_resume: call after advancing tail when the ring's 'stalled' flag is set,
+// so the loop starts draining the pipe again. Returns 0, or -1 if not in ring mode.
+__attribute__((visibility("default")))
+int ring_resume(int handle, int stream) {
+    if (stream != PW_EVT_STDOUT && stream != PW_EVT_STDERR) return -1;
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    pw_ring* r = p && p->watched ? p->ring[stream - 1] : NULL;
+    int fd = p ? (stream == PW_EVT_STDOUT ? p->stdout_fd : p->stderr_fd) : -1;
+    // a paused stream is re-armed by pause_stream instead
+    if (r && fd >= 0 && !p->paused[stream - 1])
+        ring_unstall(r, fd, handle, stream == PW_EVT_STDOUT ? LOOP_TAG_STDOUT : LOOP_TAG_STDERR);
+    slot_unlock(handle);
+    return r ? 0 : -1;
+}
+
+// pause_stream: stop (paused = 1) or resume (paused = 0) draining one pipe of a
+// subscribed handle, so a consumer that falls behind pushes back on the child through
+// the full pipe instead of buffering without bound. EOF is not seen while paused.
+// Returns 0, or -1 if the handle is not subscribed.
+__attribute__((visibility("default")))
+int pause_stream(int handle, int stream, int paused) {
+    if (stream != PW_EVT_STDOUT && stream != PW_EVT_STDERR) return -1;
+    int si = stream - 1;
+    int tag = stream == PW_EVT_STDOUT ? LOOP_TAG_STDOUT : LOOP_TAG_STDERR;
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    if (!p || !p->watched) {
+        slot_unlock(handle);
+        return -1;
+    }
+    int fd = si ? p->stderr_fd : p->stdout_fd;
+    paused = paused != 0;
+    if (fd >= 0 && p->paused[si] != paused) {
+        pw_ring* r = p->ring[si];
+        if (paused) loop_del(fd);
+        else if (r && __atomic_load_n(&r->stalled, __ATOMIC_SEQ_CST)) ring_unstall(r, fd, handle, tag);
+        else loop_add(fd, handle, tag);
+    }
+    p->paused[si] = paused;
+    slot_unlock(handle);
+    return 0;
+}
+
+// unsubscribe_process: stop delivering events for handle. Once it returns no
+// callback for the handle is running or will run, so user data can be freed.
+// Returns 0 if the handle was subscribed, -1 otherwise.
+__attribute__((visibility("default")))
+int unsubscribe_process(int handle) {
+    if (loop_epfd < 0) return -1;
+
+    int self = on_loop_thread();
+    if (!self) pthread_mutex_lock(&loop_mutex);
+    slot_lock(handle);
+    proc_entry* p = entry_locked(handle);
+    int was = p && p->watched;
+    pw_ring* rings[2] = { NULL, NULL };
+    if (was) {
+        loop_del(p->stdout_fd);
+        loop_del(p->stderr_fd);
+        rings[0] = p->ring[0];
+        rings[1] = p->ring[1];
+        p->ring[0] = p->ring[1] = NULL;
+        p->watched = 0;
+        p->cb = NULL;
+        p->cb_user = NULL;
+    }
+    slot_unlock(handle);
+    if (!self) pthread_mutex_unlock(&loop_mutex);
+    free(rings[0]);
+    free(rings[1]);
+    return was ? 0 : -1;
+}
+
+// ---- pipelines ----
+// start_pipeline hands stage i's stdout to stage i+1's stdin. By default each link is
+// one pipe both children hold, so the data never passes through us. PW_PIPELINE_MONITOR
+// puts a relay on the event loop instead: it splice(2)s each link into the next stage's
+// pipe, tee(2)ing the bytes into a third pipe that reads as stage i's stdout first. Still
+// no copy through user space, and the copy never holds the pipeline back: what finds it
+// full passes uncopied (lib_stats.relay_dropped).
+
+#define RELAY_CHUNK      (64 * 1024)
+#define RELAY_MAX_ROUNDS 16 // chunks per wakeup, so one busy link cannot starve the loop
+
+typedef struct {
+    int    in;      // read end of stage i's stdout
+    int    out;     // write end of stage i+1's stdin
+    int    copy;    // write end of the copy, -1 once nobody reads it
+    size_t pending; // bytes at the head of in already tee'd to copy, not yet spliced
+    int    stalled; // out is full: watched for EPOLLOUT instead of in
+} pw_relay;
+
+// Relays by id (the handle field of their loop keys); under loop_mutex.
+static pw_relay** relays;
+static int        relay_cap;
+
+// Take over the three (non-blocking) fds and start relaying. Returns 0, or -1 with errno
+// set and the fds still the caller's.
+static int relay_add(int in, int out, int copy) {
+    pw_relay* r = malloc(sizeof(*r));
+    if (!r) { errno = ENOMEM; return -1; }
+    r->in = in;
+    r->out = out;
+    r->copy = copy;
+    r->pending = 0;
+    r->stalled = 0;
+
+    pthread_mutex_lock(&loop_mutex);
+    int id = 0;
+    while (id < relay_cap && relays[id]) ++id;
+    if (id == relay_cap) {
+        int cap = relay_cap ? relay_cap * 2 : 8;
+        pw_relay** grown = realloc(relays, sizeof(*relays) * (size_t)cap);
+        if (!grown) {
+            pthread_mutex_unlock(&loop_mutex);
+            free(r);
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(grown + relay_cap, 0, sizeof(*relays) * (size_t)(cap - relay_cap));
+        relays = grown;
+        relay_cap = cap;
+    }
+    int rc = loop_add(in, id, LOOP_TAG_RELAY_IN);
+    if (rc == 0) relays[id] = r;
+    pthread_mutex_unlock(&loop_mutex);
+    if (rc != 0) free(r);
+    return rc;
+}
+
+static void relay_close(int id) {
+    pw_relay* r = relays[id];
+    loop_del(r->in);
+    loop_del(r->out);
+    close(r->in);
+    close(r->out);
+    if (r->copy >= 0) close(r->copy);
+    free(r);
+    relays[id] = NULL;
+}
+
+// The next stage's pipe is full: wait for it to drain instead of for more input.
+static void relay_stall(int id, pw_relay* r) {
+    loop_del(r->in);
+    r->stalled = 1;
+    if (loop_add_events(r->out, id, LOOP_TAG_RELAY_OUT, EPOLLOUT) != 0) relay_close(id);
+}
+
+static void relay_unstall(int id) {
+    pw_relay* r = id < relay_cap ? relays[id] : NULL;
+    if (!r || !r->stalled) return; // a stale event for a since reused id
+    loop_del(r->out);
+    r->stalled = 0;
+    if (loop_add(r->in, id, LOOP_TAG_RELAY_IN) != 0) relay_close(id);
+}
+
+// Loop thread (under loop_mutex): move what stage i wrote on to stage i+1.
+static void relay_pump(int id) {
+    pw_relay* r = id < relay_cap ? relays[id] : NULL;
+    if (!r || r->stalled) return;
+    for (int round = 0; round < RELAY_MAX_ROUNDS; ++round) {
+        if (r->copy >= 0 && r->pending == 0) {
+            ssize_t t = tee(r->in, r->copy, RELAY_CHUNK, SPLICE_F_NONBLOCK);
+            if (t > 0) r->pending = (size_t)t;
+            else if (t < 0 && errno == EPIPE) { close(r->copy); r->copy = -1; } // the handle was released
+            // 0 (end of input) and EAGAIN (no input, or the copy is full) are the splice's to tell
+        }
+        ssize_t n = splice(r->in, NULL, r->out, NULL, r->pending ? r->pending : RELAY_CHUNK,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            stat_add(&lib_stats.relay_bytes, n);
+            if (r->pending) r->pending -= (size_t)n;
+            else if (r->copy >= 0) stat_add(&lib_stats.relay_dropped, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) {
+            int avail = 0;
+            if (ioctl(r->in, FIONREAD, &avail) == 0 && avail > 0) relay_stall(id, r); // out is full
+            return;
+        }
+        // end of input, or stage i+1 is gone (EPIPE): closing our ends passes that on
+        relay_close(id);
+        return;
+    }
+}
+
+#define PW_PIPELINE_MONITOR 0x1 // relay the links and read each stage's stdout as a copy (above)
+
+// One link's fds: [0] stage i's stdout, [1] stage i+1's stdin; with a monitor [2..4] the
+// relay's in, out and copy. All -1 once handed on.
+#define LINK_FDS 5
+
+static void close_fds(int* fds, int n) {
+    for (int i = 0; i < n; ++i) {
+        if (fds[i] >= 0) close(fds[i]);
+        fds[i] = -1;
+    }
+}
+
+// Make link i (stage i to i+1): one pipe, or with a monitor the three a relay joins.
+static int link_open(launch* ls, int i, int monitor, int* fds) {
+    int a[2], b[2], m[2];
+    if (pipe2(a, O_CLOEXEC) == -1) return -1;
+    pipe_resize(a[0], ls[i].o.pipe_size);
+    if (!monitor) {
+        fds[0] = a[1];
+        fds[1] = a[0];
+        return 0;
+    }
+    fds[0] = a[1];
+    fds[2] = a[0];
+    if (pipe2(b, O_CLOEXEC) == -1) return -1;
+    fds[1] = b[0];
+    fds[3] = b[1];
+    pipe_resize(b[0], ls[i + 1].o.pipe_size);
+    if (make_pipe(m) == -1) return -1;
+    ls[i].stdout_copy = m[0]; // launch_open resizes it as stage i's stdout
+    fds[4] = m[1];
+    if (set_nonblocking(a[0]) == -1 || set_nonblocking(b[1]) == -1 || set_nonblocking(m[1]) == -1) return -1;
+    if (relay_add(a[0], b[1], m[1]) == -1) return -1;
+    fds[2] = fds[3] = fds[4] = -1;
     return 0;
 }
+
+// start_pipeline: start count stages (pw_spawn_opts back to back, each stages->size
+// bytes, as for start_processes), stage i's stdout feeding stage i+1's stdin. Only stage
+// 0 may take PW_START_STDIN; every stage but the last needs PW_OUT_PIPE stdout, which
+// (without PW_PIPELINE_MONITOR) then reads as EOF through its handle. All stages share
+// one new process group, so signal_process(handle, sig, 1) on any of them reaches the
+// whole pipeline, while each handle keeps its own exit code. Nothing runs unless every
+// stage starts. Returns 0 with handles[0..count) set, or -1 with errno set (EINVAL for
+// options a pipeline cannot take, ENOSYS for a monitor without the event loop).
+__attribute__((visibility("default")))
+int start_pipeline(int count, const pw_spawn_opts* stages, int flags, int* handles) {
+    if (count <= 0 || !stages || !handles || stages->size < PW_SPAWN_OPTS_MIN_SIZE || (flags & ~PW_PIPELINE_MONITOR))
+        return start_failed(EINVAL);
+    int monitor = flags & PW_PIPELINE_MONITOR;
+    if (monitor && loop_start() != 0) return start_failed(ENOSYS);
+    launch* ls = malloc(sizeof(launch) * (size_t)count);
+    int* links = malloc(sizeof(int) * LINK_FDS * (size_t)count);
+    if (!ls || !links) {
+        free(ls);
+        free(links);
+        return start_failed(ENOMEM);
+    }
+    for (int i = 0; i < LINK_FDS * count; ++i) links[i] = -1;
+    size_t stride = (size_t)stages->size;
+    int traced = trace_begin("pw:start_pipeline");
+
+    int parsed = 0, err = 0;
+    while (!err && parsed < count) {
+        const pw_spawn_opts* spec = (const pw_spawn_opts*)((const char*)stages + stride * (size_t)parsed);
+        launch* l = &ls[parsed];
+        if (launch_parse(l, spec) == -1) { err = errno; break; }
+        int bad = l->o.flags & PW_START_NEW_SESSION;
+        if (parsed > 0) bad |= l->o.flags & PW_START_STDIN;
+        if (parsed < count - 1) bad |= l->o.out.kind != PW_OUT_PIPE;
+        if (bad) err = EINVAL;
+        // the helper expects a stdin fd whenever one comes along
+        if (parsed > 0) l->o.flags |= PW_START_STDIN;
+        l->o.flags &= ~PW_START_NEW_PGROUP;
+        parsed++;
+    }
+    if (!err && slots_reserve(ls, count, NULL) < count) err = EAGAIN; // every handle slot is taken
+    for (int i = 0; !err && i < count - 1; ++i) {
+        int* fds = &links[LINK_FDS * i];
+        if (link_open(ls, i, monitor, fds) == -1) { err = errno; break; }
+        ls[i].stdout_to = fds[0];
+        ls[i + 1].stdin_from = fds[1];
+        fds[0] = fds[1] = -1;
+    }
+    for (int i = 0; !err && i < count; ++i) {
+        if (launch_open(&ls[i]) == -1) err = errno;
+    }
+
+    int backend = get_spawn_backend();
+    // held until every stage is published, as in launch_run
+    int locked = !err && backend == PW_SPAWN_SERVER;
+    if (locked) pthread_mutex_lock(&server_mutex);
+    // The last stage goes first and leads the group. It reads a link we still hold open,
+    // so unlike stage 0 it cannot have exited (and been reaped by the helper) before the
+    // rest join, short of ignoring its stdin: then the stragglers stay in our group.
+    launch* lead = &ls[count - 1];
+    lead->o.flags |= PW_START_NEW_PGROUP;
+    int spawned = 0;
+    while (!err && spawned < count) {
+        launch* l = spawned == 0 ? lead : &ls[spawned - 1];
+        l->cs.pgid = spawned == 0 ? 0 : lead->pid;
+        int rc = launch_spawn(l, backend);
+        if (rc == -1 && errno == EPERM && l->cs.pgid) { // the group is gone already
+            l->cs.pgid = 0;
+            rc = launch_spawn(l, backend);
+        }
+        if (rc == -1) err = errno;
+        else spawned++;
+    }
+    if (!err) {
+        for (int i = 0; i < count; ++i) handles[i] = launch_publish(&ls[i]);
+    } else if (spawned > 0) {
+        // the group is whole only if every setpgid took, so kill each stage as well
+        kill(-lead->pid, SIGKILL);
+        for (int k = 0; k < spawned; ++k) {
+            launch* l = k == 0 ? lead : &ls[k - 1];
+            kill(l->pid, SIGKILL);
+            if (l->backend == PW_SPAWN_SERVER) continue; // the helper reaps those
+            while (waitpid(l->pid, NULL, 0) == -1 && errno == EINTR) {}
+        }
+    }
+    if (locked) pthread_mutex_unlock(&server_mutex);
+
+    if (err) {
+        // a registered relay sees its ends close with these and lets go of its own
+        for (int i = 0; i < parsed; ++i) launch_fail(&ls[i]);
+        close_fds(links, LINK_FDS * count);
+    } else {
+        for (int i = 0; i < count; ++i) {
+            reaper_watch(handles[i]);
+            stat_time(&lib_stats.spawn, now_ns() - ls[i].call_begin);
+        }
+    }
+    free(ls);
+    free(links);
+    trace_end(traced);
+    return err ? start_failed(err) : 0;
+}
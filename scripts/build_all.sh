@@ -7,6 +7,7 @@ SRC_DIR="${ROOT_DIR}/native"
 OUT_DIR="${ROOT_DIR}/artifacts"
 MAUI_LIBS_ROOT="${ROOT_DIR}/scripts/maui-output/Platforms/Android/NativeLibraries"
 RID_OUT_ROOT="${ROOT_DIR}/runtimes"   # where .NET will auto-load from
+BENCH_OUT_ROOT="${OUT_DIR}/bench"     # procwrapper_bench + its libprocwrapper.so, per ABI
 
 ANDROID_ABIS=("arm64-v8a" "armeabi-v7a")
 API_LEVEL="${ANDROID_API_LEVEL:-21}"
@@ -30,6 +31,20 @@ detect_ndk() {
   return 1
 }
 
+# Stage procwrapper_bench next to its library so the directory can be run (or adb pushed) as is.
+stage_bench() {
+  local name="$1" install_dir="$2" so="$3"
+  local bench
+  bench="$(find "$install_dir" -maxdepth 1 -name 'procwrapper_bench' -print -quit || true)"
+  if [[ -z "$bench" ]]; then
+    echo "ℹ️  procwrapper_bench not built for $name."
+    return 0
+  fi
+  mkdir -p "$BENCH_OUT_ROOT/$name"
+  cp "$bench" "$so" "$BENCH_OUT_ROOT/$name/"
+  echo "⏱  $name bench → $BENCH_OUT_ROOT/$name/procwrapper_bench"
+}
+
 ### CLEAN ###############################################################
 rm -rf "$OUT_DIR"
 mkdir -p "$OUT_DIR" "$MAUI_LIBS_ROOT" "$RID_OUT_ROOT"
@@ -47,7 +62,8 @@ mkdir -p "$HOST64_BUILD" "$HOST64_INSTALL"
 
 cmake -S "$SRC_DIR" -B "$HOST64_BUILD" \
   -D CMAKE_BUILD_TYPE=Release \
-  -D CMAKE_LIBRARY_OUTPUT_DIRECTORY="$HOST64_INSTALL"
+  -D CMAKE_LIBRARY_OUTPUT_DIRECTORY="$HOST64_INSTALL" \
+  -D CMAKE_RUNTIME_OUTPUT_DIRECTORY="$HOST64_INSTALL"
 
 cmake --build "$HOST64_BUILD" --config Release -- -j"$(nproc)"
 
@@ -61,6 +77,7 @@ RID64_DIR="$RID_OUT_ROOT/linux-x64/native"
 mkdir -p "$RID64_DIR"
 cp -v "$HOST64_SO" "$RID64_DIR/libprocwrapper.so"
 echo "✅ linux-x64 → $RID64_DIR/libprocwrapper.so"
+stage_bench "linux-x64" "$HOST64_INSTALL" "$HOST64_SO"
 echo
 
 ### HOST BUILD: linux-x86 (optional) ####################################
@@ -76,8 +93,8 @@ if command -v gcc >/dev/null 2>&1 && gcc -m32 -v >/dev/null 2>&1; then
     -D CMAKE_C_FLAGS="-m32" \
     -D CMAKE_EXE_LINKER_FLAGS="-m32" \
     -D CMAKE_SHARED_LINKER_FLAGS="-m32" \
-    -D CMAKE_LIBRARY_OUTPUT_DIRECTORY="$HOST86_INSTALL"
-
+    -D CMAKE_LIBRARY_OUTPUT_DIRECTORY="$HOST86_INSTALL" \
+    -D CMAKE_RUNTIME_OUTPUT_DIRECTORY="$HOST86_INSTALL" &&
   cmake --build "$HOST86_BUILD" --config Release -- -j"$(nproc)" || {
     echo "⚠️  linux-x86 build failed (likely missing 32-bit dev libs). Skipping."
   }
@@ -88,6 +105,7 @@ if command -v gcc >/dev/null 2>&1 && gcc -m32 -v >/dev/null 2>&1; then
     mkdir -p "$RID86_DIR"
     cp -v "$HOST86_SO" "$RID86_DIR/libprocwrapper.so"
     echo "✅ linux-x86 → $RID86_DIR/libprocwrapper.so"
+    stage_bench "linux-x86" "$HOST86_INSTALL" "$HOST86_SO"
   else
     echo "ℹ️  linux-x86 artifact not produced."
   fi
@@ -112,7 +130,8 @@ if NDK="$(detect_ndk)"; then
       -D ANDROID_PLATFORM="android-${API_LEVEL}" \
       -D ANDROID_STL="c++_static" \
       -D CMAKE_BUILD_TYPE=Release \
-      -D CMAKE_LIBRARY_OUTPUT_DIRECTORY="$A_INSTALL"
+      -D CMAKE_LIBRARY_OUTPUT_DIRECTORY="$A_INSTALL" \
+      -D CMAKE_RUNTIME_OUTPUT_DIRECTORY="$A_INSTALL"
 
     cmake --build "$A_BUILD" --config Release -- -j"$(nproc)"
 
@@ -126,6 +145,7 @@ if NDK="$(detect_ndk)"; then
     mkdir -p "$DEST_DIR"
     cp -v "$A_SO" "$DEST_DIR/libprocwrapper.so"
     echo "✅ $ABI → $DEST_DIR/libprocwrapper.so"
+    stage_bench "$ABI" "$A_INSTALL" "$A_SO"
     echo
   done
 else
@@ -135,4 +155,7 @@ fi
 echo "🎉 Done."
 echo "   Host libs placed under: $RID_OUT_ROOT/{linux-x64,linux-x86}/native/libprocwrapper.so"
 echo "   Android libs placed under: $MAUI_LIBS_ROOT/{arm64-v8a,armeabi-v7a}/libprocwrapper.so"
+echo "   Benchmarks placed under: $BENCH_OUT_ROOT/<abi>/procwrapper_bench"
+echo "   On device: adb push $BENCH_OUT_ROOT/arm64-v8a /data/local/tmp/pwbench &&"
+echo "              adb shell 'cd /data/local/tmp/pwbench && LD_LIBRARY_PATH=. ./procwrapper_bench --backend all'"
 